@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+#
+# ApsBikeComp (ABC) - create a FAT32 SD card image for the host simulation
+#
+# Petit FatFs can neither create files nor extend them, so the track files
+# the firmware is going to write must already exist (and be big enough).
+# This formats a blank image and pre-allocates the requested files as
+# contiguous, zero filled, cluster chains.
+#
+#   mkimage.py [-s MiB] [-c spc] [--nmea capture] [--track-size KiB]
+#              image [FILE[:KiB] ...]
+#
+# With --nmea the track file name the firmware will open is worked out from
+# the first valid $GPRMC sentence in the capture.
+#
+
+import argparse, calendar, struct, sys
+
+SECTOR = 512
+RSVD   = 32
+NFATS  = 2
+EOC    = 0x0FFFFFFF
+
+def fat_name ( name ):
+  base, _, ext = name.upper().lstrip('/').partition('.')
+  if not base or len(base) > 8 or len(ext) > 3:
+    raise ValueError('%s is not an 8.3 name' % name)
+  return (base.ljust(8) + ext.ljust(3)).encode('ascii')
+
+def nmea_track_name ( path ):
+  with open(path, 'rb') as fp:
+    for l in fp:
+      l = l.strip().decode('ascii', 'replace')
+      if not l.startswith('$') or '*' not in l: continue
+      body, _, csum = l[1:].partition('*')
+      x = 0
+      for c in body: x ^= ord(c)
+      try:
+        if x != int(csum[:2], 16): continue
+      except ValueError:
+        continue
+      f = body.split(',')
+      if f[0] not in ('GPRMC', 'GNRMC') or len(f) < 10 or f[2] != 'A': continue
+      t, d = f[1].split('.')[0], f[9]
+      tm = (2000 + int(d[4:6]), int(d[2:4]), int(d[0:2]),
+            int(t[0:2]), int(t[2:4]), int(t[4:6]))
+      return '%08X.TRK' % calendar.timegm(tm)
+  raise ValueError('%s: no valid $GPRMC/$GNRMC found' % path)
+
+def layout ( total, spc ):
+  fatsz = 1
+  while True:
+    clusters = (total - RSVD - NFATS * fatsz) // spc
+    need     = ((clusters + 2) * 4 + SECTOR - 1) // SECTOR
+    if need <= fatsz: return clusters, fatsz
+    fatsz = need
+
+def mkimage ( path, size, files, spc = 0 ):
+  total = size // SECTOR
+
+  # Largest cluster (up to 32KiB) that is still FAT32, like a real card
+  for s in ([spc] if spc else [64, 32, 16, 8, 4, 2, 1]):
+    clusters, fatsz = layout(total, s)
+    if clusters >= 65525: break
+  if clusters < 65525:
+    raise ValueError('image too small for FAT32')
+  spc  = s
+  csz  = spc * SECTOR
+  data = RSVD + NFATS * fatsz
+
+  # Allocate root directory then each file
+  fat     = [0x0FFFFFF8, EOC]
+  rootlen = ((len(files) + 1) * 32 + csz - 1) // csz
+  def alloc ( n ):
+    first = len(fat)
+    for i in range(n - 1): fat.append(first + i + 1)
+    fat.append(EOC)
+    return first
+  root = alloc(rootlen)
+  ents = [ b'ABC        ' + bytes([0x08]) + bytes(20) ]
+  for name, fsize in files:
+    clus = alloc(max(1, (fsize + csz - 1) // csz))
+    ents.append(fat_name(name) + struct.pack('<BBBHHHHHHHI',
+                0x20, 0, 0, 0, 0, 0, clus >> 16, 0, 0, clus & 0xFFFF, fsize))
+  if len(fat) - 2 > clusters:
+    raise ValueError('files do not fit in the image')
+
+  # Boot sector
+  bs = bytearray(SECTOR)
+  bs[0:3]  = b'\xEB\x58\x90'
+  bs[3:11] = b'ABCSIM  '
+  struct.pack_into('<HBHBHHBHHHII', bs, 11, SECTOR, spc, RSVD, NFATS, 0, 0,
+                   0xF8, 0, 63, 255, 0, total)
+  struct.pack_into('<IHHIHH', bs, 36, fatsz, 0, 0, root, 1, 6)
+  struct.pack_into('<BBBI', bs, 64, 0x80, 0, 0x29, 0xABC0ABC0)
+  bs[71:82]  = b'ABC        '
+  bs[82:90]  = b'FAT32   '
+  bs[510:512] = b'\x55\xAA'
+
+  # FS info
+  fi = bytearray(SECTOR)
+  struct.pack_into('<I', fi, 0, 0x41615252)
+  struct.pack_into('<III', fi, 484, 0x61417272, clusters - (len(fat) - 2),
+                   len(fat))
+  struct.pack_into('<I', fi, 508, 0xAA550000)
+
+  with open(path, 'wb') as fp:
+    fp.truncate(total * SECTOR)
+    for base in (0, 6):
+      fp.seek(base * SECTOR);       fp.write(bs)
+      fp.seek((base + 1) * SECTOR); fp.write(fi)
+    raw = struct.pack('<%dI' % len(fat), *fat)
+    for i in range(NFATS):
+      fp.seek((RSVD + i * fatsz) * SECTOR)
+      fp.write(raw)
+    fp.seek((data + (root - 2) * spc) * SECTOR)
+    fp.write(b''.join(ents))
+
+def main ():
+  ap = argparse.ArgumentParser(description='Create ABC simulation SD image')
+  ap.add_argument('-s', '--size', type=int, default=1024,
+                  help='image size in MiB (default 1024, sparse)')
+  ap.add_argument('-c', '--cluster', type=int, default=0,
+                  choices=[0, 1, 2, 4, 8, 16, 32, 64],
+                  help='sectors per cluster (default: largest possible)')
+  ap.add_argument('--nmea', help='pre-allocate the track for this capture')
+  ap.add_argument('--track-size', type=int, default=4096,
+                  help='track file size in KiB (default 4096)')
+  ap.add_argument('image')
+  ap.add_argument('files', nargs='*', help='NAME.EXT[:KiB]')
+  args = ap.parse_args()
+
+  files = []
+  try:
+    if args.nmea:
+      files.append((nmea_track_name(args.nmea), args.track_size * 1024))
+    for f in args.files:
+      name, _, kib = f.partition(':')
+      files.append((name, int(kib or args.track_size) * 1024))
+    mkimage(args.image, args.size << 20, files, args.cluster)
+  except ValueError as e:
+    sys.exit(str(e))
+  for name, size in files:
+    print('%s: %s (%d bytes)' % (args.image, name, size))
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,219 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Simulation - NMEA parser benchmark
+ *
+ * Runs every sentence of a capture through the parser, repeatedly, and
+ * reports the cost per sentence. Both the line interface (nmea_parse) and
+ * the streaming parser, fed in UART sized spans, are timed. The fixes are
+ * then re-encoded as UBX NAV-PVT and the same is done for the UBX parser:
+ *
+ *   abc-bench ride.nmea [repeat]
+ *
+ * Cycles are read from the TSC where there is one, so are host cycles, but
+ * the before/after ratio is what matters.
+ * ***************************************************************************/
+
+#include "sensors/gps/nmea.h"
+#include "sensors/gps/ubx.h"
+#include "hal/trace.h"
+#include "abc_misc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_cycles() __rdtsc()
+#else
+#define bench_cycles() 0ull
+#endif
+
+/*
+ * Bytes handed over per UART read
+ */
+#define BENCH_SPAN (64)
+
+/*
+ * Trace is not part of the benchmark
+ */
+void
+trace_printf ( const char *fmt, ... )
+{
+  (void)fmt;
+}
+
+/*
+ * Encode a fix as NAV-PVT
+ */
+static size_t
+bench_pvt ( uint8_t *buf, const gps_fix_s *f )
+{
+  uint8_t pl[UBX_MAX_PAYLOAD];
+  int32_t v[] = { f->fx_lon, f->fx_lat, 0, f->fx_alt };
+  size_t  i;
+
+  memset(pl, 0, sizeof(pl));
+  pl[0]  = (uint8_t)f->fx_ms;
+  pl[1]  = (uint8_t)(f->fx_ms >> 8);
+  pl[4]  = (uint8_t)(f->fx_tm.tm_year + 1900);
+  pl[5]  = (uint8_t)((f->fx_tm.tm_year + 1900) >> 8);
+  pl[6]  = (uint8_t)(f->fx_tm.tm_mon + 1);
+  pl[7]  = (uint8_t)f->fx_tm.tm_mday;
+  pl[8]  = (uint8_t)f->fx_tm.tm_hour;
+  pl[9]  = (uint8_t)f->fx_tm.tm_min;
+  pl[10] = (uint8_t)f->fx_tm.tm_sec;
+  pl[11] = 0x03;
+  pl[20] = 3;
+  pl[21] = f->fx_valid;
+  pl[23] = (uint8_t)f->fx_sats;
+  for (i = 0; i < ARRAY_SIZE(v); i++)
+    memcpy(pl + 24 + (i * 4), v + i, 4);
+  memcpy(pl + 60, &f->fx_speed, 4);
+  memcpy(pl + 64, &f->fx_course, 4);
+  return ubx_frame(buf, UBX_CLASS_NAV, UBX_NAV_PVT, pl, sizeof(pl));
+}
+
+static double
+bench_now ( void )
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int
+main ( int argc, char *argv[] )
+{
+  char   **lines = NULL, buf[128], *raw = NULL;
+  uint8_t *ubx = NULL;
+  size_t   n = 0, i, j, k, r, repeat, ok = 0, rawlen = 0, ubxlen = 0, fixes;
+  double   t;
+  unsigned long long c;
+  nmea_parser_s np;
+  nmea_type_t   type;
+  ubx_parser_s  up;
+  ubx_type_t    utype;
+  FILE    *fp;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s capture.nmea [repeat]\n", argv[0]);
+    return 1;
+  }
+  repeat = (argc > 2) ? strtoul(argv[2], NULL, 0) : 100;
+
+  /* Load */
+  if (NULL == (fp = fopen(argv[1], "r"))) {
+    perror(argv[1]);
+    return 1;
+  }
+  while (fgets(buf, sizeof(buf), fp)) {
+    buf[strcspn(buf, "\r\n")] = '\0';
+    lines        = realloc(lines, (n + 1) * sizeof(*lines));
+    lines[n++]   = strdup(buf);
+    raw          = realloc(raw, rawlen + strlen(buf) + 3);
+    rawlen      += (size_t)sprintf(raw + rawlen, "%s\r\n", buf);
+  }
+  fclose(fp);
+  if (0 == n) return 1;
+
+  /* Run */
+  nmea_init(&np);
+  t = bench_now();
+  c = bench_cycles();
+  for (r = 0; r < repeat; r++)
+    for (i = 0; i < n; i++)
+      ok += (NMEA_RMC == nmea_parse(&np, lines[i])) && np.np_fix.fx_valid;
+  c = bench_cycles() - c;
+  t = bench_now() - t;
+
+  printf("nmea: line   %zu sentences x %zu, %zu parsed, %.1f ns/sentence,"
+         " %.0f cycles/sentence\n",
+         n, repeat, ok / repeat, (t * 1e9) / (n * repeat),
+         (double)c / (n * repeat));
+
+  /* Run (streaming, as the UART hands it over) */
+  ok = 0;
+  nmea_init(&np);
+  t = bench_now();
+  c = bench_cycles();
+  for (r = 0; r < repeat; r++)
+    for (i = 0; i < rawlen; i += j) {
+      j = ((rawlen - i) < BENCH_SPAN) ? (rawlen - i) : BENCH_SPAN;
+      for (k = 0; k < j; ) {
+        k  += nmea_feed(&np, (const uint8_t*)raw + i + k, j - k, &type);
+        ok += (NMEA_RMC == type) && np.np_fix.fx_valid;
+      }
+    }
+  c = bench_cycles() - c;
+  t = bench_now() - t;
+
+  printf("nmea: stream %zu sentences x %zu, %zu parsed, %.1f ns/sentence,"
+         " %.0f cycles/sentence\n",
+         n, repeat, ok / repeat, (t * 1e9) / (n * repeat),
+         (double)c / (n * repeat));
+  fixes = ok / repeat;
+  if (0 == fixes) return 0;
+  printf("nmea: %.0f bytes/fix, %.0f cycles/fix\n",
+         (double)rawlen / fixes, (double)c / (fixes * repeat));
+
+  /* Same fixes as UBX */
+  nmea_init(&np);
+  for (i = 0; i < n; i++) {
+    if ((NMEA_RMC != nmea_parse(&np, lines[i])) || !np.np_fix.fx_valid)
+      continue;
+    ubx     = realloc(ubx, ubxlen + UBX_MAX_PAYLOAD + UBX_FRAME_OVERHEAD);
+    ubxlen += bench_pvt(ubx + ubxlen, &np.np_fix);
+  }
+
+  ok = 0;
+  ubx_init(&up);
+  t = bench_now();
+  c = bench_cycles();
+  for (r = 0; r < repeat; r++)
+    for (i = 0; i < ubxlen; i += j) {
+      j = ((ubxlen - i) < BENCH_SPAN) ? (ubxlen - i) : BENCH_SPAN;
+      for (k = 0; k < j; ) {
+        k  += ubx_feed(&up, ubx + i + k, j - k, &utype);
+        ok += (UBX_PVT == utype) && up.up_fix.fx_valid;
+      }
+    }
+  c = bench_cycles() - c;
+  t = bench_now() - t;
+
+  printf("ubx:  stream %zu NAV-PVT x %zu, %zu parsed, %.0f bytes/fix,"
+         " %.1f ns/fix, %.0f cycles/fix\n",
+         fixes, repeat, ok / repeat, (double)ubxlen / fixes,
+         (t * 1e9) / (fixes * repeat), (double)c / (fixes * repeat));
+
+  return 0;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
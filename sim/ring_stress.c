@@ -0,0 +1,210 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Simulation - SPSC ring stress test
+ *
+ * Runs a producer and a consumer thread flat out against one (small) ring,
+ * so that they are genuinely concurrent on a multi-core host, with random
+ * chunk sizes through all four interfaces (push/pop and the in place
+ * reserve/commit and peek/consume spans):
+ *
+ *   abc-stress [MiB] [ring size]
+ *
+ * The data is a sequence that does not repeat within the ring, the consumer
+ * checks every byte. What push could not queue is retried, so the stream
+ * has no gaps, and has to match the ring's overflow count. Exits non-zero
+ * on any mismatch.
+ * ***************************************************************************/
+
+#include "ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Test state
+ */
+typedef struct stress
+{
+  ring_s    s_ring;                     /**< The ring under test */
+  uint64_t  s_total;                    /**< Bytes to pass through */
+  uint64_t  s_refused;                  /**< Bytes push could not queue */
+  uint64_t  s_errors;                   /**< Bytes that did not match */
+  uint64_t  s_first;                    /**< Offset of the first mismatch */
+} stress_s;
+
+/*
+ * Byte n of the stream
+ */
+static inline uint8_t
+stress_byte ( uint64_t n )
+{
+  return (uint8_t)(n ^ (n >> 8) ^ (n >> 16) ^ (n >> 24));
+}
+
+/*
+ * Random chunk size (1..max), per thread state
+ */
+static inline size_t
+stress_len ( uint32_t *seed, size_t max )
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return 1 + (*seed % max);
+}
+
+static void *
+stress_producer ( void *p )
+{
+  stress_s *st   = p;
+  ring_s   *r    = &st->s_ring;
+  uint64_t  n    = 0;
+  uint32_t  seed = 0x12345678;
+  size_t    len, c, i, max = 2 * (r->r_mask + 1);
+  uint8_t   buf[2 * 65536], *w;
+
+  while (n < st->s_total) {
+    len = stress_len(&seed, max);
+    if (len > st->s_total - n) len = (size_t)(st->s_total - n);
+
+    /* Bulk push (retrying what did not fit) */
+    if (seed & 0x100) {
+      for (i = 0; i < len; i++) buf[i] = stress_byte(n + i);
+      c = ring_push(r, buf, len);
+      st->s_refused += len - c;
+
+    /* In place */
+    } else {
+      c = ring_reserve(r, &w);
+      if (c > len) c = len;
+      for (i = 0; i < c; i++) w[i] = stress_byte(n + i);
+      ring_commit(r, c);
+    }
+    n += c;
+    if (0 == c) sched_yield();
+  }
+
+  return NULL;
+}
+
+static void *
+stress_consumer ( void *p )
+{
+  stress_s      *st   = p;
+  ring_s        *r    = &st->s_ring;
+  uint64_t       n    = 0;
+  uint32_t       seed = 0x87654321;
+  size_t         len, c, i, max = 2 * (r->r_mask + 1);
+  uint8_t        buf[2 * 65536];
+  const uint8_t *d;
+
+  while (n < st->s_total) {
+    len = stress_len(&seed, max);
+
+    /* Bulk pop */
+    if (seed & 0x100) {
+      c = ring_pop(r, buf, len);
+      d = buf;
+
+    /* In place */
+    } else {
+      c = ring_peek(r, &d);
+      if (c > len) c = len;
+    }
+
+    for (i = 0; i < c; i++) {
+      if (d[i] != stress_byte(n + i)) {
+        if (0 == st->s_errors) st->s_first = n + i;
+        ++st->s_errors;
+      }
+    }
+    if (!(seed & 0x100)) ring_consume(r, c);
+    n += c;
+    if (0 == c) sched_yield();
+  }
+
+  return NULL;
+}
+
+static double
+stress_now ( void )
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+int
+main ( int argc, char *argv[] )
+{
+  static uint8_t storage[65536];
+  stress_s  st = { .s_total = 0 };
+  pthread_t pt, ct;
+  size_t    size;
+  double    t;
+  int       ok;
+
+  st.s_total = ((argc > 1) ? strtoull(argv[1], NULL, 0) : 16) << 20;
+  size       = (argc > 2) ? strtoul(argv[2], NULL, 0) : 64;
+  if ((size > sizeof(storage)) ||
+      !ring_init(&st.s_ring, storage, size)) {
+    fprintf(stderr, "ring size must be a power of 2, up to %zu\n",
+            sizeof(storage));
+    return 1;
+  }
+
+  t = stress_now();
+  pthread_create(&ct, NULL, stress_consumer, &st);
+  pthread_create(&pt, NULL, stress_producer, &st);
+  pthread_join(pt, NULL);
+  pthread_join(ct, NULL);
+  t = stress_now() - t;
+
+  ok = (0 == st.s_errors) && (0 == ring_used(&st.s_ring)) &&
+       (st.s_refused == st.s_ring.r_overflow) &&
+       (st.s_ring.r_peak <= size);
+  printf("ring %zu: %llu MiB in %.2fs (%.0f MiB/s), peak %lu, "
+         "overflow %lu (%s), %llu errors",
+         size, (unsigned long long)(st.s_total >> 20), t,
+         (st.s_total >> 20) / t, (unsigned long)st.s_ring.r_peak,
+         (unsigned long)st.s_ring.r_overflow,
+         (st.s_refused == st.s_ring.r_overflow) ? "matches" : "MISMATCH",
+         (unsigned long long)st.s_errors);
+  if (st.s_errors)
+    printf(" (first at %llu)", (unsigned long long)st.s_first);
+  printf(" - %s\n", ok ? "ok" : "FAILED");
+
+  return ok ? 0 : 1;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,853 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Simulation - Track converter
+ *
+ * Converts track files from the card to GPX, CSV or FIT:
+ *
+ *   abc-track [-f gpx|csv|fit] [-o output] [-j jobs] input...
+ *
+ * The compressed binary format (storage/track.h, and its uncompressed
+ * version 1) and the JSON lines written by older firmware are all read.
+ * The input is memory mapped and decoded in one pass. With a single input
+ * file the output goes to -o (or stdout, also "-o -"). Given several
+ * inputs, or a directory (e.g. the mounted card, all *.TRK files in it),
+ * each is converted to a file of the same name with the new extension,
+ * beside the input or in the -o directory, spread over -j threads
+ * (default: one per core).
+ * ***************************************************************************/
+
+#define _GNU_SOURCE
+#include "storage/track.h"
+#include "sensors/gps/nmea.h"
+#include "abc_misc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Output buffer (per file)
+ */
+#define TOOL_OUTBUF     (1 << 20)
+
+/*
+ * FIT epoch (1989-12-31 00:00:00 UTC) in Unix time
+ */
+#define FIT_EPOCH       (631065600)
+
+/*
+ * Decoded point
+ */
+typedef struct tool_point
+{
+  int64_t tp_ms;                        /**< UTC, ms since 1970 */
+  coord_t tp_lat;                       /**< Latitude */
+  coord_t tp_lon;                       /**< Longitude */
+} tool_point_s;
+
+typedef struct tool_track
+{
+  tool_point_s *tt_pts;                 /**< Points */
+  size_t        tt_num;                 /**< Points used */
+  size_t        tt_max;                 /**< Points allocated */
+} tool_track_s;
+
+/*
+ * Output formats
+ */
+typedef void (*tool_writer)( FILE *fp, const tool_track_s *tt );
+
+typedef struct tool_format
+{
+  const char  *tf_name;                 /**< Name (and file extension) */
+  tool_writer  tf_write;                /**< Writer */
+} tool_format_s;
+
+/*
+ * Batch job
+ */
+typedef struct tool_job
+{
+  char *tj_in;                          /**< Input path */
+  char *tj_out;                         /**< Output path */
+} tool_job_s;
+
+typedef struct tool_batch
+{
+  tool_job_s          *tb_jobs;         /**< Jobs */
+  size_t               tb_num;          /**< Number of jobs */
+  size_t               tb_next;         /**< Next job to run */
+  size_t               tb_failed;       /**< Jobs that failed */
+  const tool_format_s *tb_fmt;          /**< Output format */
+} tool_batch_s;
+
+/* ****************************************************************************
+ * Decoding
+ * ***************************************************************************/
+
+static tool_point_s *
+tool_add ( tool_track_s *tt )
+{
+  if (tt->tt_num == tt->tt_max) {
+    tt->tt_max = tt->tt_max ? (tt->tt_max * 2) : 4096;
+    tt->tt_pts = realloc(tt->tt_pts, tt->tt_max * sizeof(*tt->tt_pts));
+    if (NULL == tt->tt_pts) abort();
+  }
+  return tt->tt_pts + tt->tt_num++;
+}
+
+/*
+ * LEB128 varint
+ *
+ * @return false if truncated
+ */
+static inline bool
+tool_uvarint ( const uint8_t **p, const uint8_t *end, uint32_t *v )
+{
+  uint32_t r = 0;
+  unsigned s = 0;
+
+  while (*p < end) {
+    r |= (uint32_t)(**p & 0x7F) << s;
+    if (!(*(*p)++ & 0x80)) {
+      *v = r;
+      return true;
+    }
+    if ((s += 7) > 28) break;
+  }
+  return false;
+}
+
+static inline bool
+tool_svarint ( const uint8_t **p, const uint8_t *end, int32_t *v )
+{
+  uint32_t u;
+
+  if (!tool_uvarint(p, end, &u)) return false;
+  *v = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+  return true;
+}
+
+static void
+tool_emit ( tool_track_s *tt, int64_t ms, coord_t lat, coord_t lon )
+{
+  tool_point_s *tp = tool_add(tt);
+
+  tp->tp_ms  = ms;
+  tp->tp_lat = lat;
+  tp->tp_lon = lon;
+}
+
+static inline uint32_t
+tool_u32 ( const uint8_t *b )
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+/*
+ * Version 1, LEB128 varint deltas up to the zero padding
+ */
+static bool
+tool_decode_v1
+  ( const char *path, const uint8_t *d, size_t len, tool_track_s *tt )
+{
+  const uint8_t *p, *end = d + len;
+  uint32_t       dt;
+  int32_t        dlat, dlon;
+  int64_t        ms = tool_u32(d + 8) * 1000ll;
+  coord_t        lat = 0, lon = 0;
+
+  for (p = d + d[5]; (p < end) && *p; ) {
+    if (!tool_uvarint(&p, end, &dt)   ||
+        !tool_svarint(&p, end, &dlat) ||
+        !tool_svarint(&p, end, &dlon)) {
+      fprintf(stderr, "%s: truncated record at %zu\n", path,
+              (size_t)(p - d));
+      break;
+    }
+    ms  += dt;
+    lat += dlat;
+    lon += dlon;
+    tool_emit(tt, ms, lat, lon);
+  }
+  return true;
+}
+
+/*
+ * Bit reader (MSB first)
+ */
+typedef struct tool_bits
+{
+  const uint8_t *tb_buf;                /**< Data */
+  size_t         tb_pos;                /**< Next bit */
+  size_t         tb_end;                /**< End bit */
+} tool_bits_s;
+
+static inline bool
+tool_bits ( tool_bits_s *br, unsigned n, uint32_t *v )
+{
+  uint32_t r = 0;
+
+  if ((br->tb_pos + n) > br->tb_end) return false;
+  while (n--) {
+    r = (r << 1) |
+        ((br->tb_buf[br->tb_pos >> 3] >> (7 - (br->tb_pos & 7))) & 1);
+    ++br->tb_pos;
+  }
+  *v = r;
+  return true;
+}
+
+static inline unsigned
+tool_bitlen ( uint32_t v )
+{
+  return v ? (32u - (unsigned)__builtin_clz(v)) : 0;
+}
+
+/*
+ * Rice code (see storage/track.h)
+ */
+static bool
+tool_rice ( tool_bits_s *br, uint32_t *mean, uint32_t *v )
+{
+  unsigned k = tool_bitlen(*mean >> 3), q;
+  uint32_t b, r;
+
+  for (q = 0; q < TRACK_RICE_ESC; q++) {
+    if (!tool_bits(br, 1, &b)) return false;
+    if (!b) break;
+  }
+  if (q < TRACK_RICE_ESC) {
+    if (!tool_bits(br, k, &r)) return false;
+    r |= q << k;
+  } else {
+    if (!tool_bits(br, 5, &b))     return false;
+    if (!tool_bits(br, b + 1, &r)) return false;
+  }
+  *mean += ((r > 0xFFFF) ? 0xFFFF : r) - (*mean >> 3);
+  *v     = r;
+  return true;
+}
+
+/*
+ * Version 2, a Rice coded frame per sector
+ */
+static bool
+tool_decode_v2
+  ( const char *path, const uint8_t *d, size_t len, tool_track_s *tt )
+{
+  const uint8_t *s;
+  tool_bits_s    br;
+  int64_t        base = tool_u32(d + 8) * 1000ll;
+  int32_t        last[TRACK_F_MAX], delta[TRACK_F_MAX];
+  uint32_t       mean[TRACK_F_MAX], z;
+  size_t         sec, off, slen;
+  unsigned       count, i;
+  int            f;
+
+  for (sec = 0; (sec * TRACK_SECTOR) < len; sec++) {
+    s    = d + (sec * TRACK_SECTOR);
+    slen = len - (sec * TRACK_SECTOR);
+    if (slen > TRACK_SECTOR) slen = TRACK_SECTOR;
+    off  = sec ? 0 : d[5];
+
+    /* Frame header */
+    if (slen < (off + TRACK_FRAME_LEN)) {
+      fprintf(stderr, "%s: truncated frame at %zu\n", path,
+              sec * TRACK_SECTOR);
+      break;
+    }
+    if (0 == (count = s[off] | (s[off + 1] << 8))) break;
+    for (f = 0; f < TRACK_F_MAX; f++) {
+      last[f]  = (int32_t)tool_u32(s + off + 2 + (f * 4));
+      delta[f] = 0;
+      mean[f]  = 0;
+    }
+    tool_emit(tt, base + (uint32_t)last[TRACK_F_TIME],
+              last[TRACK_F_LAT], last[TRACK_F_LON]);
+
+    /* Records */
+    br.tb_buf = s;
+    br.tb_pos = (off + TRACK_FRAME_LEN) * 8;
+    br.tb_end = slen * 8;
+    for (i = 1; i < count; i++) {
+      for (f = 0; f < TRACK_F_MAX; f++) {
+        if (!tool_rice(&br, mean + f, &z)) break;
+        delta[f] += (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+        last[f]  += delta[f];
+      }
+      if (f < TRACK_F_MAX) {
+        fprintf(stderr, "%s: frame at %zu truncated after %u records\n",
+                path, sec * TRACK_SECTOR, i);
+        break;
+      }
+      tool_emit(tt, base + (uint32_t)last[TRACK_F_TIME],
+                last[TRACK_F_LAT], last[TRACK_F_LON]);
+    }
+  }
+  return true;
+}
+
+/*
+ * Packed binary
+ */
+static bool
+tool_decode_bin
+  ( const char *path, const uint8_t *d, size_t len, tool_track_s *tt )
+{
+  if ((len < TRACK_HDR_LEN) || (d[5] < TRACK_HDR_LEN) || (d[5] > len)) {
+    fprintf(stderr, "%s: bad header\n", path);
+    return false;
+  }
+  switch (d[4]) {
+    case 1:
+      return tool_decode_v1(path, d, len, tt);
+    case 2:
+      return tool_decode_v2(path, d, len, tt);
+    default:
+      fprintf(stderr, "%s: unsupported version %d\n", path, d[4]);
+      return false;
+  }
+}
+
+/*
+ * Fixed-point number (value * 10^dp), bounded by end
+ */
+static bool
+tool_number ( const char *p, const char *end, int dp, int64_t *v )
+{
+  int64_t r = 0;
+  bool    neg = false, frac = false, any = false;
+
+  while ((p < end) && ((' ' == *p) || (':' == *p))) ++p;
+  if ((p < end) && ('-' == *p)) {
+    neg = true;
+    ++p;
+  }
+  for (; p < end; ++p) {
+    if (('.' == *p) && !frac) {
+      frac = true;
+    } else if ((*p >= '0') && (*p <= '9')) {
+      any = true;
+      if (frac && (0 == dp)) continue;
+      r = (r * 10) + (*p - '0');
+      if (frac) --dp;
+    } else {
+      break;
+    }
+  }
+  for (; dp > 0; --dp) r *= 10;
+  *v = neg ? -r : r;
+  return any;
+}
+
+/*
+ * Value of "key" within a line
+ */
+static bool
+tool_json
+  ( const char *l, const char *end, const char *key, int dp, int64_t *v )
+{
+  const char *p = memmem(l, (size_t)(end - l), key, strlen(key));
+
+  if (NULL == p) return false;
+  return tool_number(p + strlen(key), end, dp, v);
+}
+
+/*
+ * JSON lines ({ "time" : s, "latitude" : deg, "longitude" : deg })
+ */
+static bool
+tool_decode_json
+  ( const char *path, const uint8_t *d, size_t len, tool_track_s *tt )
+{
+  const char   *l = (const char*)d, *end = l + len, *e, *z;
+  tool_point_s *tp;
+  int64_t       t, lat, lon;
+  size_t        bad = 0;
+
+  /* Up to the zero padding */
+  if (NULL != (z = memchr(l, '\0', len))) end = z;
+
+  for (; l < end; l = e + 1) {
+    if (NULL == (e = memchr(l, '\n', (size_t)(end - l)))) e = end;
+    if (e == l) continue;
+    if (!tool_json(l, e, "\"time\"",      0, &t)   ||
+        !tool_json(l, e, "\"latitude\"",  7, &lat) ||
+        !tool_json(l, e, "\"longitude\"", 7, &lon)) {
+      ++bad;
+      continue;
+    }
+    tp = tool_add(tt);
+    tp->tp_ms  = t * 1000;
+    tp->tp_lat = (coord_t)lat;
+    tp->tp_lon = (coord_t)lon;
+  }
+  if (bad)
+    fprintf(stderr, "%s: %zu lines not understood\n", path, bad);
+  return (0 != tt->tt_num) || (0 == bad);
+}
+
+/* ****************************************************************************
+ * Output
+ * ***************************************************************************/
+
+/*
+ * ISO 8601 UTC time (with ms), the date and time is only reformatted when
+ * the second changes
+ */
+typedef struct tool_clock
+{
+  time_t tc_sec;                        /**< Second formatted in tc_str */
+  char   tc_str[80];                    /**< Formatted time */
+} tool_clock_s;
+
+static const char *
+tool_time ( tool_clock_s *tc, int64_t ms )
+{
+  time_t    s = (time_t)(ms / 1000);
+  unsigned  f = (unsigned)(ms % 1000);
+  struct tm tm;
+  char     *p;
+
+  if ((s != tc->tc_sec) || !tc->tc_str[0]) {
+    gmtime_r(&s, &tm);
+    snprintf(tc->tc_str, sizeof(tc->tc_str),
+             "%04d-%02d-%02dT%02d:%02d:%02d.000Z",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec);
+    tc->tc_sec = s;
+  }
+  p    = tc->tc_str + strlen(tc->tc_str) - 4;
+  p[0] = (char)('0' + (f / 100));
+  p[1] = (char)('0' + ((f / 10) % 10));
+  p[2] = (char)('0' + (f % 10));
+  return tc->tc_str;
+}
+
+static void
+tool_write_gpx ( FILE *fp, const tool_track_s *tt )
+{
+  char         lat[NMEA_COORD_STRLEN], lon[NMEA_COORD_STRLEN];
+  tool_clock_s tc = { 0, "" };
+  size_t       i;
+
+  fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<gpx version=\"1.1\" creator=\"abc-track\""
+        " xmlns=\"http://www.topografix.com/GPX/1/1\">\n"
+        " <trk>\n  <trkseg>\n", fp);
+  for (i = 0; i < tt->tt_num; i++) {
+    nmea_coord_str(lat, tt->tt_pts[i].tp_lat);
+    nmea_coord_str(lon, tt->tt_pts[i].tp_lon);
+    fprintf(fp, "   <trkpt lat=\"%s\" lon=\"%s\"><time>%s</time></trkpt>\n",
+            lat, lon, tool_time(&tc, tt->tt_pts[i].tp_ms));
+  }
+  fputs("  </trkseg>\n </trk>\n</gpx>\n", fp);
+}
+
+static void
+tool_write_csv ( FILE *fp, const tool_track_s *tt )
+{
+  char         lat[NMEA_COORD_STRLEN], lon[NMEA_COORD_STRLEN];
+  tool_clock_s tc = { 0, "" };
+  size_t       i;
+
+  fputs("time,latitude,longitude\n", fp);
+  for (i = 0; i < tt->tt_num; i++) {
+    nmea_coord_str(lat, tt->tt_pts[i].tp_lat);
+    nmea_coord_str(lon, tt->tt_pts[i].tp_lon);
+    fprintf(fp, "%s,%s,%s\n", tool_time(&tc, tt->tt_pts[i].tp_ms), lat, lon);
+  }
+}
+
+/*
+ * FIT CRC-16
+ */
+static uint16_t
+fit_crc ( uint16_t crc, const uint8_t *b, size_t len )
+{
+  static const uint16_t tbl[16] = {
+    0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+    0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400,
+  };
+  uint16_t t;
+
+  while (len--) {
+    t   = tbl[crc & 0xF];
+    crc = ((crc >> 4) & 0x0FFF) ^ t ^ tbl[*b & 0xF];
+    t   = tbl[crc & 0xF];
+    crc = ((crc >> 4) & 0x0FFF) ^ t ^ tbl[(*b++ >> 4) & 0xF];
+  }
+  return crc;
+}
+
+static inline uint8_t *
+fit_u16 ( uint8_t *b, uint16_t v )
+{
+  *b++ = (uint8_t)v;
+  *b++ = (uint8_t)(v >> 8);
+  return b;
+}
+
+static inline uint8_t *
+fit_u32 ( uint8_t *b, uint32_t v )
+{
+  return fit_u16(fit_u16(b, (uint16_t)v), (uint16_t)(v >> 16));
+}
+
+/*
+ * 1e-7 degrees to semicircles (2^31 per 180 degrees)
+ */
+static inline uint32_t
+fit_semicircles ( coord_t c )
+{
+  return (uint32_t)(int32_t)(((int64_t)c << 31) / (180ll * COORD_SCALE));
+}
+
+/*
+ * FIT activity: file_id then a record message per point
+ */
+static void
+tool_write_fit ( FILE *fp, const tool_track_s *tt )
+{
+  static const uint8_t def_file_id[] = {
+    0x40, 0, 0, 0, 0, 3,                /* local 0, little endian, global 0 */
+    0, 1, 0x00,                         /* type (enum) */
+    1, 2, 0x84,                         /* manufacturer (uint16) */
+    4, 4, 0x86,                         /* time_created (uint32) */
+  };
+  static const uint8_t def_record[] = {
+    0x41, 0, 0, 20, 0, 3,               /* local 1, little endian, global 20 */
+    253, 4, 0x86,                       /* timestamp (uint32) */
+    0, 4, 0x85,                         /* position_lat (sint32) */
+    1, 4, 0x85,                         /* position_long (sint32) */
+  };
+  uint8_t *buf, *p;
+  size_t   data, i;
+  uint32_t created;
+
+  data = sizeof(def_file_id) + 8 + sizeof(def_record) + (13 * tt->tt_num);
+  if (NULL == (buf = malloc(14 + data + 2))) abort();
+  created = tt->tt_num ? (uint32_t)(tt->tt_pts[0].tp_ms / 1000 - FIT_EPOCH) : 0;
+
+  /* Header */
+  p    = buf;
+  *p++ = 14;
+  *p++ = 0x10;                          /* protocol 1.0 */
+  p    = fit_u16(p, 2093);              /* profile 20.93 */
+  p    = fit_u32(p, (uint32_t)data);
+  memcpy(p, ".FIT", 4);
+  p   += 4;
+  p    = fit_u16(p, fit_crc(0, buf, 12));
+
+  /* file_id: activity, development */
+  memcpy(p, def_file_id, sizeof(def_file_id));
+  p   += sizeof(def_file_id);
+  *p++ = 0x00;
+  *p++ = 4;
+  p    = fit_u16(p, 255);
+  p    = fit_u32(p, created);
+
+  /* Records */
+  memcpy(p, def_record, sizeof(def_record));
+  p   += sizeof(def_record);
+  for (i = 0; i < tt->tt_num; i++) {
+    *p++ = 0x01;
+    p    = fit_u32(p, (uint32_t)(tt->tt_pts[i].tp_ms / 1000 - FIT_EPOCH));
+    p    = fit_u32(p, fit_semicircles(tt->tt_pts[i].tp_lat));
+    p    = fit_u32(p, fit_semicircles(tt->tt_pts[i].tp_lon));
+  }
+  p = fit_u16(p, fit_crc(0, buf, (size_t)(p - buf)));
+
+  fwrite(buf, 1, (size_t)(p - buf), fp);
+  free(buf);
+}
+
+static const tool_format_s tool_formats[] = {
+  { "gpx", tool_write_gpx },
+  { "csv", tool_write_csv },
+  { "fit", tool_write_fit },
+};
+
+/* ****************************************************************************
+ * Conversion
+ * ***************************************************************************/
+
+/*
+ * Convert a single file (out NULL for stdout)
+ */
+static bool
+tool_convert ( const char *in, const char *out, const tool_format_s *fmt )
+{
+  tool_track_s tt = { NULL, 0, 0 };
+  struct stat  st;
+  uint8_t     *d = NULL;
+  char        *obuf;
+  FILE        *fp;
+  bool         ok;
+  int          fd;
+
+  /* Map */
+  if (0 > (fd = open(in, O_RDONLY))) {
+    perror(in);
+    return false;
+  }
+  if (0 > fstat(fd, &st)) {
+    perror(in);
+    close(fd);
+    return false;
+  }
+  if (st.st_size) {
+    d = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == d) {
+      perror(in);
+      close(fd);
+      return false;
+    }
+    madvise(d, (size_t)st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  /* Decode */
+  if (((size_t)st.st_size >= 4) && !memcmp(d, TRACK_MAGIC, 4))
+    ok = tool_decode_bin(in, d, (size_t)st.st_size, &tt);
+  else
+    ok = tool_decode_json(in, d, (size_t)st.st_size, &tt);
+  if (d) munmap(d, (size_t)st.st_size);
+
+  /* Write */
+  if (ok) {
+    fp = out ? fopen(out, "wb") : stdout;
+    if (NULL == fp) {
+      perror(out);
+      ok = false;
+    } else {
+      obuf = malloc(TOOL_OUTBUF);
+      if (obuf) setvbuf(fp, obuf, _IOFBF, TOOL_OUTBUF);
+      fmt->tf_write(fp, &tt);
+      if (fflush(fp) || ferror(fp)) {
+        perror(out ? out : "stdout");
+        ok = false;
+      }
+      if (out) fclose(fp);
+      else     setvbuf(fp, NULL, _IONBF, 0);
+      free(obuf);
+    }
+  }
+
+  free(tt.tt_pts);
+  return ok;
+}
+
+static void *
+tool_worker ( void *arg )
+{
+  tool_batch_s *tb = arg;
+  size_t        i;
+
+  while ((i = __atomic_fetch_add(&tb->tb_next, 1, __ATOMIC_RELAXED)) <
+         tb->tb_num)
+    if (!tool_convert(tb->tb_jobs[i].tj_in, tb->tb_jobs[i].tj_out,
+                      tb->tb_fmt))
+      __atomic_fetch_add(&tb->tb_failed, 1, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+/*
+ * Queue an input for batch conversion
+ */
+static void
+tool_job ( tool_batch_s *tb, const char *in, const char *outdir,
+           const tool_format_s *fmt )
+{
+  const char *base = strrchr(in, '/');
+  const char *ext;
+  tool_job_s *tj;
+  size_t      n;
+
+  base = base ? (base + 1) : in;
+  ext  = strrchr(base, '.');
+  n    = ext ? (size_t)(ext - base) : strlen(base);
+
+  tb->tb_jobs = realloc(tb->tb_jobs, (tb->tb_num + 1) * sizeof(*tb->tb_jobs));
+  if (NULL == tb->tb_jobs) abort();
+  tj = tb->tb_jobs + tb->tb_num++;
+  tj->tj_in = strdup(in);
+  if (outdir) {
+    if (0 > asprintf(&tj->tj_out, "%s/%.*s.%s", outdir, (int)n, base,
+                     fmt->tf_name)) abort();
+  } else {
+    if (0 > asprintf(&tj->tj_out, "%.*s.%s", (int)((base - in) + n), in,
+                     fmt->tf_name)) abort();
+  }
+}
+
+/*
+ * Queue every track in a directory
+ */
+static bool
+tool_dir ( tool_batch_s *tb, const char *dir, const char *outdir,
+           const tool_format_s *fmt )
+{
+  struct dirent *de;
+  const char    *ext;
+  char          *path;
+  DIR           *dp;
+
+  if (NULL == (dp = opendir(dir))) {
+    perror(dir);
+    return false;
+  }
+  while (NULL != (de = readdir(dp))) {
+    ext = strrchr(de->d_name, '.');
+    if (!ext || (strcasecmp(ext, ".trk") && strcasecmp(ext, ".track")))
+      continue;
+    if (0 > asprintf(&path, "%s/%s", dir, de->d_name)) abort();
+    tool_job(tb, path, outdir, fmt);
+    free(path);
+  }
+  closedir(dp);
+  return true;
+}
+
+static void
+tool_usage ( const char *prog )
+{
+  fprintf(stderr,
+          "usage: %s [-f gpx|csv|fit] [-o output] [-j jobs] input...\n"
+          "\n"
+          "  -f fmt   output format (default gpx)\n"
+          "  -o out   output file (one input, - for stdout), or directory "
+          "(batch)\n"
+          "  -j jobs  batch threads (default: one per core)\n"
+          "\n"
+          "Inputs may be directories, every *.TRK in them is converted.\n",
+          prog);
+}
+
+int
+main ( int argc, char *argv[] )
+{
+  const tool_format_s *fmt = tool_formats;
+  const char          *out = NULL;
+  tool_batch_s         tb;
+  pthread_t           *th;
+  struct stat          st;
+  long                 jobs = 0;
+  size_t               i;
+  bool                 batch;
+  int                  c, rc = 0;
+
+  while (-1 != (c = getopt(argc, argv, "f:o:j:h"))) {
+    switch (c) {
+      case 'f':
+        for (i = 0; i < ARRAY_SIZE(tool_formats); i++)
+          if (!strcasecmp(optarg, tool_formats[i].tf_name)) break;
+        if (i == ARRAY_SIZE(tool_formats)) {
+          fprintf(stderr, "%s: unknown format\n", optarg);
+          return 1;
+        }
+        fmt = tool_formats + i;
+        break;
+      case 'o':
+        out = optarg;
+        break;
+      case 'j':
+        jobs = strtol(optarg, NULL, 0);
+        break;
+      default:
+        tool_usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    tool_usage(argv[0]);
+    return 1;
+  }
+
+  /* Single file */
+  batch = (argc - optind) > 1;
+  if (!batch && !stat(argv[optind], &st) && S_ISDIR(st.st_mode))
+    batch = true;
+  if (!batch) {
+    if (out && !strcmp(out, "-")) out = NULL;
+    return tool_convert(argv[optind], out, fmt) ? 0 : 1;
+  }
+  if (out && !strcmp(out, "-")) {
+    fprintf(stderr, "-o -: batch output must be a directory\n");
+    return 1;
+  }
+
+  /* Batch */
+  memset(&tb, 0, sizeof(tb));
+  tb.tb_fmt = fmt;
+  if (out && (mkdir(out, 0777) < 0) && (EEXIST != errno)) {
+    perror(out);
+    return 1;
+  }
+  for (c = optind; c < argc; c++) {
+    if (!stat(argv[c], &st) && S_ISDIR(st.st_mode)) {
+      if (!tool_dir(&tb, argv[c], out, fmt)) rc = 1;
+    } else {
+      tool_job(&tb, argv[c], out, fmt);
+    }
+  }
+
+  if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs <= 0) jobs = 1;
+  if ((size_t)jobs > tb.tb_num) jobs = (long)tb.tb_num;
+  th = calloc((size_t)jobs + 1, sizeof(*th));
+  for (i = 0; i < (size_t)jobs; i++)
+    if (pthread_create(th + i, NULL, tool_worker, &tb)) break;
+  if (0 == i) tool_worker(&tb);
+  while (i--) pthread_join(th[i], NULL);
+  free(th);
+
+  fprintf(stderr, "%zu converted, %zu failed\n",
+          tb.tb_num - tb.tb_failed, tb.tb_failed);
+  for (i = 0; i < tb.tb_num; i++) {
+    free(tb.tb_jobs[i].tj_in);
+    free(tb.tb_jobs[i].tj_out);
+  }
+  free(tb.tb_jobs);
+  return (rc || tb.tb_failed) ? 1 : 0;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
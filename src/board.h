@@ -32,7 +32,7 @@
 /*
  * UART definitions
  */
-#define ABC_UART_RXBUF_SZ (64)
+#define ABC_UART_RXBUF_SZ (256)
 #define ABC_UART_TXBUF_SZ (128)
 #define ABC_UART_USART1   (1)
 #define ABC_UART_USART2   (0)
@@ -40,6 +40,27 @@
 #define ABC_UART_GPS      (0)
 #define ABC_UART_TRACE    (0)
 
+/*
+ * Trace definitions (queued output, a power of 2)
+ */
+#define ABC_TRACE_BUF_SZ  (512)
+
+/*
+ * GPS definitions (baud and fix interval the receiver is moved to)
+ */
+#define ABC_GPS_BAUD      (115200)
+#define ABC_GPS_RATE_MS   (100)
+
+/*
+ * Power definitions (see hal/power.h), the GPS is woken for a little
+ * before each fix is due and STOP is only worth it for gaps longer than
+ * the HSE takes to restart
+ */
+#define ABC_POWER_QUIET_MS     (5)
+#define ABC_POWER_STOP_MIN_MS  (10)
+#define ABC_POWER_GUARD_MS     (10)
+#define ABC_POWER_BATTERY_MAH  (1000)
+
 /*
  * SPI defintions
  */
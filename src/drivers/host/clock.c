@@ -0,0 +1,93 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - Clock
+ *
+ * Simulated time. The simulation runs as fast as the host allows, so wall
+ * clock time means nothing: time is instead advanced by the drivers as the
+ * bus activity they emulate would have taken (e.g. the UART at its baud
+ * rate), and timeouts expire after the same amount of traffic as they
+ * would on the target.
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/clock.h"
+#include "clock_sim.h"
+
+/*
+ * Module data
+ */
+static uint64_t clock_now_us;
+
+/* ****************************************************************************
+ * Simulation Interface
+ * ***************************************************************************/
+
+void
+clock_sim_advance ( uint32_t us )
+{
+  clock_now_us += us;
+}
+
+uint64_t
+clock_sim_us ( void )
+{
+  return clock_now_us;
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+clock_init ( void )
+{
+  clock_now_us = 0;
+}
+
+uint32_t
+clock_ms ( void )
+{
+  return (uint32_t)(clock_now_us / 1000);
+}
+
+uint32_t
+clock_us ( void )
+{
+  return (uint32_t)clock_now_us;
+}
+
+void
+clock_skip ( uint32_t ms )
+{
+  clock_now_us += (uint64_t)ms * 1000;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,55 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - Simulated clock
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_DRIVERS_HOST_CLOCK_SIM_H
+#define ABC_DRIVERS_HOST_CLOCK_SIM_H
+
+#include "types.h"
+
+/**
+ * Advance simulated time
+ *
+ * @param us Microseconds that have passed
+ */
+void clock_sim_advance ( uint32_t us );
+
+/**
+ * Get simulated time, without wrapping
+ *
+ * @return Microseconds since clock_init()
+ */
+uint64_t clock_sim_us ( void );
+
+#endif /* ABC_DRIVERS_HOST_CLOCK_SIM_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,71 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - CPU
+ *
+ * There are no interrupts, sleeping lets the simulated clock run on by a
+ * tick and then delivers what the simulated peripherals have to say by
+ * then (as their interrupts would have).
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/cpu.h"
+#include "clock_sim.h"
+#include "uart_sim.h"
+#include "pps_sim.h"
+
+/*
+ * Time that passes in a sleep (us)
+ */
+#define CPU_WAIT_US (1000)
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+cpu_irq_disable ( void )
+{
+}
+
+void
+cpu_irq_enable ( void )
+{
+}
+
+void
+cpu_wait ( void )
+{
+  clock_sim_advance(CPU_WAIT_US);
+  uart_sim_irq();
+  pps_sim_irq(false);
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
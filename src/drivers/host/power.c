@@ -0,0 +1,80 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - Power
+ *
+ * SLEEP lets the clock run on by a tick (as cpu_wait()), STOP skips ticks
+ * until the deadline or until the simulated UART receives something (as
+ * the RX pin wakes the STM32). The current figures are the STM32 ones.
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/power.h"
+#include "hal/clock.h"
+#include "hal/cpu.h"
+#include "uart_sim.h"
+#include "pps_sim.h"
+
+/*
+ * Typical supply current (as drivers/stm32f10x/power.c)
+ */
+const uint32_t power_mode_ua[POWER_MODES] = {
+  36000, /* RUN */
+  14400, /* SLEEP */
+     24, /* STOP */
+};
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+power_rtc_init ( void )
+{
+}
+
+void
+power_sleep ( void )
+{
+  cpu_wait();
+}
+
+bool
+power_stop ( uint32_t ms )
+{
+  while (ms--) {
+    clock_skip(1);
+    pps_sim_irq(true);
+    if (uart_sim_irq()) break;
+  }
+  return true;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,111 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - PPS input
+ *
+ * Simulated edges, one per GPS second. A GPS second is 1000000 simulated
+ * microseconds adjusted by the crystal error ABC_SIM_PPS_PPM (how fast the
+ * clock runs against the GPS). Until the UART replay ties the capture's
+ * time of day to the clock (pps_sim_at()) they run from pps_init(), after
+ * that they fall on the capture's whole seconds, as the receiver's would.
+ *
+ * They are delivered when the CPU sleeps (pps_sim_irq()), as a timer
+ * capture would be, with the exact edge time. In STOP there is no capture,
+ * as on the STM32 they are then inexact (the time the CPU woke).
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/pps.h"
+#include "hal/clock.h"
+#include "clock_sim.h"
+#include "pps_sim.h"
+
+#include <stdlib.h>
+
+/*
+ * Module data
+ */
+static uint32_t pps_period;             /**< Edge interval (us, 0 = off) */
+static uint64_t pps_next;               /**< Next edge (clock_sim_us) */
+static bool     pps_tied;               /**< Capture time tied to the clock */
+static uint32_t pps_tie_ms;             /**< Capture time tied (ms of day) */
+static uint64_t pps_tie_us;             /**< ... to this (clock_sim_us) */
+
+/* ****************************************************************************
+ * Simulation Interface
+ * ***************************************************************************/
+
+void
+pps_sim_irq ( bool stopped )
+{
+  if (0 == pps_period) return;
+  while (clock_sim_us() >= pps_next) {
+    pps_dispatch(stopped ? clock_us() : (uint32_t)pps_next, !stopped);
+    pps_next += pps_period;
+  }
+}
+
+uint64_t
+pps_sim_at ( uint32_t ms, uint64_t us )
+{
+  uint32_t per = pps_period ? pps_period : 1000000;
+  uint64_t now = clock_sim_us();
+
+  /* First call, the edges move onto the capture's seconds (from now on) */
+  if (!pps_tied) {
+    if (us > now) us = now;
+    pps_tied   = true;
+    pps_tie_ms = ms;
+    pps_tie_us = us;
+    pps_next   = us + (uint64_t)((1000 - ms % 1000) % 1000) * per / 1000;
+    if (pps_next < now)
+      pps_next += (now - pps_next + per - 1) / per * per;
+  }
+
+  /* Past midnight */
+  if (ms < pps_tie_ms) ms += 86400000;
+
+  return pps_tie_us + (uint64_t)(ms - pps_tie_ms) * per / 1000;
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+pps_init ( void )
+{
+  const char *ppm = getenv("ABC_SIM_PPS_PPM");
+
+  pps_period = 1000000 + (ppm ? (int32_t)strtol(ppm, NULL, 0) : 0);
+  pps_next   = clock_sim_us() + pps_period;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
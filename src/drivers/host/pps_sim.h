@@ -0,0 +1,60 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - Simulated PPS
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_DRIVERS_HOST_PPS_SIM_H
+#define ABC_DRIVERS_HOST_PPS_SIM_H
+
+#include "types.h"
+
+/**
+ * Deliver the edges due by the (simulated) time now, as the capture
+ * interrupt would
+ *
+ * @param stopped The CPU is in STOP (no capture, the edges are inexact)
+ */
+void pps_sim_irq ( bool stopped );
+
+/**
+ * Get when a replayed fix is valid, the first call ties the capture's time
+ * of day to the clock (and the edges to its seconds)
+ *
+ * @param ms The fix time (ms of day)
+ * @param us When the first fix is valid (clock_sim_us)
+ *
+ * @return When the fix is valid (clock_sim_us)
+ */
+uint64_t pps_sim_at ( uint32_t ms, uint64_t us );
+
+#endif /* ABC_DRIVERS_HOST_PPS_SIM_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
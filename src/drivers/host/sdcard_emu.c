@@ -0,0 +1,508 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - SD card emulation
+ *
+ * The card always reports itself as an SD v2 / SDHC card, so block
+ * addressing is used throughout. Only the commands storage/sdcard.c actually
+ * issues are implemented, anything else is rejected as illegal.
+ *
+ * Programming a written block normally takes no (simulated) time, setting
+ * $ABC_SIM_SD_BUSY_MS holds the card busy that long after each one, as a
+ * card doing its housekeeping would.
+ * ***************************************************************************/
+
+#include "sdcard_emu.h"
+#include "abc_misc.h"
+#include "hal/clock.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* ****************************************************************************
+ * Definitions
+ * ***************************************************************************/
+
+#define SDEMU_R1_IDLE       (0x01)
+#define SDEMU_R1_ILLEGAL    (0x04)
+#define SDEMU_R1_CRC        (0x08)
+#define SDEMU_R1_PARAM      (0x40)
+
+#define SDEMU_TOKEN_START   (0xFE)
+#define SDEMU_TOKEN_MULTI   (0xFC)
+#define SDEMU_TOKEN_STOP    (0xFD)
+#define SDEMU_DATA_ACCEPT   (0xE5)
+#define SDEMU_DATA_CRC_ERR  (0xEB)
+#define SDEMU_DATA_WR_ERR   (0xED)
+
+#define SDEMU_OCR           (0xC0FF8000) /* powered up, CCS, 2.7-3.6V */
+#define SDEMU_BUSY_BYTES    (4)
+
+typedef enum sdemu_state
+{
+  SDEMU_IDLE,                           /**< Waiting for a command */
+  SDEMU_CMD,                            /**< Receiving a command */
+  SDEMU_RX_TOKEN,                       /**< Waiting for a write data token */
+  SDEMU_RX_DATA,                        /**< Receiving a write data block */
+} sdemu_state_e;
+
+/* ****************************************************************************
+ * Module data
+ * ***************************************************************************/
+
+static struct
+{
+  int            fd;                     /**< Backing image */
+  uint32_t       sectors;                /**< Capacity */
+  sdemu_state_e  state;                  /**< Input state */
+  bool           app;                    /**< Next command is an ACMD */
+  bool           ready;                  /**< Initialisation complete */
+  bool           crc;                    /**< CRC checking enabled */
+  bool           multi;                  /**< Multi-block write */
+  bool           rmulti;                 /**< Multi-block read */
+  uint32_t       rsect;                  /**< Next multi-block read sector */
+  uint32_t       erase;                  /**< Pre-erase count (ACMD23) */
+  uint8_t        cmd[6];                 /**< Command being received */
+  size_t         cmdlen;
+  uint8_t        out[1024];              /**< Response queue */
+  size_t         outlen;
+  size_t         outpos;
+  uint8_t        blk[514];               /**< Write block (inc CRC) */
+  size_t         blkpos;
+  uint32_t       wsect;                  /**< Write address */
+  uint32_t       prog_ms;                /**< Block programming time */
+  uint32_t       busy_until;             /**< Programming done (clock_ms) */
+  sdemu_stats_s  stats;
+} sdemu = { .fd = -1 };
+
+/* ****************************************************************************
+ * Utility functions
+ * ***************************************************************************/
+
+/*
+ * CRCs (must match the way the card computes them, not the driver)
+ */
+static uint8_t
+sdemu_crc7 ( const uint8_t *data, size_t len )
+{
+  uint8_t crc = 0;
+
+  while (len--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (uint8_t)((crc & 0x80) ? ((crc << 1) ^ 0x12) : (crc << 1));
+  }
+
+  return (uint8_t)(crc | 0x1);
+}
+
+static uint16_t
+sdemu_crc16 ( const uint8_t *data, size_t len )
+{
+  uint16_t crc = 0;
+
+  while (len--) {
+    crc ^= (uint16_t)(*data++ << 8);
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (uint16_t)((crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1));
+  }
+
+  return crc;
+}
+
+/*
+ * Queue response bytes
+ */
+static void
+sdemu_queue ( const uint8_t *buf, size_t len )
+{
+  if (len > (sizeof(sdemu.out) - sdemu.outlen))
+    len = sizeof(sdemu.out) - sdemu.outlen;
+  memcpy(sdemu.out + sdemu.outlen, buf, len);
+  sdemu.outlen += len;
+}
+
+static void
+sdemu_queue_byte ( uint8_t b )
+{
+  sdemu_queue(&b, 1);
+}
+
+static void
+sdemu_queue_r1 ( uint8_t r1 )
+{
+  sdemu_queue_byte(0xFF); // Ncr
+  sdemu_queue_byte((uint8_t)(r1 | (sdemu.ready ? 0 : SDEMU_R1_IDLE)));
+}
+
+static void
+sdemu_queue_u32 ( uint32_t u32 )
+{
+  sdemu_queue_byte((uint8_t)(u32 >> 24));
+  sdemu_queue_byte((uint8_t)(u32 >> 16));
+  sdemu_queue_byte((uint8_t)(u32 >>  8));
+  sdemu_queue_byte((uint8_t)(u32 >>  0));
+}
+
+static void
+sdemu_queue_block ( const uint8_t *buf, size_t len )
+{
+  uint16_t crc = sdemu_crc16(buf, len);
+  sdemu_queue_byte(0xFF); // Nac
+  sdemu_queue_byte(SDEMU_TOKEN_START);
+  sdemu_queue(buf, len);
+  sdemu_queue_byte((uint8_t)(crc >> 8));
+  sdemu_queue_byte((uint8_t)(crc & 0xFF));
+}
+
+/* ****************************************************************************
+ * Register contents
+ * ***************************************************************************/
+
+static void
+sdemu_queue_cid ( void )
+{
+  uint8_t cid[16] = {
+    0x00, 'A', 'B', 'S', 'I', 'M', 'S', 'D', 0x10,
+    0x00, 0x00, 0x00, 0x01, 0x01, 0x11, 0x00
+  };
+  cid[15] = sdemu_crc7(cid, 15);
+  sdemu_queue_block(cid, sizeof(cid));
+}
+
+static void
+sdemu_queue_csd ( void )
+{
+  uint32_t csize = (sdemu.sectors / 1024) - 1;
+  uint8_t  csd[16] = {
+    0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00,
+    (uint8_t)((csize >> 16) & 0x3F),
+    (uint8_t)((csize >>  8) & 0xFF),
+    (uint8_t)((csize >>  0) & 0xFF),
+    0x7F, 0x80, 0x0A, 0x40, 0x00, 0x00
+  };
+  csd[15] = sdemu_crc7(csd, 15);
+  sdemu_queue_block(csd, sizeof(csd));
+}
+
+/* ****************************************************************************
+ * Command processing
+ * ***************************************************************************/
+
+static void
+sdemu_read_sector ( uint32_t sect )
+{
+  uint8_t buf[512];
+
+  if (512 != pread(sdemu.fd, buf, sizeof(buf), (off_t)sect * 512))
+    memset(buf, 0, sizeof(buf));
+  sdemu_queue_block(buf, sizeof(buf));
+  ++sdemu.stats.st_rd_sectors;
+}
+
+static void
+sdemu_write_sector ( void )
+{
+  uint16_t crc = (uint16_t)((sdemu.blk[512] << 8) | sdemu.blk[513]);
+
+  if (sdemu.crc && (crc != sdemu_crc16(sdemu.blk, 512))) {
+    ++sdemu.stats.st_crc_errors;
+    sdemu_queue_byte(SDEMU_DATA_CRC_ERR);
+  } else if (512 != pwrite(sdemu.fd, sdemu.blk, 512,
+                           (off_t)sdemu.wsect * 512)) {
+    sdemu_queue_byte(SDEMU_DATA_WR_ERR);
+  } else {
+    sdemu_queue_byte(SDEMU_DATA_ACCEPT);
+    ++sdemu.stats.st_wr_sectors;
+  }
+
+  /* Busy (programming) */
+  for (uint8_t i = 0; i < SDEMU_BUSY_BYTES; i++)
+    sdemu_queue_byte(0x00);
+  sdemu.busy_until = clock_ms() + sdemu.prog_ms;
+}
+
+static void
+sdemu_command ( void )
+{
+  uint8_t  idx = sdemu.cmd[0] & 0x3F;
+  uint32_t arg = (uint32_t)(sdemu.cmd[1] << 24)
+               | (uint32_t)(sdemu.cmd[2] << 16)
+               | (uint32_t)(sdemu.cmd[3] <<  8)
+               | (uint32_t)(sdemu.cmd[4] <<  0);
+  bool     app = sdemu.app;
+
+  ++sdemu.stats.st_cmds;
+  sdemu.state = SDEMU_IDLE;
+  sdemu.app   = false;
+
+  /* CRC (always checked for CMD0/CMD8) */
+  if ((sdemu.crc || (0 == idx) || (8 == idx)) &&
+      (sdemu.cmd[5] != sdemu_crc7(sdemu.cmd, 5))) {
+    ++sdemu.stats.st_crc_errors;
+    sdemu_queue_r1(SDEMU_R1_CRC);
+    return;
+  }
+
+  /* Application commands */
+  if (app) {
+    if (41 == idx) {
+      sdemu.ready = true;
+      sdemu_queue_r1(0);
+    } else if ((23 == idx) && sdemu.ready) {
+      sdemu.erase = arg & 0x7FFFFF;
+      sdemu_queue_r1(0);
+    } else {
+      sdemu_queue_r1(SDEMU_R1_ILLEGAL);
+    }
+    return;
+  }
+
+  switch (idx) {
+
+    /* GO_IDLE_STATE */
+    case 0:
+      sdemu.ready = false;
+      sdemu.crc   = false;
+      sdemu_queue_r1(0);
+      break;
+
+    /* SEND_IF_COND */
+    case 8:
+      sdemu_queue_r1(0);
+      sdemu_queue_u32(arg & 0xFFF);
+      break;
+
+    /* SEND_CSD / SEND_CID */
+    case 9:
+    case 10:
+      sdemu_queue_r1(0);
+      if (9 == idx) sdemu_queue_csd();
+      else          sdemu_queue_cid();
+      break;
+
+    /* SET_BLOCKLEN */
+    case 16:
+      sdemu_queue_r1((512 == arg) ? 0 : SDEMU_R1_PARAM);
+      break;
+
+    /* STOP_TRANSMISSION */
+    case 12:
+      sdemu.rmulti = false;
+      sdemu_queue_byte(0xFF); // stuff byte
+      sdemu_queue_r1(0);
+      for (uint8_t i = 0; i < SDEMU_BUSY_BYTES; i++)
+        sdemu_queue_byte(0x00);
+      break;
+
+    /* READ_SINGLE_BLOCK / READ_MULTIPLE_BLOCK */
+    case 17:
+    case 18:
+      if (!sdemu.ready || (arg >= sdemu.sectors)) {
+        sdemu_queue_r1(sdemu.ready ? SDEMU_R1_PARAM : SDEMU_R1_ILLEGAL);
+        break;
+      }
+      sdemu_queue_r1(0);
+      if (17 == idx) {
+        sdemu_read_sector(arg);
+      } else {
+        sdemu.rmulti = true;
+        sdemu.rsect  = arg;
+        ++sdemu.stats.st_multi_reads;
+      }
+      break;
+
+    /* WRITE_BLOCK / WRITE_MULTIPLE_BLOCK */
+    case 24:
+    case 25:
+      if (!sdemu.ready || (arg >= sdemu.sectors)) {
+        sdemu_queue_r1(sdemu.ready ? SDEMU_R1_PARAM : SDEMU_R1_ILLEGAL);
+        break;
+      }
+      sdemu_queue_r1(0);
+      sdemu.wsect = arg;
+      sdemu.multi = (25 == idx);
+      sdemu.state = SDEMU_RX_TOKEN;
+      if (sdemu.multi) ++sdemu.stats.st_multi_writes;
+      break;
+
+    /* APP_CMD */
+    case 55:
+      sdemu.app = true;
+      sdemu_queue_r1(0);
+      break;
+
+    /* READ_OCR */
+    case 58:
+      sdemu_queue_r1(0);
+      sdemu_queue_u32(SDEMU_OCR);
+      break;
+
+    /* CRC_ON_OFF */
+    case 59:
+      sdemu.crc = (0 != (arg & 0x1));
+      sdemu_queue_r1(0);
+      break;
+
+    default:
+      sdemu_queue_r1(SDEMU_R1_ILLEGAL);
+      break;
+  }
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+bool
+sdemu_open ( const char *path )
+{
+  struct stat st;
+
+  sdemu_close();
+  if (NULL == path) return false;
+
+  sdemu.fd = open(path, O_RDWR);
+  if (0 > sdemu.fd) {
+    perror(path);
+    return false;
+  }
+  if (0 != fstat(sdemu.fd, &st) || (st.st_size < (512 * 1024))) {
+    fprintf(stderr, "%s: image too small\n", path);
+    sdemu_close();
+    return false;
+  }
+
+  /* Capacity is reported in 512KiB units */
+  sdemu.sectors = (uint32_t)(st.st_size / 512) & ~0x3FFu;
+  sdemu.state   = SDEMU_IDLE;
+  sdemu.ready   = false;
+  sdemu.crc     = false;
+  sdemu.multi   = false;
+  sdemu.rmulti  = false;
+  sdemu.prog_ms = getenv("ABC_SIM_SD_BUSY_MS") ?
+                  (uint32_t)strtoul(getenv("ABC_SIM_SD_BUSY_MS"), NULL, 0) : 0;
+  sdemu.busy_until = clock_ms();
+  memset(&sdemu.stats, 0, sizeof(sdemu.stats));
+
+  return true;
+}
+
+void
+sdemu_close ( void )
+{
+  if (0 <= sdemu.fd) {
+    fsync(sdemu.fd);
+    close(sdemu.fd);
+  }
+  sdemu.fd = -1;
+}
+
+uint8_t
+sdemu_xfer ( uint8_t in )
+{
+  uint8_t out = 0xFF;
+
+  /* No card */
+  if (0 > sdemu.fd) return 0xFF;
+
+  /* Multi-block read, keep the data coming */
+  if (sdemu.rmulti && (SDEMU_CMD != sdemu.state) &&
+      (sdemu.outpos == sdemu.outlen) && (sdemu.rsect < sdemu.sectors))
+    sdemu_read_sector(sdemu.rsect++);
+
+  /* Output */
+  if (sdemu.outpos < sdemu.outlen) {
+    out = sdemu.out[sdemu.outpos++];
+    if (sdemu.outpos == sdemu.outlen)
+      sdemu.outpos = sdemu.outlen = 0;
+
+  /* Still programming */
+  } else if ((int32_t)(sdemu.busy_until - clock_ms()) > 0) {
+    out = 0x00;
+  }
+
+  /* Input */
+  switch (sdemu.state) {
+    case SDEMU_IDLE:
+      if (0x40 == (in & 0xC0)) {
+        sdemu.outpos = sdemu.outlen = 0;
+        sdemu.cmd[0] = in;
+        sdemu.cmdlen = 1;
+        sdemu.state  = SDEMU_CMD;
+      }
+      break;
+
+    case SDEMU_CMD:
+      sdemu.cmd[sdemu.cmdlen++] = in;
+      if (sizeof(sdemu.cmd) == sdemu.cmdlen)
+        sdemu_command();
+      break;
+
+    case SDEMU_RX_TOKEN:
+      if (in == (sdemu.multi ? SDEMU_TOKEN_MULTI : SDEMU_TOKEN_START)) {
+        sdemu.blkpos = 0;
+        sdemu.state  = SDEMU_RX_DATA;
+      } else if (sdemu.multi && (SDEMU_TOKEN_STOP == in)) {
+        sdemu_queue_byte(0xFF); // Nbr
+        for (uint8_t i = 0; i < SDEMU_BUSY_BYTES; i++)
+          sdemu_queue_byte(0x00);
+        sdemu.multi = false;
+        sdemu.erase = 0;
+        sdemu.state = SDEMU_IDLE;
+      } else if (0xFF != in) {
+        sdemu.state = SDEMU_IDLE;
+      }
+      break;
+
+    case SDEMU_RX_DATA:
+      sdemu.blk[sdemu.blkpos++] = in;
+      if (sizeof(sdemu.blk) == sdemu.blkpos) {
+        sdemu.state = sdemu.multi ? SDEMU_RX_TOKEN : SDEMU_IDLE;
+        sdemu_write_sector();
+        ++sdemu.wsect;
+        if (sdemu.multi && (sdemu.wsect >= sdemu.sectors))
+          sdemu.state = SDEMU_IDLE;
+      }
+      break;
+  }
+
+  return out;
+}
+
+const sdemu_stats_s *
+sdemu_stats ( void )
+{
+  return &sdemu.stats;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
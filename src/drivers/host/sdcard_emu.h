@@ -0,0 +1,86 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - SD card emulation
+ *
+ * Byte level emulation of an SDHC card in SPI mode, backed by a raw disk
+ * image. This sits on the far side of the host SPI driver so that the whole
+ * of storage/sdcard.c is exercised unmodified.
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_DRIVERS_HOST_SDCARD_EMU_H
+#define ABC_DRIVERS_HOST_SDCARD_EMU_H
+
+#include "types.h"
+
+/**
+ * Statistics
+ */
+typedef struct sdemu_stats
+{
+  uint32_t st_cmds;                     /**< Commands received */
+  uint32_t st_rd_sectors;               /**< Sectors read */
+  uint32_t st_wr_sectors;               /**< Sectors written */
+  uint32_t st_multi_writes;             /**< Multi-block writes (CMD25) */
+  uint32_t st_multi_reads;              /**< Multi-block reads (CMD18) */
+  uint32_t st_crc_errors;               /**< Command/Data CRC failures */
+} sdemu_stats_s;
+
+/**
+ * Attach the emulated card to a disk image
+ *
+ * @param path The image file (must be a multiple of 512KiB)
+ *
+ * @return True if the card is present
+ */
+bool    sdemu_open ( const char *path );
+
+/**
+ * Detach from the image (flushes all writes)
+ */
+void    sdemu_close ( void );
+
+/**
+ * Clock a single byte through the card
+ *
+ * @param in The byte the host drives on MOSI
+ *
+ * @return The byte the card drives on MISO
+ */
+uint8_t sdemu_xfer ( uint8_t in );
+
+/**
+ * Get the statistics
+ */
+const sdemu_stats_s *sdemu_stats ( void );
+
+#endif /* ABC_DRIVERS_HOST_SDCARD_EMU_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,215 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - SPI
+ *
+ * Simulated SPI bus with the emulated SD card (see sdcard_emu.c) hanging off
+ * it. The card image is taken from $ABC_SIM_IMAGE.
+ *
+ * Bus utilisation is accounted as if the transfer had happened at the
+ * requested clock speed, so changes to the SD command flow can be compared
+ * without target hardware. The simulated clock is advanced to match.
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/spi.h"
+#include "sdcard_emu.h"
+#include "clock_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Structure used to represent SPI
+ */
+struct spi
+{
+  uint32_t s_speed;                      /**< Clock speed (Hz) */
+  bool     s_open;                       /**< In use */
+};
+
+/*
+ * Module data
+ */
+static spi_s    spis[1];
+static uint64_t spi_bytes;
+static uint32_t spi_xfers;
+static double   spi_time;
+static uint64_t spi_time_us;            /**< spi_time passed to the clock */
+
+/* ****************************************************************************
+ * Statistics
+ * ***************************************************************************/
+
+static void
+_spi_stats ( void )
+{
+  const sdemu_stats_s *st = sdemu_stats();
+
+  fflush(stdout);
+  fprintf(stderr,
+          "spi: %llu bytes in %u transfers, %.3f s bus time\n"
+          "sd:  %u cmds, %u sectors read (%u multi-block reads),"
+          " %u sectors written (%u multi-block writes), %u crc errors\n",
+          (unsigned long long)spi_bytes, spi_xfers, spi_time,
+          st->st_cmds, st->st_rd_sectors, st->st_multi_reads,
+          st->st_wr_sectors, st->st_multi_writes, st->st_crc_errors);
+  sdemu_close();
+}
+
+/*
+ * Account for bytes clocked
+ */
+static void
+_spi_account ( spi_s *spi, size_t len )
+{
+  uint64_t us;
+
+  spi_bytes   += len;
+  spi_time    += (double)(len * 8) / spi->s_speed;
+  us           = (uint64_t)(spi_time * 1e6) - spi_time_us;
+  spi_time_us += us;
+  clock_sim_advance((uint32_t)us);
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+/*
+ * Initialise the SPI subsystem
+ */
+void
+spi_init ( void )
+{
+  sdemu_open(getenv("ABC_SIM_IMAGE"));
+  atexit(_spi_stats);
+}
+
+/*
+ * Open SPI
+ */
+spi_s *
+spi_open ( uint8_t idx, uint32_t speed )
+{
+  /* Invalid */
+  if (idx >= ARRAY_SIZE(spis))
+    return NULL;
+  if (spis[idx].s_open || (0 == speed))
+    return NULL;
+
+  spis[idx].s_speed = speed;
+  spis[idx].s_open  = true;
+
+  /* Return object */
+  return spis + idx;
+}
+
+/*
+ * Close the SPI
+ *
+ * @param spi The SPI to close
+ */
+void
+spi_close ( spi_s *spi )
+{
+  spi->s_open = false;
+}
+
+/*
+ * Send and receive
+ */
+bool spi_tx_rx
+  ( spi_s *spi,
+    const uint8_t *txbuf, const size_t txlen,
+          uint8_t *rxbuf, const size_t rxlen )
+{
+  size_t i;
+
+  /* Send data */
+  for (i = 0; i < txlen; i++)
+    (void)sdemu_xfer(txbuf[i]);
+
+  /* Receive data */
+  for (i = 0; i < rxlen; i++)
+    rxbuf[i] = sdemu_xfer(0xFF);
+
+  spi_xfers += 1;
+  _spi_account(spi, txlen + rxlen);
+
+  return true;
+}
+
+/*
+ * Full-duplex transfer
+ */
+bool
+spi_xfer ( spi_s *spi, const uint8_t *txbuf, uint8_t *rxbuf, size_t len )
+{
+  spi_seg_s seg = { txbuf, rxbuf, len };
+  return spi_xfer_list(spi, &seg, 1);
+}
+
+/*
+ * Full-duplex scatter-gather transfer
+ */
+bool
+spi_xfer_list ( spi_s *spi, const spi_seg_s *segs, size_t nsegs )
+{
+  size_t  i;
+  uint8_t b;
+
+  spi_xfers += 1;
+  for (; nsegs; --nsegs, ++segs) {
+    for (i = 0; i < segs->ss_len; i++) {
+      b = sdemu_xfer(segs->ss_tx ? segs->ss_tx[i] : 0xFF);
+      if (segs->ss_rx) segs->ss_rx[i] = b;
+    }
+    _spi_account(spi, segs->ss_len);
+  }
+
+  return true;
+}
+
+/*
+ * Send and receive, completes immediately (there is no bus to wait for)
+ */
+bool spi_tx_rx_async
+  ( spi_s *spi,
+    const uint8_t *txbuf, const size_t txlen,
+          uint8_t *rxbuf, const size_t rxlen,
+    spi_cb cb, void *arg )
+{
+  bool ok = spi_tx_rx(spi, txbuf, txlen, rxbuf, rxlen);
+  if (NULL != cb) cb(arg, ok);
+  return true;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,375 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - UART
+ *
+ * Every UART index maps onto the same simulated port. RX replays an NMEA
+ * capture file ($ABC_SIM_NMEA, or stdin if unset) and TX goes to stdout.
+ *
+ * The capture arrives at the configured baud rate against the simulated
+ * clock, into a receive ring the size of the target's. Whatever arrives
+ * while the ring is full is lost (and counted), just as when the
+ * application is held up on the target. Arrival is checked whenever the
+ * application looks for data, and when it sleeps (uart_sim_irq(), which
+ * also makes the receive notification).
+ *
+ * The replay is paced by the fixes in it, as the receiver sends them: the
+ * sentences for a fix are not started until UART_SIM_OUT_US after the fix
+ * time (the first fix sets the pace, see pps_sim_at(), which also puts the
+ * PPS edges on its seconds). Sentences without a time follow on at the
+ * baud rate.
+ *
+ * Once the capture is exhausted uart_read() reports an error, which is how
+ * the main loop knows the simulation is over.
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/uart.h"
+#include "hal/clock.h"
+#include "ring.h"
+#include "clock_sim.h"
+#include "pps_sim.h"
+#include "uart_sim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Replay pacing
+ */
+#define UART_SIM_OUT_US   (25000)       /**< Fix valid to output starting */
+#define UART_SIM_LINE_MAX (128)         /**< Longest sentence (else split) */
+#define UART_SIM_NO_FIX   (0xFFFFFFFFu) /**< u_fix before the first */
+
+/*
+ * Structure used to represent UART
+ */
+struct uart
+{
+  FILE     *u_rx;                        /**< Capture being replayed */
+  FILE     *u_tx;                        /**< Output */
+  uint32_t  u_baud;                      /**< Configured baud rate */
+  uint64_t  u_mark;                      /**< Bytes started (clock_sim_us) */
+  uint64_t  u_arrived;                   /**< Bytes arrived since u_mark */
+  uint64_t  u_total;                     /**< Bytes received */
+  uint32_t  u_fix;                       /**< Current fix (ms of day) */
+  size_t    u_len;                       /**< Sentence length */
+  size_t    u_pos;                       /**< Sentence bytes arrived */
+  uint8_t   u_line[UART_SIM_LINE_MAX];   /**< Sentence being received */
+  bool      u_eof;                       /**< Capture exhausted */
+  ring_s    u_rxq;                       /**< RX ring */
+  uint8_t   u_rxb[ABC_UART_RXBUF_SZ];    /**< RX ring storage */
+  uart_cb   u_cb;                        /**< RX notification */
+  void     *u_cb_arg;                    /**< RX notification arg */
+};
+
+/*
+ * Module data
+ */
+static uart_s uarts[1];
+
+/* ****************************************************************************
+ * Simulation
+ * ***************************************************************************/
+
+static void
+_uart_stats ( void )
+{
+  fflush(stdout);
+  fprintf(stderr, "uart: %llu bytes received, %llu lost (overrun)\n",
+          (unsigned long long)uarts[0].u_total,
+          (unsigned long long)uarts[0].u_rxq.r_overflow);
+}
+
+/*
+ * Get the time of an NMEA sentence ($xxxxx,hhmmss[.sss],...)
+ *
+ * @return Time of day (ms), or UART_SIM_NO_FIX if it has none
+ */
+static uint32_t
+_uart_time ( const uint8_t *s, size_t len )
+{
+  uint32_t v = 0, frac = 0, scale = 1000;
+  size_t   i;
+
+  if ((len < 13) || ('$' != s[0]) || (',' != s[6])) return UART_SIM_NO_FIX;
+  for (i = 7; i < 13; i++) {
+    if (('0' > s[i]) || ('9' < s[i])) return UART_SIM_NO_FIX;
+    v = v * 10 + (s[i] - '0');
+  }
+  if ((len > 13) && ('.' == s[13]))
+    for (i = 14; (i < len) && (scale > 1) && ('0' <= s[i]) && ('9' >= s[i]);
+         i++)
+      frac += (s[i] - '0') * (scale /= 10);
+
+  return ((v / 10000) * 3600 + (v / 100 % 100) * 60 + v % 100) * 1000 + frac;
+}
+
+/*
+ * Start the next sentence, held back until its fix is output
+ */
+static bool
+_uart_line ( uart_s *uart )
+{
+  uint64_t at, start, valid;
+  uint32_t ms;
+  int      c = EOF;
+
+  uart->u_len = uart->u_pos = 0;
+  while ((uart->u_len < sizeof(uart->u_line)) &&
+         (EOF != (c = fgetc(uart->u_rx)))) {
+    uart->u_line[uart->u_len++] = (uint8_t)c;
+    if ('\n' == c) break;
+  }
+  if (0 == uart->u_len) return false;
+
+  /* New fix */
+  ms = _uart_time(uart->u_line, uart->u_len);
+  if ((UART_SIM_NO_FIX == ms) || (ms == uart->u_fix)) return true;
+  uart->u_fix = ms;
+  start       = uart->u_mark + uart->u_arrived * 10000000 / uart->u_baud;
+  valid       = (start > UART_SIM_OUT_US) ? (start - UART_SIM_OUT_US) : 0;
+  at          = pps_sim_at(ms, valid) + UART_SIM_OUT_US;
+  if (at > start) {
+    uart->u_mark    = at;
+    uart->u_arrived = 0;
+  }
+  return true;
+}
+
+/*
+ * Take in what has arrived by now
+ */
+static void
+_uart_arrive ( uart_s *uart )
+{
+  uint64_t now = clock_sim_us(), due;
+  size_t   n, room, c;
+  uint8_t *p;
+
+  while (!uart->u_eof) {
+    if ((uart->u_pos == uart->u_len) && !_uart_line(uart)) {
+      uart->u_eof = true;
+      break;
+    }
+    if (now <= uart->u_mark) break;
+    due = (now - uart->u_mark) * uart->u_baud / 10000000;
+    if (due <= uart->u_arrived) break;
+    n = uart->u_len - uart->u_pos;
+    if (n > due - uart->u_arrived) n = (size_t)(due - uart->u_arrived);
+    uart->u_arrived += n;
+    uart->u_total   += n;
+
+    /* Receive (straight into the ring, either side of the wrap) */
+    while (n && (0 != (room = ring_reserve(&uart->u_rxq, &p)))) {
+      c = (n < room) ? n : room;
+      memcpy(p, uart->u_line + uart->u_pos, c);
+      ring_commit(&uart->u_rxq, c);
+      uart->u_pos += c;
+      n           -= c;
+    }
+
+    /* Overrun */
+    ring_drop(&uart->u_rxq, n);
+    uart->u_pos += n;
+  }
+}
+
+bool
+uart_sim_irq ( void )
+{
+  uart_s *uart = uarts + 0;
+
+  if ((NULL == uart->u_rx) || (0 == uart->u_baud)) return false;
+  _uart_arrive(uart);
+
+  /* Data waiting, or the end of it (so the reader finds out) */
+  if ((0 == ring_used(&uart->u_rxq)) && !uart->u_eof) return false;
+  if (NULL != uart->u_cb) uart->u_cb(uart->u_cb_arg);
+  return true;
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+/*
+ * Initialise the UART subsystem
+ */
+void
+uart_init ( void )
+{
+  const char *path = getenv("ABC_SIM_NMEA");
+
+  /* The target has no timezone, GPS time must be handled as UTC */
+  setenv("TZ", "UTC", 1);
+  tzset();
+
+  uarts[0].u_tx  = stdout;
+  uarts[0].u_rx  = stdin;
+  uarts[0].u_fix = UART_SIM_NO_FIX;
+  ring_init(&uarts[0].u_rxq, uarts[0].u_rxb, sizeof(uarts[0].u_rxb));
+  if (NULL != path) {
+    uarts[0].u_rx = fopen(path, "rb");
+    if (NULL == uarts[0].u_rx)
+      perror(path);
+  }
+  atexit(_uart_stats);
+}
+
+/*
+ * Open UART
+ */
+uart_s *
+uart_open ( uint8_t idx, uint32_t baud )
+{
+  /* Invalid */
+  if (idx >= ARRAY_SIZE(uarts))
+    return NULL;
+
+  /* Re-open, what has not been read is lost */
+  if (0 != uarts[idx].u_baud)
+    ring_reset(&uarts[idx].u_rxq);
+  uarts[idx].u_baud    = baud;
+  if (uarts[idx].u_mark < clock_sim_us())
+    uarts[idx].u_mark  = clock_sim_us();
+  uarts[idx].u_arrived = 0;
+
+  /* Return object */
+  return uarts + idx;
+}
+
+/**
+ * Close the UART
+ *
+ * @param uart The UART to close
+ */
+void
+uart_close ( uart_s *uart )
+{
+  (void)uart;
+}
+
+/**
+ * Read from the UART
+ *
+ * @param uart The UART to read from
+ * @param buf  The buffer to read into
+ * @param len  The size of the buffer (max read length)
+ *
+ * @return The number of bytes read (<0 indicates an error)
+ */
+ssize_t
+uart_read ( uart_s *uart, uint8_t *buf, size_t len )
+{
+  const uint8_t *p;
+  ssize_t n;
+
+  /* Take in what has arrived */
+  n = uart_peek(uart, &p);
+  if (0 >= n) return n;
+
+  return (ssize_t)ring_pop(&uart->u_rxq, buf, len);
+}
+
+/**
+ * Get the received data without copying it
+ *
+ * @param uart The UART to read from
+ * @param buf  Returns a pointer to the data (valid until uart_consume)
+ *
+ * @return The number of bytes available (<0 indicates an error)
+ */
+ssize_t
+uart_peek ( uart_s *uart, const uint8_t **buf )
+{
+  if (NULL == uart->u_rx) return -1;
+
+  /* Take in what has arrived */
+  _uart_arrive(uart);
+  if ((0 == ring_used(&uart->u_rxq)) && uart->u_eof) return -1;
+
+  return (ssize_t)ring_peek(&uart->u_rxq, buf);
+}
+
+/**
+ * Release data returned by uart_peek()
+ *
+ * @param uart The UART to release data from
+ * @param len  The number of bytes processed
+ */
+void
+uart_consume ( uart_s *uart, size_t len )
+{
+  ring_consume(&uart->u_rxq, len);
+}
+
+/**
+ * Be told when data has been received
+ *
+ * @param uart The UART
+ * @param cb   The function to call (NULL to stop)
+ * @param arg  Passed to cb
+ */
+void
+uart_set_callback ( uart_s *uart, uart_cb cb, void *arg )
+{
+  uart->u_cb     = cb;
+  uart->u_cb_arg = arg;
+}
+
+/**
+ * Write to the UART
+ *
+ * @param uart The UART to write to
+ * @param buf  The buffer to write from
+ * @param len  The length of the data in buffer
+ *
+ * @return The number of bytes written (<0 indicates an error)
+ */
+ssize_t
+uart_write ( uart_s *uart, const uint8_t *buf, size_t len )
+{
+  return (ssize_t)fwrite(buf, 1, len, uart->u_tx);
+}
+
+/**
+ * Wait for all buffered data to be sent
+ *
+ * @param uart The UART to flush
+ */
+void
+uart_flush ( uart_s *uart )
+{
+  fflush(uart->u_tx);
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,49 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Host Drivers - Simulated UART
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_DRIVERS_HOST_UART_SIM_H
+#define ABC_DRIVERS_HOST_UART_SIM_H
+
+#include "types.h"
+
+/**
+ * Take in what has arrived by the (simulated) time now, and notify as the
+ * receive interrupt would
+ *
+ * @return true if there was a notification (something to wake for)
+ */
+bool uart_sim_irq ( void );
+
+#endif /* ABC_DRIVERS_HOST_UART_SIM_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
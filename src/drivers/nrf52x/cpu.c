@@ -0,0 +1,64 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * nRF52 Drivers - CPU
+ *
+ * PRIMASK and WFI (Sleep mode, peripherals and SysTick keep running)
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/cpu.h"
+
+#include "nrf.h"
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+cpu_irq_disable ( void )
+{
+  __disable_irq();
+}
+
+void
+cpu_irq_enable ( void )
+{
+  __enable_irq();
+}
+
+void
+cpu_wait ( void )
+{
+  __DSB();
+  __WFI();
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,169 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * nRF52 Drivers - Power
+ *
+ * SLEEP is WFI. STOP is System ON idle with SysTick stopped, so the HFCLK
+ * can stop as well, with RTC1 (LFCLK, 1024Hz) keeping time and its CC0
+ * waking the CPU when the next timer is due. UARTE EasyDMA keeps receiving
+ * (it requests the HFCLK itself) and wakes it per chunk, and PPS (GPIOTE)
+ * wakes it as well.
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/power.h"
+#include "hal/clock.h"
+
+#include "nrf.h"
+#include "nrf_clock.h"
+#include "nrf_rtc.h"
+#include "nrf_drv_common.h"
+
+/*
+ * RTC rate (LFCLK / (RTC_PRESCALER + 1)), ~1ms resolution
+ */
+#define RTC_HZ         (1024)
+#define RTC_PRESCALER  (32768 / RTC_HZ - 1)
+#define RTC_MASK       (0xFFFFFF)
+
+/*
+ * Longest wait for the LFCLK to start (in SysTick ms)
+ */
+#define RTC_LFCLK_MS   (1000)
+
+/*
+ * Below the levels reserved by the SoftDevice
+ */
+#define RTC_IRQ_PRIO   (7)
+
+/*
+ * Typical supply current (product specification, 64MHz running from
+ * flash with the UARTE and SPIM in use)
+ */
+const uint32_t power_mode_ua[POWER_MODES] = {
+  3700, /* RUN */
+  1200, /* SLEEP (HFCLK held by SysTick) */
+   600, /* STOP (UARTE receiving) */
+};
+
+/*
+ * Undefined interrupt vectors
+ */
+void RTC1_IRQHandler ( void );
+
+/*
+ * Module data
+ */
+static bool     power_rtc;       /**< RTC is running */
+static uint32_t power_frac;      /**< RTC ticks not yet passed to clock */
+
+/* ****************************************************************************
+ * IRQ Handler
+ * ***************************************************************************/
+
+void
+RTC1_IRQHandler ( void )
+{
+  nrf_rtc_event_clear(NRF_RTC1, NRF_RTC_EVENT_COMPARE_0);
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+power_rtc_init ( void )
+{
+  uint32_t t;
+
+  /* LFCLK (crystal) */
+  if (!nrf_clock_lf_is_running()) {
+    nrf_clock_lf_src_set(NRF_CLOCK_LFCLK_Xtal);
+    nrf_clock_event_clear(NRF_CLOCK_EVENT_LFCLKSTARTED);
+    nrf_clock_task_trigger(NRF_CLOCK_TASK_LFCLKSTART);
+    t = clock_ms();
+    while (!nrf_clock_event_check(NRF_CLOCK_EVENT_LFCLKSTARTED))
+      if ((clock_ms() - t) > RTC_LFCLK_MS) return;
+  }
+
+  /* RTC1 */
+  nrf_rtc_task_trigger(NRF_RTC1, NRF_RTC_TASK_STOP);
+  nrf_rtc_prescaler_set(NRF_RTC1, RTC_PRESCALER);
+  nrf_rtc_event_clear(NRF_RTC1, NRF_RTC_EVENT_COMPARE_0);
+  nrf_rtc_int_enable(NRF_RTC1, NRF_RTC_INT_COMPARE0_MASK);
+  nrf_drv_common_irq_enable(RTC1_IRQn, RTC_IRQ_PRIO);
+  nrf_rtc_task_trigger(NRF_RTC1, NRF_RTC_TASK_START);
+
+  power_rtc = true;
+}
+
+void
+power_sleep ( void )
+{
+  __DSB();
+  __WFI();
+}
+
+/*
+ * Interrupts are disabled, the wakeup interrupt is taken once power_idle()
+ * returns
+ */
+bool
+power_stop ( uint32_t ms )
+{
+  uint32_t c0, ticks;
+
+  if (!power_rtc) return false;
+
+  /* CC must be at least 2 ticks ahead, and inside the 24-bit counter */
+  if (ms > 3600000) ms = 3600000;
+  ticks = (uint32_t)(((uint64_t)ms * RTC_HZ) / 1000);
+  if (ticks < 2) return false;
+
+  c0 = nrf_rtc_counter_get(NRF_RTC1);
+  nrf_rtc_cc_set(NRF_RTC1, 0, (c0 + ticks) & RTC_MASK);
+  nrf_rtc_event_clear(NRF_RTC1, NRF_RTC_EVENT_COMPARE_0);
+
+  /* Idle without SysTick (it would only wake us) */
+  SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+  __DSB();
+  __WFI();
+
+  /* Account for the time stopped */
+  power_frac += ((nrf_rtc_counter_get(NRF_RTC1) - c0) & RTC_MASK) * 1000;
+  clock_skip(power_frac / RTC_HZ);
+  power_frac %= RTC_HZ;
+  SysTick->VAL   = 0;
+  SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+
+  return true;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
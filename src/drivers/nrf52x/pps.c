@@ -23,34 +23,67 @@
  * ***************************************************************************/
 
 /* ****************************************************************************
- * STM32 Drivers - PPS input
- * 
- * External interrupt signal from PPS input pin
+ * nRF52 Drivers - PPS input
+ *
+ * GPIOTE IN event from the PPS pin, routed through PPI to capture TIMER2
+ * (free running at 1MHz) at the edge. The interrupt then works back from
+ * how far TIMER2 has counted since to the edge's clock_us().
+ *
+ * TIMER2 keeps the HFCLK running in System ON idle, the price of exact
+ * edges.
  * ***************************************************************************/
 
 #include "board.h"
 #include "abc_misc.h"
 #include "hal/pps.h"
+#include "hal/clock.h"
+
+#include "nrf.h"
+#include "nrf_gpio.h"
+#include "nrf_gpiote.h"
+#include "nrf_timer.h"
+#include "nrf_ppi.h"
+#include "nrf_drv_common.h"
+
+/*
+ * Pin
+ */
+#define PPS_PIN       (12)
+
+/*
+ * Resources (TIMER1 and PPI channel 0 are the UART's)
+ */
+#define PPS_GPIOTE_CH (0)
+#define PPS_PPI_CH    NRF_PPI_CHANNEL1
+
+/*
+ * Below the levels reserved by the SoftDevice
+ */
+#define PPS_IRQ_PRIO  (6)
+
+/*
+ * Undefined interrupt vectors
+ */
+void GPIOTE_IRQHandler ( void );
 
 /* ****************************************************************************
  * IRQ Handler
  * ***************************************************************************/
 
-/*
-void EXTI4_IRQHandler ( void );
-
 void
-EXTI4_IRQHandler ( void )
+GPIOTE_IRQHandler ( void )
 {
-  static bool state = false;
-  if (EXTI_GetITStatus(EXTI_Line4) != RESET) {
-    state = !state;
-    if (state) GPIO_ResetBits(GPIOA, GPIO_Pin_5);
-    else       GPIO_SetBits(GPIOA, GPIO_Pin_5);
-    EXTI_ClearITPendingBit(EXTI_Line4);
-  }
+  uint32_t cc, now, us;
+
+  if (!nrf_gpiote_event_is_set(NRF_GPIOTE_EVENTS_IN_0)) return;
+  nrf_gpiote_event_clear(NRF_GPIOTE_EVENTS_IN_0);
+
+  nrf_timer_task_trigger(NRF_TIMER2, NRF_TIMER_TASK_CAPTURE1);
+  us  = clock_us();
+  now = nrf_timer_cc_read(NRF_TIMER2, NRF_TIMER_CC_CHANNEL1);
+  cc  = nrf_timer_cc_read(NRF_TIMER2, NRF_TIMER_CC_CHANNEL0);
+  pps_dispatch(us - (now - cc), true);
 }
-*/
 
 /* ****************************************************************************
  * Public Interface
@@ -59,8 +92,27 @@ EXTI4_IRQHandler ( void )
 void
 pps_init ( void )
 {
-}
+  /* Free running 1MHz timer */
+  nrf_timer_mode_set(NRF_TIMER2, NRF_TIMER_MODE_TIMER);
+  nrf_timer_bit_width_set(NRF_TIMER2, NRF_TIMER_BIT_WIDTH_32);
+  nrf_timer_frequency_set(NRF_TIMER2, NRF_TIMER_FREQ_1MHz);
+  nrf_timer_task_trigger(NRF_TIMER2, NRF_TIMER_TASK_START);
 
+  /* Rising edge */
+  nrf_gpio_cfg_input(PPS_PIN, NRF_GPIO_PIN_NOPULL);
+  nrf_gpiote_event_configure(PPS_GPIOTE_CH, PPS_PIN,
+                             NRF_GPIOTE_POLARITY_LOTOHI);
+  nrf_gpiote_event_enable(PPS_GPIOTE_CH);
+  nrf_gpiote_event_clear(NRF_GPIOTE_EVENTS_IN_0);
+  nrf_gpiote_int_enable(NRF_GPIOTE_INT_IN0_MASK);
+  nrf_drv_common_irq_enable(GPIOTE_IRQn, PPS_IRQ_PRIO);
+
+  /* Edge captures the timer */
+  nrf_ppi_channel_endpoint_setup(PPS_PPI_CH,
+    nrf_gpiote_event_addr_get(NRF_GPIOTE_EVENTS_IN_0),
+    nrf_timer_task_address_get(NRF_TIMER2, NRF_TIMER_TASK_CAPTURE0));
+  nrf_ppi_channel_enable(PPS_PPI_CH);
+}
 
 /* ****************************************************************************
  * Editor Configuration
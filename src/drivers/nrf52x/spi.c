@@ -23,50 +23,246 @@
  * ***************************************************************************/
 
 /* ****************************************************************************
- * STM32 Drivers - SPI
- * 
- * Wrapper around STM standard peripheral library to support the custom HAL
- * interface
+ * nRF52 Drivers - SPI
  *
- * This is NOT using DMA, it's polling the data in and out
+ * SPIM0 driven by EasyDMA, up to 8MHz
  *
- * It's fixed as Master, 8-bit, CPOL=0, CPHA=1, MSB first
+ * EasyDMA moves at most 255 bytes per START, so segments are split into
+ * chunks that are chained from the END interrupt. The RX pointer is in
+ * ArrayList mode, so it advances by itself and the next chunk only needs
+ * a START. While receiving nothing is loaded for TX, the SPIM clocks out
+ * its over-read character (0xFF).
+ *
+ * EasyDMA cannot read flash, constant TX data is bounced through RAM. A
+ * segment with neither TX nor RX (dummy clocks) sends 0xFF from there too,
+ * a transfer with nothing to move would clock nothing.
+ *
+ * nRF52832 PAN-58: with RXD.MAXCNT = 1 (and TXD.MAXCNT <= 1) the SPIM
+ * clocks an extra byte, which would eat part of an SD card response. For
+ * single byte chunks the first SCK edge (GPIOTE) triggers STOP through
+ * PPI, which ends the transfer after that byte.
+ *
+ * It's fixed as Master, 8-bit, CPOL=0, CPHA=0, MSB first
  * ***************************************************************************/
 
 #include "board.h"
 #include "abc_misc.h"
 #include "hal/spi.h"
 
+#include "nrf.h"
+#include "nrf_gpio.h"
+#include "nrf_spim.h"
+#include "nrf_drv_common.h"
+#include "nrf_gpiote.h"
+#include "nrf_ppi.h"
+
+#include <string.h>
+
+/*
+ * Pins
+ */
+#define SPI_PIN_SCK   (25)
+#define SPI_PIN_MOSI  (23)
+#define SPI_PIN_MISO  (24)
+
+/*
+ * PAN-58 workaround resources (GPIOTE 0 and PPI 0/1 are PPS and the UART)
+ */
+#define SPI_PAN58_GPIOTE (1)
+#define SPI_PAN58_PPI    NRF_PPI_CHANNEL2
+
+/*
+ * Largest EasyDMA transfer
+ */
+#define SPI_CHUNK     (255)
+
+/*
+ * Below the levels reserved by the SoftDevice, radio events are never
+ * held off by a sector transfer
+ */
+#define SPI_IRQ_PRIO  (6)
+
+/*
+ * Undefined interrupt vectors
+ */
+void SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler ( void );
+
 /*
  * Structure used to represent SPI
  */
 struct spi
 {
+  NRF_SPIM_Type   *s_hw;                 /**< HW interface */
+  volatile bool    s_busy;               /**< Transfer in progress */
+  volatile bool    s_ok;                 /**< Last transfer succeeded */
+  spi_seg_s        s_seg[2];             /**< spi_tx_rx_async() segments */
+  const spi_seg_s *s_segs;               /**< Current segment */
+  size_t           s_nsegs;              /**< Segments left (inc current) */
+  size_t           s_off;                /**< Offset into current segment */
+  spi_cb           s_cb;                 /**< Completion callback */
+  void            *s_arg;                /**< Completion callback arg */
+  uint8_t          s_bounce[SPI_CHUNK];  /**< TX data that is not in RAM */
 };
 
 /*
  * Module data
  */
-static spi_s spis[2];
+static spi_s spis[1];
 
 /* ****************************************************************************
  * Hardware Setup
  * ***************************************************************************/
 
 /*
- * Initialise USART1
+ * Initialise SPIM0
  */
 static void
 _spi1_init ( void )
 {
+  NRF_SPIM_Type *hw = NRF_SPIM0;
+
+  /* Pins (SCK input buffer must be connected for the SPIM to sample) */
+  nrf_gpio_pin_clear(SPI_PIN_SCK);
+  nrf_gpio_cfg(SPI_PIN_SCK, NRF_GPIO_PIN_DIR_OUTPUT,
+               NRF_GPIO_PIN_INPUT_CONNECT, NRF_GPIO_PIN_NOPULL,
+               NRF_GPIO_PIN_S0S1, NRF_GPIO_PIN_NOSENSE);
+  nrf_gpio_pin_clear(SPI_PIN_MOSI);
+  nrf_gpio_cfg_output(SPI_PIN_MOSI);
+  nrf_gpio_cfg_input(SPI_PIN_MISO, NRF_GPIO_PIN_PULLUP);
+
+  /* Configure */
+  nrf_spim_pins_set(hw, SPI_PIN_SCK, SPI_PIN_MOSI, SPI_PIN_MISO);
+  nrf_spim_configure(hw, NRF_SPIM_MODE_0, NRF_SPIM_BIT_ORDER_MSB_FIRST);
+  nrf_spim_orc_set(hw, 0xFF);
+  nrf_spim_rx_list_enable(hw);
+  nrf_spim_event_clear(hw, NRF_SPIM_EVENT_END);
+  nrf_spim_int_enable(hw, NRF_SPIM_INT_END_MASK);
+  nrf_drv_common_irq_enable(SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQn,
+                            SPI_IRQ_PRIO);
+
+#ifdef NRF52_PAN_58
+  /* First SCK edge stops the SPIM (enabled per single byte chunk) */
+  nrf_gpiote_event_configure(SPI_PAN58_GPIOTE, SPI_PIN_SCK,
+                             NRF_GPIOTE_POLARITY_TOGGLE);
+  nrf_gpiote_event_enable(SPI_PAN58_GPIOTE);
+  nrf_ppi_channel_endpoint_setup(SPI_PAN58_PPI,
+    nrf_gpiote_event_addr_get(NRF_GPIOTE_EVENTS_IN_1),
+    nrf_spim_task_address_get(hw, NRF_SPIM_TASK_STOP));
+#endif
+
+  spis[0].s_hw = hw;
+}
+
+/* ****************************************************************************
+ * Transfers
+ * ***************************************************************************/
+
+/*
+ * Start the next chunk
+ *
+ * @return false if there is nothing left to transfer
+ */
+static bool
+_spi_next ( spi_s *spi )
+{
+  const spi_seg_s *seg;
+  const uint8_t   *tx;
+  size_t           n;
+
+  /* Skip finished (or empty) segments */
+  while (spi->s_nsegs && (spi->s_off >= spi->s_segs->ss_len)) {
+    ++spi->s_segs;
+    --spi->s_nsegs;
+    spi->s_off = 0;
+  }
+  if (0 == spi->s_nsegs) return false;
+  seg = spi->s_segs;
+
+  /* New segment, point RX at the start of its list */
+  if (0 == spi->s_off)
+    spi->s_hw->RXD.PTR = (uint32_t)seg->ss_rx;
+
+  /* Chunk */
+  n = seg->ss_len - spi->s_off;
+  if (n > SPI_CHUNK) n = SPI_CHUNK;
+
+  /* TX data (ORC is sent if there is none, but something must move) */
+  tx = NULL;
+  if (NULL != seg->ss_tx) {
+    tx = seg->ss_tx + spi->s_off;
+    if (!nrf_drv_is_in_RAM(tx)) {
+      memcpy(spi->s_bounce, tx, n);
+      tx = spi->s_bounce;
+    }
+  } else if (NULL == seg->ss_rx) {
+    memset(spi->s_bounce, 0xFF, n);
+    tx = spi->s_bounce;
+  }
+  spi->s_hw->TXD.PTR    = (uint32_t)tx;
+  spi->s_hw->TXD.MAXCNT = tx ? n : 0;
+  spi->s_hw->RXD.MAXCNT = seg->ss_rx ? n : 0;
+  spi->s_off           += n;
+
+#ifdef NRF52_PAN_58
+  if (1 == n)
+    nrf_ppi_channel_enable(SPI_PAN58_PPI);
+  else
+    nrf_ppi_channel_disable(SPI_PAN58_PPI);
+#endif
+
+  nrf_spim_task_trigger(spi->s_hw, NRF_SPIM_TASK_START);
+  return true;
 }
 
 /*
- * Initialise USART2
+ * Complete a transfer
  */
 static void
-_spi2_init ( void )
+_spi_done ( spi_s *spi, bool ok )
 {
+  spi_cb cb = spi->s_cb;
+
+  spi->s_ok   = ok;
+  spi->s_cb   = NULL;
+  spi->s_busy = false;
+  if (NULL != cb) cb(spi->s_arg, ok);
+}
+
+/*
+ * Start a transfer of a list of segments
+ */
+static bool
+_spi_start
+  ( spi_s *spi, const spi_seg_s *segs, size_t nsegs, spi_cb cb, void *arg )
+{
+  spi->s_busy  = true;
+  spi->s_cb    = cb;
+  spi->s_arg   = arg;
+  spi->s_segs  = segs;
+  spi->s_nsegs = nsegs;
+  spi->s_off   = 0;
+  if (!_spi_next(spi))
+    _spi_done(spi, true);
+  return true;
+}
+
+/* ****************************************************************************
+ * IRQ Handlers
+ * ***************************************************************************/
+
+void
+SPIM0_SPIS0_TWIM0_TWIS0_SPI0_TWI0_IRQHandler ( void )
+{
+  spi_s *spi = spis + 0;
+
+  if (!nrf_spim_event_check(spi->s_hw, NRF_SPIM_EVENT_END)) return;
+  nrf_spim_event_clear(spi->s_hw, NRF_SPIM_EVENT_END);
+
+  /* Chunk complete, start the next */
+  if (_spi_next(spi))
+    return;
+
+  _spi_done(spi, true);
 }
 
 /* ****************************************************************************
@@ -80,7 +276,6 @@ void
 spi_init ( void )
 {
   _spi1_init();
-  _spi2_init();
 }
 
 /*
@@ -89,6 +284,36 @@ spi_init ( void )
 spi_s *
 spi_open ( uint8_t idx, uint32_t speed )
 {
+  static const struct {
+    uint32_t             hz;
+    nrf_spim_frequency_t freq;
+  } freqs[] = {
+    { 8000000, NRF_SPIM_FREQ_8M   },
+    { 4000000, NRF_SPIM_FREQ_4M   },
+    { 2000000, NRF_SPIM_FREQ_2M   },
+    { 1000000, NRF_SPIM_FREQ_1M   },
+    {  500000, NRF_SPIM_FREQ_500K },
+    {  250000, NRF_SPIM_FREQ_250K },
+    {  125000, NRF_SPIM_FREQ_125K },
+  };
+  size_t i;
+
+  /* Invalid */
+  if (idx >= ARRAY_SIZE(spis))
+    return NULL;
+  if (NULL == spis[idx].s_hw)
+    return NULL;
+
+  /* Fastest clock not above the requested speed */
+  for (i = 0; i < ARRAY_SIZE(freqs) - 1; i++)
+    if (speed >= freqs[i].hz) break;
+
+  /* (Re)configure */
+  while (spis[idx].s_busy);
+  nrf_spim_disable(spis[idx].s_hw);
+  nrf_spim_frequency_set(spis[idx].s_hw, freqs[i].freq);
+  nrf_spim_enable(spis[idx].s_hw);
+
   /* Return object */
   return spis + idx;
 }
@@ -101,6 +326,29 @@ spi_open ( uint8_t idx, uint32_t speed )
 void
 spi_close ( spi_s *spi )
 {
+  while (spi->s_busy);
+  nrf_spim_disable(spi->s_hw);
+}
+
+/*
+ * Send and receive (asynchronous)
+ */
+bool spi_tx_rx_async
+  ( spi_s *spi,
+    const uint8_t *txbuf, const size_t txlen,
+          uint8_t *rxbuf, const size_t rxlen,
+    spi_cb cb, void *arg )
+{
+  /* Wait for the previous transfer */
+  while (spi->s_busy);
+
+  spi->s_seg[0].ss_tx  = txbuf;
+  spi->s_seg[0].ss_rx  = NULL;
+  spi->s_seg[0].ss_len = txlen;
+  spi->s_seg[1].ss_tx  = NULL;
+  spi->s_seg[1].ss_rx  = rxbuf;
+  spi->s_seg[1].ss_len = rxlen;
+  return _spi_start(spi, spi->s_seg, 2, cb, arg);
 }
 
 /*
@@ -111,7 +359,33 @@ bool spi_tx_rx
     const uint8_t *txbuf, const size_t txlen,
           uint8_t *rxbuf, const size_t rxlen )
 {
-  return true;
+  if (!spi_tx_rx_async(spi, txbuf, txlen, rxbuf, rxlen, NULL, NULL))
+    return false;
+  while (spi->s_busy);
+  return spi->s_ok;
+}
+
+/*
+ * Full-duplex transfer
+ */
+bool
+spi_xfer ( spi_s *spi, const uint8_t *txbuf, uint8_t *rxbuf, size_t len )
+{
+  spi_seg_s seg = { txbuf, rxbuf, len };
+  return spi_xfer_list(spi, &seg, 1);
+}
+
+/*
+ * Full-duplex scatter-gather transfer
+ */
+bool
+spi_xfer_list ( spi_s *spi, const spi_seg_s *segs, size_t nsegs )
+{
+  while (spi->s_busy);
+  if (!_spi_start(spi, segs, nsegs, NULL, NULL))
+    return false;
+  while (spi->s_busy);
+  return spi->s_ok;
 }
 
 /* ****************************************************************************
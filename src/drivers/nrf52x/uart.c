@@ -22,21 +22,65 @@
  *
  * ***************************************************************************/
 
+
 /* ****************************************************************************
- * STM32 Drivers - UART
- * 
- * Wrapper around STM standard peripheral library to support the custom HAL
- * interface
+ * nRF52 Drivers - UART
+ *
+ * Wrapper around the nRF5 SDK UART driver (UARTE, EasyDMA) to support the
+ * custom HAL interface
+ *
+ * RX is received in UART_RX_CHUNK byte chunks, into a pair of chunk buffers
+ * that are always both queued with the driver (double-buffered) so nothing
+ * is lost while the interrupt re-arms. That is one interrupt per chunk,
+ * rather than per byte, which pushes the chunk into the RX ring and
+ * queues the buffer again straight away, then notifies the reader. If the
+ * ring is full the chunk is counted as overflow. A chunk is only complete
+ * once it is full, so the tail of a burst would sit in a part filled
+ * chunk: TIMER1, restarted by every RXDRDY through PPI, aborts the
+ * reception once the line has been quiet for a few characters, flushing
+ * what has been received.
+ *
+ * TX sends everything contiguous in the TX ring in a single transfer.
  * ***************************************************************************/
 
 #include "board.h"
 #include "abc_misc.h"
 #include "hal/uart.h"
+#include "ring.h"
 
 #include "nrf_drv_uart.h"
+#include "nrf_drv_common.h"
+#include "nrf_uarte.h"
+#include "nrf_timer.h"
+#include "nrf_ppi.h"
 #include "nrf.h"
 #include "bsp.h"
 
+#include <string.h>
+
+/*
+ * RX chunks
+ */
+#define UART_RX_CHUNK    (32)
+
+/*
+ * Line idle time (in characters) before a part filled chunk is flushed
+ */
+#define UART_RX_TIMEOUT  (4)
+
+/*
+ * Largest EasyDMA transfer
+ */
+#define UART_TX_MAX      (255)
+
+#if !RING_POW2(ABC_UART_RXBUF_SZ) || !RING_POW2(ABC_UART_TXBUF_SZ)
+#error "UART buffer sizes must be powers of 2"
+#endif
+
+/*
+ * Undefined interrupt vectors
+ */
+void TIMER1_IRQHandler ( void );
 
 /*
  * Structure used to represent UART
@@ -44,12 +88,18 @@
 struct uart
 {
   nrf_drv_uart_t u_hw;                     /**< HW interface */
-  uint8_t        u_rxb[ABC_UART_RXBUF_SZ]; /**< RX buffer */
-  uint8_t        u_rxi;                    /**< RX buffer input ptr */
-  uint8_t        u_rxo;                    /**< RX buffer output ptr */
-  uint8_t        u_txb[ABC_UART_TXBUF_SZ]; /**< TX buffer */
-  uint8_t        u_txi;                    /**< TX buffer input ptr */
-  uint8_t        u_txo;                    /**< TX buffer output ptr */
+  uint32_t       u_baud;                   /**< Baud rate (0 if closed) */
+  uint8_t        u_rxc[2][UART_RX_CHUNK];  /**< RX chunks (DMA) */
+  volatile uint8_t u_rxarm;                /**< Chunks queued (count) */
+  volatile uint8_t u_rxdone;               /**< Chunks received (count) */
+  volatile bool  u_rxabort;                /**< RX timeout abort pending */
+  ring_s         u_rx;                     /**< RX ring */
+  uint8_t        u_rxb[ABC_UART_RXBUF_SZ]; /**< RX ring storage */
+  ring_s         u_tx;                     /**< TX ring */
+  uint8_t        u_txb[ABC_UART_TXBUF_SZ]; /**< TX ring storage */
+  volatile uint8_t u_txlen;                /**< TX bytes in flight */
+  uart_cb        u_cb;                     /**< RX notification */
+  void          *u_cb_arg;                 /**< RX notification arg */
 };
 
 /*
@@ -57,6 +107,45 @@ struct uart
  */
 static uart_s uarts[1];
 
+/* ****************************************************************************
+ * RX/TX
+ * ***************************************************************************/
+
+/*
+ * Keep both chunks queued with the driver
+ *
+ * Note: called under interrupt, or with interrupts disabled
+ */
+static void
+_uart_rx_arm ( uart_s *uart )
+{
+  while ((uint8_t)(uart->u_rxarm - uart->u_rxdone) < 2) {
+    uint8_t *p = uart->u_rxc[uart->u_rxarm % 2];
+    if (NRF_SUCCESS != nrf_drv_uart_rx(&uart->u_hw, p, UART_RX_CHUNK)) break;
+    ++uart->u_rxarm;
+  }
+}
+
+/*
+ * Send the next contiguous span of the TX ring
+ *
+ * Note: called under interrupt, or with interrupts disabled (this is the
+ * consumer side of the ring)
+ */
+static void
+_uart_tx_start ( uart_s *uart )
+{
+  const uint8_t *p;
+  size_t         n;
+
+  if (0 != uart->u_txlen) return;
+  n = ring_peek(&uart->u_tx, &p);
+  if (0 == n) return;
+  if (n > UART_TX_MAX) n = UART_TX_MAX;
+  if (NRF_SUCCESS == nrf_drv_uart_tx(&uart->u_hw, p, n))
+    uart->u_txlen = (uint8_t)n;
+}
+
 /* ****************************************************************************
  * IRQ Handlers
  * ***************************************************************************/
@@ -66,17 +155,42 @@ uart_event_handler ( nrf_drv_uart_event_t *ev, void *p )
 {
   uart_s *uart = (uart_s*)p;
 
+  /* Chunk received (complete, or flushed by the timeout) */
   if (NRF_DRV_UART_EVT_RX_DONE == ev->type) {
-    nrf_drv_uart_rx(&uart->u_hw, uart->u_rxb + uart->u_rxi, 1);
-    uart->u_rxi = (uart->u_rxi + 1) % ABC_UART_RXBUF_SZ;
-  } else if (NRF_DRV_UART_EVT_TX_DONE == ev->type) {
-    uart->u_txo = (uart->u_txo + 1) % ABC_UART_TXBUF_SZ;
-    if (uart->u_txo != uart->u_txi) {
-      nrf_drv_uart_tx(&uart->u_hw, uart->u_txb + uart->u_txo, 1);
+    ring_push(&uart->u_rx, uart->u_rxc[uart->u_rxdone % 2],
+              ev->data.rxtx.bytes);
+    ++uart->u_rxdone;
+
+    /* Abort also drops the second queued chunk */
+    if (uart->u_rxabort) {
+      uart->u_rxabort = false;
+      uart->u_rxdone  = uart->u_rxarm;
     }
+    _uart_rx_arm(uart);
+    if ((0 != ev->data.rxtx.bytes) && (NULL != uart->u_cb))
+      uart->u_cb(uart->u_cb_arg);
+
+  /* Receive error (e.g. overrun), reception stops: discard and restart */
+  } else if (NRF_DRV_UART_EVT_ERROR == ev->type) {
+    uart->u_rxdone = uart->u_rxarm;
+    _uart_rx_arm(uart);
+
+  /* Sent */
+  } else if (NRF_DRV_UART_EVT_TX_DONE == ev->type) {
+    ring_consume(&uart->u_tx, uart->u_txlen);
+    uart->u_txlen = 0;
+    _uart_tx_start(uart);
   }
 }
 
+void
+TIMER1_IRQHandler ( void )
+{
+  nrf_timer_event_clear(NRF_TIMER1, NRF_TIMER_EVENT_COMPARE0);
+  uarts[0].u_rxabort = true;
+  nrf_drv_uart_rx_abort(&uarts[0].u_hw);
+}
+
 /* ****************************************************************************
  * Hardware Setup
  * ***************************************************************************/
@@ -87,25 +201,42 @@ uart_event_handler ( nrf_drv_uart_event_t *ev, void *p )
 static void
 _usart1_init ( void )
 {
-  uint8_t b;
-
   /* Setup instance */
   nrf_drv_uart_t tmp = NRF_DRV_UART_INSTANCE(0);
   memcpy(&uarts[0].u_hw, &tmp, sizeof(tmp));// = NRF_DRV_UART_INSTANCE(0);
 
-  /* Configure */
+  /* RX timeout: TIMER1 (1MHz) is cleared and started by every RXDRDY */
+  nrf_timer_mode_set(NRF_TIMER1, NRF_TIMER_MODE_TIMER);
+  nrf_timer_bit_width_set(NRF_TIMER1, NRF_TIMER_BIT_WIDTH_32);
+  nrf_timer_frequency_set(NRF_TIMER1, NRF_TIMER_FREQ_1MHz);
+  nrf_timer_shorts_enable(NRF_TIMER1, NRF_TIMER_SHORT_COMPARE0_STOP_MASK |
+                                      NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK);
+  nrf_timer_int_enable(NRF_TIMER1, NRF_TIMER_INT_COMPARE0_MASK);
+  nrf_drv_common_irq_enable(TIMER1_IRQn, UART_DEFAULT_CONFIG_IRQ_PRIORITY);
+  nrf_ppi_channel_endpoint_setup(NRF_PPI_CHANNEL0,
+    nrf_uarte_event_address_get(NRF_UARTE0, NRF_UARTE_EVENT_RXDRDY),
+    nrf_timer_task_address_get(NRF_TIMER1, NRF_TIMER_TASK_CLEAR));
+  nrf_ppi_fork_endpoint_setup(NRF_PPI_CHANNEL0,
+    nrf_timer_task_address_get(NRF_TIMER1, NRF_TIMER_TASK_START));
+  nrf_ppi_channel_enable(NRF_PPI_CHANNEL0);
+}
+
+/*
+ * Configure USART1 (the driver has no way to change the baud rate of an
+ * initialised instance, so it is re-initialised)
+ */
+static void
+_usart1_config ( nrf_uart_baudrate_t baudrate )
+{
   nrf_drv_uart_config_t conf = NRF_DRV_UART_DEFAULT_CONFIG;
-  conf.baudrate  = NRF_UART_BAUDRATE_9600;
+  conf.baudrate  = baudrate;
   conf.hwfc      = NRF_UART_HWFC_DISABLED;
   conf.parity    = NRF_UART_PARITY_EXCLUDED;
   conf.pselrxd   = 16; // for GPS
   conf.pseltxd   = 27; // on the debug header
   conf.p_context = &uarts[0];
+  conf.use_easy_dma = true;
   nrf_drv_uart_init(&uarts[0].u_hw, &conf, uart_event_handler);
-  nrf_drv_uart_rx_enable(&uarts[0].u_hw);
-
-  /* Dummy read */
-  nrf_drv_uart_rx(&uarts[0].u_hw, &b, 1);
 }
 
 /* ****************************************************************************
@@ -119,6 +250,8 @@ void
 uart_init ( void )
 {
   _usart1_init();
+  ring_init(&uarts[0].u_rx, uarts[0].u_rxb, sizeof(uarts[0].u_rxb));
+  ring_init(&uarts[0].u_tx, uarts[0].u_txb, sizeof(uarts[0].u_txb));
 }
 
 /*
@@ -127,12 +260,59 @@ uart_init ( void )
 uart_s *
 uart_open ( uint8_t idx, uint32_t baud )
 {
+  static const struct {
+    uint32_t            baud;
+    nrf_uart_baudrate_t rate;
+  } rates[] = {
+    {    4800, NRF_UART_BAUDRATE_4800    },
+    {    9600, NRF_UART_BAUDRATE_9600    },
+    {   19200, NRF_UART_BAUDRATE_19200   },
+    {   38400, NRF_UART_BAUDRATE_38400   },
+    {   57600, NRF_UART_BAUDRATE_57600   },
+    {  115200, NRF_UART_BAUDRATE_115200  },
+    {  230400, NRF_UART_BAUDRATE_230400  },
+    {  460800, NRF_UART_BAUDRATE_460800  },
+    {  921600, NRF_UART_BAUDRATE_921600  },
+  };
+  uart_s *uart;
+  size_t  i;
+
   /* Invalid */
   if (idx >= ARRAY_SIZE(uarts))
     return NULL;
+  for (i = 0; i < ARRAY_SIZE(rates); i++)
+    if (baud == rates[i].baud) break;
+  if (i >= ARRAY_SIZE(rates))
+    return NULL;
+  uart = uarts + idx;
+
+  /* Already open, finish sending and stop everything */
+  if (0 != uart->u_baud) {
+    uart_flush(uart);
+    __disable_irq();
+    nrf_timer_task_trigger(NRF_TIMER1, NRF_TIMER_TASK_STOP);
+    nrf_timer_event_clear(NRF_TIMER1, NRF_TIMER_EVENT_COMPARE0);
+    nrf_drv_uart_uninit(&uart->u_hw);
+    uart->u_rxarm   = 0;
+    uart->u_rxdone  = 0;
+    uart->u_rxabort = false;
+    ring_reset(&uart->u_rx);
+    __enable_irq();
+  }
+  _usart1_config(rates[i].rate);
+  uart->u_baud = baud;
+
+  /* RX timeout (10 bits per character) */
+  nrf_timer_cc_write(NRF_TIMER1, NRF_TIMER_CC_CHANNEL0,
+                     (uint32_t)((UART_RX_TIMEOUT * 10 * 1000000ull) / baud));
+
+  /* Start receiving */
+  __disable_irq();
+  _uart_rx_arm(uart);
+  __enable_irq();
 
   /* Return object */
-  return uarts + idx;
+  return uart;
 }
 
 /**
@@ -158,18 +338,64 @@ uart_close ( uart_s *uart )
 ssize_t
 uart_read ( uart_s *uart, uint8_t *buf, size_t len )
 {
-  ssize_t n = 0;
-  while ((uart->u_rxi != uart->u_rxo) && (0 != len)) {
-    *buf = uart->u_rxb[uart->u_rxo];
-    ++uart->u_rxo;
-    if (uart->u_rxo >= ABC_UART_RXBUF_SZ)
-      uart->u_rxo = 0;
-    ++n;
-    --len;
+  const uint8_t *p;
+  ssize_t n = 0, c;
+
+  while (0 != len) {
+    c = uart_peek(uart, &p);
+    if (0 >= c) break;
+    if ((size_t)c > len) c = (ssize_t)len;
+    memcpy(buf, p, (size_t)c);
+    uart_consume(uart, (size_t)c);
+    buf += c;
+    len -= (size_t)c;
+    n   += c;
   }
   return n;
 }
 
+/**
+ * Get the received data without copying it
+ *
+ * @param uart The UART to read from
+ * @param buf  Returns a pointer to the data (valid until uart_consume)
+ *
+ * @return The number of bytes available (<0 indicates an error)
+ */
+ssize_t
+uart_peek ( uart_s *uart, const uint8_t **buf )
+{
+  return (ssize_t)ring_peek(&uart->u_rx, buf);
+}
+
+/**
+ * Release data returned by uart_peek()
+ *
+ * @param uart The UART to release data from
+ * @param len  The number of bytes processed
+ */
+void
+uart_consume ( uart_s *uart, size_t len )
+{
+  ring_consume(&uart->u_rx, len);
+}
+
+/**
+ * Be told when data has been received
+ *
+ * @param uart The UART
+ * @param cb   The function to call (NULL to stop)
+ * @param arg  Passed to cb
+ */
+void
+uart_set_callback ( uart_s *uart, uart_cb cb, void *arg )
+{
+  __disable_irq();
+  uart->u_cb     = cb;
+  uart->u_cb_arg = arg;
+  __enable_irq();
+}
+
 /**
  * Write to the UART
  *
@@ -182,23 +408,29 @@ uart_read ( uart_s *uart, uint8_t *buf, size_t len )
 ssize_t
 uart_write ( uart_s *uart, const uint8_t *buf, size_t len )
 {
-  ssize_t n = 0;
+  size_t n;
 
-  /* Copy to buffer */
-  while (n < len) {
-    uint8_t pin = (uart->u_txi + 1) % ABC_UART_TXBUF_SZ;
-    if (pin == uart->u_txo) break;
-    uart->u_txb[uart->u_txi] = buf[n];
-    uart->u_txi              = pin;
-    ++n;
-  }
+  /* Copy to ring */
+  n = ring_push(&uart->u_tx, buf, len);
 
   /* Start TX */
-  if (!nrf_drv_uart_tx_in_progress(&uart->u_hw)) {
-    nrf_drv_uart_tx(&uart->u_hw, uart->u_txb + uart->u_txo, 1);
-  }
+  __disable_irq();
+  _uart_tx_start(uart);
+  __enable_irq();
 
-  return n;
+  return (ssize_t)n;
+}
+
+/**
+ * Wait for all buffered data to be sent
+ *
+ * @param uart The UART to flush
+ */
+void
+uart_flush ( uart_s *uart )
+{
+  while (0 != ring_used(&uart->u_tx));
+  while (nrf_drv_uart_tx_in_progress(&uart->u_hw));
 }
 
 /* ****************************************************************************
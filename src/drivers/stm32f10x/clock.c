@@ -0,0 +1,107 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * STM32 Drivers - Clock
+ * 
+ * SysTick interrupt at 1kHz
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/clock.h"
+
+#include <stm32f10x.h>
+
+/*
+ * Module data
+ */
+static volatile uint32_t clock_ticks;
+
+/* ****************************************************************************
+ * IRQ Handler
+ * ***************************************************************************/
+
+void SysTick_Handler ( void );
+
+void
+SysTick_Handler ( void )
+{
+  ++clock_ticks;
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+clock_init ( void )
+{
+  SysTick_Config(SystemCoreClock / 1000);
+}
+
+uint32_t
+clock_ms ( void )
+{
+  return clock_ticks;
+}
+
+/*
+ * Tick count plus how far SysTick has counted down into the next. If it
+ * has reloaded with its interrupt held off (interrupts disabled, or called
+ * from a higher priority one) the tick is still pending and is added here.
+ */
+uint32_t
+clock_us ( void )
+{
+  uint32_t ticks, ms, val;
+
+  do {
+    ticks = clock_ticks;
+    ms    = ticks;
+    val   = SysTick->VAL;
+    if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+      val = SysTick->VAL; // after the reload
+      ++ms;
+    }
+  } while (ticks != clock_ticks);
+
+  return (ms * 1000) +
+         (((SysTick->LOAD - val) * 1000) / (SysTick->LOAD + 1));
+}
+
+/*
+ * Called with interrupts disabled, SysTick restarts from a whole tick
+ */
+void
+clock_skip ( uint32_t ms )
+{
+  clock_ticks += ms;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
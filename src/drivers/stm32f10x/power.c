@@ -0,0 +1,239 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * STM32 Drivers - Power
+ *
+ * SLEEP is WFI. STOP is the STM32 Stop mode (regulator in low power), where
+ * all the clocks bar LSE/LSI stop. The RTC, clocked from LSE at 1024Hz,
+ * keeps time across it and its alarm (EXTI17) wakes the CPU when the next
+ * timer is due.
+ *
+ * RX DMA stops with the clocks, so the USART1 RX pin is armed as an EXTI
+ * falling edge (the start bit) to wake up. The character being received
+ * at the time is lost (the HSE takes ~1ms to restart), which is why STOP
+ * is only used between GPS bursts. PPS (EXTI4) wakes it as well.
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/power.h"
+#include "hal/clock.h"
+
+#include <stm32f10x.h>
+
+/*
+ * RTC rate (LSE / (RTC_PRESCALER + 1)), ~1ms resolution
+ */
+#define RTC_HZ         (1024)
+#define RTC_PRESCALER  (32768 / RTC_HZ - 1)
+
+/*
+ * Longest wait for the LSE to start (in SysTick ms, it is slow to start)
+ */
+#define RTC_LSE_MS     (3000)
+
+/*
+ * Margin for leaving STOP (the HSE/PLL restart) in ms
+ */
+#define RTC_WAKE_MS    (2)
+
+/*
+ * Typical supply current (datasheet, 72MHz with the peripherals in use)
+ */
+const uint32_t power_mode_ua[POWER_MODES] = {
+  36000, /* RUN */
+  14400, /* SLEEP */
+     24, /* STOP (regulator in low power) */
+};
+
+/*
+ * Undefined interrupt vectors
+ */
+void RTCAlarm_IRQHandler ( void );
+void EXTI15_10_IRQHandler ( void );
+
+/*
+ * Module data
+ */
+static bool     power_rtc;       /**< RTC is running */
+static uint32_t power_frac;      /**< RTC ticks not yet passed to clock */
+
+/* ****************************************************************************
+ * IRQ Handlers
+ * ***************************************************************************/
+
+void
+RTCAlarm_IRQHandler ( void )
+{
+  EXTI_ClearITPendingBit(EXTI_Line17);
+  RTC_ClearITPendingBit(RTC_IT_ALR);
+}
+
+void
+EXTI15_10_IRQHandler ( void )
+{
+  EXTI_ClearITPendingBit(EXTI_Line10);
+}
+
+/* ****************************************************************************
+ * Helpers
+ * ***************************************************************************/
+
+/*
+ * Arm/disarm the wakeup sources that are only needed in STOP
+ */
+static void
+_power_wake_cfg ( FunctionalState en )
+{
+  EXTI_InitTypeDef ei;
+
+  ei.EXTI_Mode    = EXTI_Mode_Interrupt;
+  ei.EXTI_Line    = EXTI_Line10;
+  ei.EXTI_Trigger = EXTI_Trigger_Falling;
+  ei.EXTI_LineCmd = en;
+  EXTI_Init(&ei);
+  EXTI_ClearITPendingBit(EXTI_Line10);
+}
+
+/*
+ * Restart the HSE and PLL (STOP leaves the CPU running on HSI)
+ */
+static void
+_power_clock_restore ( void )
+{
+  RCC_HSEConfig(RCC_HSE_ON);
+  if (SUCCESS != RCC_WaitForHSEStartUp()) return;
+  RCC_PLLCmd(ENABLE);
+  while (RESET == RCC_GetFlagStatus(RCC_FLAG_PLLRDY));
+  RCC_SYSCLKConfig(RCC_SYSCLKSource_PLLCLK);
+  while (0x08 != RCC_GetSYSCLKSource());
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+power_rtc_init ( void )
+{
+  EXTI_InitTypeDef ei;
+  NVIC_InitTypeDef ni;
+  uint32_t         t;
+
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_PWR | RCC_APB1Periph_BKP, ENABLE);
+  PWR_BackupAccessCmd(ENABLE);
+
+  /* LSE (without it there is no STOP, SysTick is all there is) */
+  RCC_LSEConfig(RCC_LSE_ON);
+  t = clock_ms();
+  while (RESET == RCC_GetFlagStatus(RCC_FLAG_LSERDY))
+    if ((clock_ms() - t) > RTC_LSE_MS) return;
+  RCC_RTCCLKConfig(RCC_RTCCLKSource_LSE);
+  RCC_RTCCLKCmd(ENABLE);
+
+  /* RTC */
+  RTC_WaitForSynchro();
+  RTC_WaitForLastTask();
+  RTC_SetPrescaler(RTC_PRESCALER);
+  RTC_WaitForLastTask();
+  RTC_ITConfig(RTC_IT_ALR, ENABLE);
+  RTC_WaitForLastTask();
+
+  /* Alarm (EXTI17) */
+  ei.EXTI_Mode    = EXTI_Mode_Interrupt;
+  ei.EXTI_Line    = EXTI_Line17;
+  ei.EXTI_Trigger = EXTI_Trigger_Rising;
+  ei.EXTI_LineCmd = ENABLE;
+  EXTI_Init(&ei);
+
+  /* RX pin (armed in power_stop()) */
+  GPIO_EXTILineConfig(GPIO_PortSourceGPIOA, GPIO_PinSource10);
+  _power_wake_cfg(DISABLE);
+
+  ni.NVIC_IRQChannelPreemptionPriority = 0x03;
+  ni.NVIC_IRQChannelSubPriority        = 0x03;
+  ni.NVIC_IRQChannelCmd                = ENABLE;
+  ni.NVIC_IRQChannel                   = RTCAlarm_IRQn;
+  NVIC_Init(&ni);
+  ni.NVIC_IRQChannel                   = EXTI15_10_IRQn;
+  NVIC_Init(&ni);
+
+  power_rtc = true;
+}
+
+void
+power_sleep ( void )
+{
+  __DSB();
+  __WFI();
+}
+
+/*
+ * Interrupts are disabled, so the wakeup interrupt is only taken once the
+ * clocks are back and power_idle() returns
+ */
+bool
+power_stop ( uint32_t ms )
+{
+  uint32_t c0, ticks;
+
+  if (!power_rtc || (ms <= RTC_WAKE_MS)) return false;
+
+  /* Wake RTC_WAKE_MS early (capped to well inside the counter) */
+  ms -= RTC_WAKE_MS;
+  if (ms > 3600000) ms = 3600000;
+  ticks = (uint32_t)(((uint64_t)ms * RTC_HZ) / 1000);
+  if (0 == ticks) return false;
+
+  RTC_WaitForSynchro();
+  c0 = RTC_GetCounter();
+  RTC_WaitForLastTask();
+  RTC_SetAlarm(c0 + ticks);
+  RTC_WaitForLastTask();
+  EXTI_ClearITPendingBit(EXTI_Line17);
+  _power_wake_cfg(ENABLE);
+
+  /* Stop (SysTick with it, it would only wake us) */
+  SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+  PWR_EnterSTOPMode(PWR_Regulator_LowPower, PWR_STOPEntry_WFI);
+  _power_clock_restore();
+  _power_wake_cfg(DISABLE);
+
+  /* Account for the time stopped (RTC registers resync after STOP) */
+  RTC_WaitForSynchro();
+  power_frac += (RTC_GetCounter() - c0) * 1000;
+  clock_skip(power_frac / RTC_HZ);
+  power_frac %= RTC_HZ;
+  SysTick->VAL   = 0;
+  SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+
+  return true;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -26,11 +26,17 @@
  * STM32 Drivers - PPS input
  * 
  * External interrupt signal from PPS input pin
+ *
+ * The pin (PB4) is also TIM3 CH1 (partial remap), TIM3 free runs at 1MHz
+ * and captures the edge. The EXTI interrupt then works back from how far
+ * TIM3 has counted since to the edge's clock_us(). TIM3 stops with the
+ * clocks in STOP, EXTI4 still wakes the CPU but the edge is not captured.
  * ***************************************************************************/
 
 #include "board.h"
 #include "abc_misc.h"
 #include "hal/pps.h"
+#include "hal/clock.h"
 
 #include <stm32f10x.h>
 
@@ -43,12 +49,19 @@ void EXTI4_IRQHandler ( void );
 void
 EXTI4_IRQHandler ( void )
 {
-  static bool state = false;
-  if (EXTI_GetITStatus(EXTI_Line4) != RESET) {
-    state = !state;
-    if (state) GPIO_ResetBits(GPIOA, GPIO_Pin_5);
-    else       GPIO_SetBits(GPIOA, GPIO_Pin_5);
-    EXTI_ClearITPendingBit(EXTI_Line4);
+  uint16_t cc, now;
+  uint32_t us;
+
+  if (EXTI_GetITStatus(EXTI_Line4) == RESET) return;
+  EXTI_ClearITPendingBit(EXTI_Line4);
+
+  now = TIM_GetCounter(TIM3);
+  us  = clock_us();
+  if (RESET != TIM_GetFlagStatus(TIM3, TIM_FLAG_CC1)) {
+    cc = TIM_GetCapture1(TIM3); // clears the flag
+    pps_dispatch(us - (uint16_t)(now - cc), true);
+  } else {
+    pps_dispatch(us, false);
   }
 }
 
@@ -59,16 +72,35 @@ EXTI4_IRQHandler ( void )
 void
 pps_init ( void )
 {
-  GPIO_InitTypeDef gi;
-  EXTI_InitTypeDef ei;
-  NVIC_InitTypeDef ni;
+  GPIO_InitTypeDef        gi;
+  EXTI_InitTypeDef        ei;
+  NVIC_InitTypeDef        ni;
+  TIM_TimeBaseInitTypeDef ti;
+  TIM_ICInitTypeDef       ci;
 
   /* Setup GPIO */
-  RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOB, ENABLE);
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOB | RCC_APB2Periph_AFIO, ENABLE);
   gi.GPIO_Pin   = GPIO_Pin_4;
   gi.GPIO_Speed = GPIO_Speed_50MHz;
   gi.GPIO_Mode  = GPIO_Mode_IN_FLOATING;
   GPIO_Init(GPIOB, &gi);
+  GPIO_PinRemapConfig(GPIO_PartialRemap_TIM3, ENABLE);
+
+  /* Setup TIM3 (1MHz, the timer clock is HCLK as APB1 is divided) */
+  RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
+  TIM_TimeBaseStructInit(&ti);
+  ti.TIM_Prescaler     = (uint16_t)(SystemCoreClock / 1000000 - 1);
+  ti.TIM_Period        = 0xFFFF;
+  ti.TIM_CounterMode   = TIM_CounterMode_Up;
+  TIM_TimeBaseInit(TIM3, &ti);
+  ci.TIM_Channel       = TIM_Channel_1;
+  ci.TIM_ICPolarity    = TIM_ICPolarity_Rising;
+  ci.TIM_ICSelection   = TIM_ICSelection_DirectTI;
+  ci.TIM_ICPrescaler   = TIM_ICPSC_DIV1;
+  ci.TIM_ICFilter      = 0x3; // 8 samples, ignores ringing
+  TIM_ICInit(TIM3, &ci);
+  TIM_ClearFlag(TIM3, TIM_FLAG_CC1);
+  TIM_Cmd(TIM3, ENABLE);
 
   /* Setup NVIC */
   ni.NVIC_IRQChannel                   = EXTI4_IRQn;
@@ -85,18 +117,8 @@ pps_init ( void )
   ei.EXTI_LineCmd = ENABLE;
   GPIO_EXTILineConfig(GPIO_PortSourceGPIOB, GPIO_PinSource4);
   EXTI_Init(&ei);
-
-  /* TODO: debug */
-#if 0
-  RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA, ENABLE);
-  gi.GPIO_Pin   = GPIO_Pin_5;
-  gi.GPIO_Speed = GPIO_Speed_2MHz;
-  gi.GPIO_Mode  = GPIO_Mode_Out_PP;
-  GPIO_Init(GPIOA, &gi);
-#endif
 }
 
-
 /* ****************************************************************************
  * Editor Configuration
  *
@@ -28,7 +28,9 @@
  * Wrapper around STM standard peripheral library to support the custom HAL
  * interface
  *
- * This is NOT using DMA, it's polling the data in and out
+ * Transfers of SPI_DMA_MIN bytes or more are moved by DMA (SPI1 RX on DMA1
+ * channel 2, TX on channel 3), with a constant 0xFF source while receiving.
+ * Anything shorter (command bytes, R1 polling) is cheaper to poll.
  *
  * It's fixed as Master, 8-bit, CPOL=0, CPHA=1, MSB first
  * ***************************************************************************/
@@ -39,18 +41,39 @@
 
 #include <stm32f10x.h>
 
+/*
+ * Smallest transfer that is worth setting up DMA for
+ */
+#define SPI_DMA_MIN (16)
+
+/*
+ * Undefined interrupt vectors
+ */
+void DMA1_Channel2_IRQHandler ( void );
+
 /*
  * Structure used to represent SPI
  */
 struct spi
 {
-  SPI_TypeDef *s_hw;                     /**< HW interface */
+  SPI_TypeDef         *s_hw;             /**< HW interface */
+  DMA_Channel_TypeDef *s_dma_rx;         /**< RX DMA channel */
+  DMA_Channel_TypeDef *s_dma_tx;         /**< TX DMA channel */
+  volatile bool        s_busy;           /**< Transfer in progress */
+  volatile bool        s_ok;             /**< Last transfer succeeded */
+  spi_seg_s            s_seg[2];         /**< spi_tx_rx_async() segments */
+  const spi_seg_s     *s_segs;           /**< Segments still to transfer */
+  size_t               s_nsegs;          /**< Number of segments left */
+  spi_cb               s_cb;             /**< Completion callback */
+  void                *s_arg;            /**< Completion callback arg */
 };
 
 /*
  * Module data
  */
-static spi_s spis[2];
+static spi_s         spis[2];
+static const uint8_t spi_ones = 0xFF;    /**< TX source while receiving */
+static uint8_t       spi_sink;           /**< RX sink while transmitting */
 
 /* ****************************************************************************
  * Hardware Setup
@@ -75,6 +98,10 @@ _spi1_init ( void )
   gi.GPIO_Speed = GPIO_Speed_50MHz;
   gi.GPIO_Mode  = GPIO_Mode_AF_PP;
   GPIO_Init(GPIOA, &gi);
+
+  /* Enable DMA */
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+  NVIC_EnableIRQ(DMA1_Channel2_IRQn);
 #endif
 }
 
@@ -88,6 +115,165 @@ _spi2_init ( void )
 #endif
 }
 
+/* ****************************************************************************
+ * Transfers
+ * ***************************************************************************/
+
+/*
+ * Polled (full-duplex) transfer
+ */
+static void
+_spi_poll ( spi_s *spi, const spi_seg_s *segs, size_t nsegs )
+{
+  size_t  i;
+  uint8_t b;
+
+  for (; nsegs; --nsegs, ++segs) {
+    for (i = 0; i < segs->ss_len; i++) {
+      spi->s_hw->DR = segs->ss_tx ? segs->ss_tx[i] : 0xFF;
+      while ((spi->s_hw->SR & SPI_I2S_FLAG_RXNE) == 0);
+      b = (uint8_t)spi->s_hw->DR;
+      if (segs->ss_rx) segs->ss_rx[i] = b;
+    }
+  }
+}
+
+/*
+ * Configure a DMA channel
+ */
+static void
+_spi_dma_config
+  ( spi_s *spi, DMA_Channel_TypeDef *ch, uint32_t dir,
+    const uint8_t *buf, bool inc, size_t len )
+{
+  DMA_InitTypeDef di;
+
+  di.DMA_PeripheralBaseAddr = (uint32_t)&spi->s_hw->DR;
+  di.DMA_MemoryBaseAddr     = (uint32_t)buf;
+  di.DMA_DIR                = dir;
+  di.DMA_BufferSize         = (uint16_t)len;
+  di.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
+  di.DMA_MemoryInc          = inc ? DMA_MemoryInc_Enable
+                                  : DMA_MemoryInc_Disable;
+  di.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  di.DMA_MemoryDataSize     = DMA_MemoryDataSize_Byte;
+  di.DMA_Mode               = DMA_Mode_Normal;
+  di.DMA_Priority           = DMA_Priority_High;
+  di.DMA_M2M                = DMA_M2M_Disable;
+  DMA_Init(ch, &di);
+}
+
+/*
+ * Start a DMA transfer of one segment
+ *
+ * RX is armed first so that nothing is lost once TX starts clocking, and it
+ * is the RX channel that signals completion (the last byte has been clocked
+ * back in, not just loaded into DR)
+ */
+static void
+_spi_dma_start
+  ( spi_s *spi, const uint8_t *txbuf, uint8_t *rxbuf, size_t len )
+{
+  _spi_dma_config(spi, spi->s_dma_rx, DMA_DIR_PeripheralSRC,
+                  rxbuf ? rxbuf : &spi_sink, NULL != rxbuf, len);
+  _spi_dma_config(spi, spi->s_dma_tx, DMA_DIR_PeripheralDST,
+                  txbuf ? txbuf : &spi_ones, NULL != txbuf, len);
+  DMA_ITConfig(spi->s_dma_rx, DMA_IT_TC | DMA_IT_TE, ENABLE);
+  DMA_Cmd(spi->s_dma_rx, ENABLE);
+  DMA_Cmd(spi->s_dma_tx, ENABLE);
+}
+
+/*
+ * Start the next (non-empty) segment
+ *
+ * @return false if there is nothing left to transfer
+ */
+static bool
+_spi_dma_next ( spi_s *spi )
+{
+  const spi_seg_s *seg;
+
+  while (spi->s_nsegs) {
+    seg = spi->s_segs++;
+    --spi->s_nsegs;
+    if (0 == seg->ss_len) continue;
+    _spi_dma_start(spi, seg->ss_tx, seg->ss_rx, seg->ss_len);
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Complete a transfer
+ */
+static void
+_spi_done ( spi_s *spi, bool ok )
+{
+  spi_cb cb = spi->s_cb;
+
+  spi->s_ok   = ok;
+  spi->s_cb   = NULL;
+  spi->s_busy = false;
+  if (NULL != cb) cb(spi->s_arg, ok);
+}
+
+/*
+ * Start a transfer of a list of segments
+ */
+static bool
+_spi_start
+  ( spi_s *spi, const spi_seg_s *segs, size_t nsegs, spi_cb cb, void *arg )
+{
+  size_t i, len = 0;
+  bool   dma    = (NULL != spi->s_dma_rx);
+
+  for (i = 0; i < nsegs; i++) {
+    len += segs[i].ss_len;
+    if (segs[i].ss_len > 0xFFFF) dma = false;
+  }
+
+  /* Too short (or too long) for DMA */
+  if (!dma || (len < SPI_DMA_MIN)) {
+    _spi_poll(spi, segs, nsegs);
+    spi->s_ok = true;
+    if (NULL != cb) cb(arg, true);
+    return true;
+  }
+
+  /* Start */
+  spi->s_busy  = true;
+  spi->s_cb    = cb;
+  spi->s_arg   = arg;
+  spi->s_segs  = segs;
+  spi->s_nsegs = nsegs;
+  if (!_spi_dma_next(spi))
+    _spi_done(spi, true);
+
+  return true;
+}
+
+/* ****************************************************************************
+ * IRQ Handlers
+ * ***************************************************************************/
+
+void
+DMA1_Channel2_IRQHandler ( void )
+{
+  spi_s *spi = spis + 0;
+  bool   ok  = !DMA_GetITStatus(DMA1_IT_TE2);
+
+  DMA_ClearITPendingBit(DMA1_IT_GL2);
+  DMA_Cmd(spi->s_dma_rx, DISABLE);
+  DMA_Cmd(spi->s_dma_tx, DISABLE);
+
+  /* Segment complete, start the next */
+  if (ok && _spi_dma_next(spi))
+    return;
+
+  _spi_done(spi, ok);
+}
+
 /* ****************************************************************************
  * Public Interface
  * ***************************************************************************/
@@ -101,8 +287,10 @@ spi_init ( void )
   _spi1_init();
   _spi2_init();
 
-  spis[0].s_hw = SPI1;
-  spis[1].s_hw = NULL;
+  spis[0].s_hw     = SPI1;
+  spis[0].s_dma_rx = DMA1_Channel2;
+  spis[0].s_dma_tx = DMA1_Channel3;
+  spis[1].s_hw     = NULL;
 }
 
 /*
@@ -139,6 +327,9 @@ spi_open ( uint8_t idx, uint32_t speed )
 	SPI_Cmd (spis[idx].s_hw, DISABLE);
 	SPI_Init(spis[idx].s_hw, &si);
 	SPI_Cmd (spis[idx].s_hw, ENABLE);
+  if (NULL != spis[idx].s_dma_rx)
+    SPI_I2S_DMACmd(spis[idx].s_hw, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx,
+                   ENABLE);
 
   /* Return object */
   return spis + idx;
@@ -152,7 +343,29 @@ spi_open ( uint8_t idx, uint32_t speed )
 void
 spi_close ( spi_s *spi )
 {
-	SPI_Cmd (spi->s_hw, DISABLE);
+  while (spi->s_busy);
+  SPI_Cmd(spi->s_hw, DISABLE);
+}
+
+/*
+ * Send and receive (asynchronous)
+ */
+bool spi_tx_rx_async
+  ( spi_s *spi,
+    const uint8_t *txbuf, const size_t txlen,
+          uint8_t *rxbuf, const size_t rxlen,
+    spi_cb cb, void *arg )
+{
+  /* Wait for the previous transfer */
+  while (spi->s_busy);
+
+  spi->s_seg[0].ss_tx  = txbuf;
+  spi->s_seg[0].ss_rx  = NULL;
+  spi->s_seg[0].ss_len = txlen;
+  spi->s_seg[1].ss_tx  = NULL;
+  spi->s_seg[1].ss_rx  = rxbuf;
+  spi->s_seg[1].ss_len = rxlen;
+  return _spi_start(spi, spi->s_seg, 2, cb, arg);
 }
 
 /*
@@ -163,27 +376,33 @@ bool spi_tx_rx
     const uint8_t *txbuf, const size_t txlen,
           uint8_t *rxbuf, const size_t rxlen )
 {
-  size_t i;
+  if (!spi_tx_rx_async(spi, txbuf, txlen, rxbuf, rxlen, NULL, NULL))
+    return false;
+  while (spi->s_busy);
+  return spi->s_ok;
+}
 
-  /* Send data */
-  i = 0;
-  while (i < txlen) {
-    spi->s_hw->DR = txbuf[i];
-	  while ((spi->s_hw->SR & SPI_I2S_FLAG_RXNE) == 0);
-	  (void)spi->s_hw->DR;
-	  ++i;
-  }
+/*
+ * Full-duplex transfer
+ */
+bool
+spi_xfer ( spi_s *spi, const uint8_t *txbuf, uint8_t *rxbuf, size_t len )
+{
+  spi_seg_s seg = { txbuf, rxbuf, len };
+  return spi_xfer_list(spi, &seg, 1);
+}
 
-  /* Receive data */
-  i = 0;
-  while (i < rxlen) {
-    spi->s_hw->DR = 0xFF;
-	  while ((spi->s_hw->SR & SPI_I2S_FLAG_RXNE) == 0);
-    rxbuf[i] = (uint8_t)spi->s_hw->DR;
-    ++i;
-  }
-    
-  return true;
+/*
+ * Full-duplex scatter-gather transfer
+ */
+bool
+spi_xfer_list ( spi_s *spi, const spi_seg_s *segs, size_t nsegs )
+{
+  while (spi->s_busy);
+  if (!_spi_start(spi, segs, nsegs, NULL, NULL))
+    return false;
+  while (spi->s_busy);
+  return spi->s_ok;
 }
 
 /* ****************************************************************************
@@ -27,6 +27,18 @@
  * 
  * Wrapper around STM standard peripheral library to support the custom HAL
  * interface
+ *
+ * RX is received by circular DMA (USART1 on DMA1 channel 5, USART2 on
+ * channel 6) straight into the storage of the RX ring, so there is no
+ * per-byte interrupt. The DMA is the producer: what it has written since
+ * the last look is committed to the ring when the reader asks for data. If
+ * that is more than the ring had free the reader fell behind and the
+ * oldest data was overwritten, it is skipped and counted as overflow (a
+ * whole buffer behind cannot be detected). The reader is notified at the
+ * end of every burst (line IDLE) and every half buffer (DMA HT/TC), so it
+ * can sleep in between.
+ *
+ * TX is a ring drained a byte at a time by the TXE interrupt.
  * ***************************************************************************/
 
 #ifndef ABC_DRIVERS_STM32_UART_H
@@ -35,14 +47,22 @@
 #include "board.h"
 #include "abc_misc.h"
 #include "hal/uart.h"
+#include "ring.h"
 
 #include <stm32f10x.h>
+#include <string.h>
+
+#if !RING_POW2(ABC_UART_RXBUF_SZ) || !RING_POW2(ABC_UART_TXBUF_SZ)
+#error "UART buffer sizes must be powers of 2"
+#endif
 
 /*
  * Undefined interrupt vectors
  */
 void USART1_IRQHandler ( void );
 void USART2_IRQHandler ( void );
+void DMA1_Channel5_IRQHandler ( void );
+void DMA1_Channel6_IRQHandler ( void );
 
 /*
  * Structure used to represent UART
@@ -50,9 +70,16 @@ void USART2_IRQHandler ( void );
 struct uart
 {
   USART_TypeDef *u_hw;                     /**< HW interface */
-  uint8_t        u_rxb[ABC_UART_RXBUF_SZ]; /**< RX buffer */
-  uint8_t        u_rxi;                    /**< RX buffer input ptr */
-  uint8_t        u_rxo;                    /**< RX buffer output ptr */
+  DMA_Channel_TypeDef *u_dma;              /**< RX DMA channel */
+  uint32_t       u_dma_it;                 /**< RX DMA interrupt flags */
+  uart_cb        u_cb;                     /**< RX notification */
+  void          *u_cb_arg;                 /**< RX notification arg */
+  uint32_t       u_baud;                   /**< Baud rate (0 if closed) */
+  ring_s         u_rx;                     /**< RX ring (filled by DMA) */
+  uint16_t       u_rxin;                   /**< DMA position committed */
+  uint8_t        u_rxb[ABC_UART_RXBUF_SZ]; /**< RX ring storage */
+  ring_s         u_tx;                     /**< TX ring */
+  uint8_t        u_txb[ABC_UART_TXBUF_SZ]; /**< TX ring storage */
 };
 
 /*
@@ -88,7 +115,9 @@ _usart1_init ( void )
   GPIO_Init(GPIOA, &gi);
 
   /* Enable interrupts */
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
   NVIC_EnableIRQ(USART1_IRQn);
+  NVIC_EnableIRQ(DMA1_Channel5_IRQn);
 #endif
 }
 
@@ -116,7 +145,9 @@ _usart2_init ( void )
   GPIO_Init(GPIOA, &gi);
 
   /* Enable interrupts */
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
   NVIC_EnableIRQ(USART2_IRQn);
+  NVIC_EnableIRQ(DMA1_Channel6_IRQn);
 #endif
 }
 
@@ -127,22 +158,44 @@ _usart2_init ( void )
 static void
 _uart_irq_handler ( USART_TypeDef *hw )
 {
-  uint8_t c;
-
-  /* Nothing available */
-  if (!USART_GetITStatus(hw, USART_IT_RXNE)) return;
-
-  /* Read */
-  c = (uint8_t)USART_ReceiveData(hw);
+  uart_s *uart = NULL;
 
   for (uint8_t i = 0; i < ARRAY_SIZE(uarts); i++) {
-    if (hw != uarts[i].u_hw) continue;
-    uarts[i].u_rxb[uarts[i].u_rxi++] = c;
-    if (uarts[i].u_rxi >= ABC_UART_RXBUF_SZ)
-      uarts[i].u_rxi = 0;
+    if (hw == uarts[i].u_hw) uart = uarts + i;
+  }
+  if (NULL == uart) return;
+
+  /*
+   * Line gone idle (end of a burst, e.g. a sentence). The data is already
+   * in the buffer, this just wakes the CPU once per burst rather than
+   * once per byte. Cleared by reading SR then DR.
+   */
+  if (USART_GetITStatus(hw, USART_IT_IDLE)) {
+    (void)USART_ReceiveData(hw);
+    if (NULL != uart->u_cb) uart->u_cb(uart->u_cb_arg);
+  }
+
+  /* Write (stop once the ring is drained) */
+  if (USART_GetITStatus(hw, USART_IT_TXE)) {
+    uint8_t b;
+    if (0 == ring_pop(&uart->u_tx, &b, 1))
+      USART_ITConfig(hw, USART_IT_TXE, DISABLE);
+    else
+      USART_SendData(hw, b);
   }
 }
 
+/*
+ * RX DMA half/all of the buffer filled (a burst longer than that would
+ * overrun before the line went idle)
+ */
+static void
+_uart_dma_irq_handler ( uart_s *uart )
+{
+  DMA_ClearITPendingBit(uart->u_dma_it);
+  if (NULL != uart->u_cb) uart->u_cb(uart->u_cb_arg);
+}
+
 void
 USART1_IRQHandler ( void )
 {
@@ -155,6 +208,18 @@ USART2_IRQHandler ( void )
   _uart_irq_handler(USART2);
 }
 
+void
+DMA1_Channel5_IRQHandler ( void )
+{
+  _uart_dma_irq_handler(uarts + 0);
+}
+
+void
+DMA1_Channel6_IRQHandler ( void )
+{
+  _uart_dma_irq_handler(uarts + 1);
+}
+
 /* ****************************************************************************
  * Public Interface
  * ***************************************************************************/
@@ -168,8 +233,17 @@ uart_init ( void )
   _usart1_init();
   _usart2_init();
 
-  uarts[0].u_hw = USART1;
-  uarts[1].u_hw = USART2;
+  uarts[0].u_hw  = USART1;
+  uarts[0].u_dma    = DMA1_Channel5;
+  uarts[0].u_dma_it = DMA1_IT_GL5;
+  uarts[1].u_hw     = USART2;
+  uarts[1].u_dma    = DMA1_Channel6;
+  uarts[1].u_dma_it = DMA1_IT_GL6;
+
+  for (uint8_t i = 0; i < ARRAY_SIZE(uarts); i++) {
+    ring_init(&uarts[i].u_rx, uarts[i].u_rxb, sizeof(uarts[i].u_rxb));
+    ring_init(&uarts[i].u_tx, uarts[i].u_txb, sizeof(uarts[i].u_txb));
+  }
 }
 
 /*
@@ -179,6 +253,7 @@ uart_s *
 uart_open ( uint8_t idx, uint32_t baud )
 {
   USART_InitTypeDef ui;
+  DMA_InitTypeDef   di;
 
   /* Invalid */
   if (idx >= ARRAY_SIZE(uarts))
@@ -186,6 +261,13 @@ uart_open ( uint8_t idx, uint32_t baud )
   if (NULL == uarts[idx].u_hw)
     return NULL;
 
+  /* Already open, finish sending at the old rate before changing */
+  if (0 != uarts[idx].u_baud) {
+    uart_flush(uarts + idx);
+    USART_Cmd(uarts[idx].u_hw, DISABLE);
+  }
+  uarts[idx].u_baud = baud;
+
   /* Configure the UART */
   ui.USART_BaudRate            = baud;
   ui.USART_WordLength          = USART_WordLength_8b;  
@@ -195,9 +277,29 @@ uart_open ( uint8_t idx, uint32_t baud )
   ui.USART_HardwareFlowControl = USART_HardwareFlowControl_None;
   USART_Init(uarts[idx].u_hw, &ui);
 
+  /* Receive into the buffer by circular DMA */
+  DMA_Cmd(uarts[idx].u_dma, DISABLE);
+  di.DMA_PeripheralBaseAddr = (uint32_t)&uarts[idx].u_hw->DR;
+  di.DMA_MemoryBaseAddr     = (uint32_t)uarts[idx].u_rxb;
+  di.DMA_DIR                = DMA_DIR_PeripheralSRC;
+  di.DMA_BufferSize         = ABC_UART_RXBUF_SZ;
+  di.DMA_PeripheralInc      = DMA_PeripheralInc_Disable;
+  di.DMA_MemoryInc          = DMA_MemoryInc_Enable;
+  di.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  di.DMA_MemoryDataSize     = DMA_MemoryDataSize_Byte;
+  di.DMA_Mode               = DMA_Mode_Circular;
+  di.DMA_Priority           = DMA_Priority_Medium;
+  di.DMA_M2M                = DMA_M2M_Disable;
+  DMA_Init(uarts[idx].u_dma, &di);
+  DMA_ITConfig(uarts[idx].u_dma, DMA_IT_HT | DMA_IT_TC, ENABLE);
+  ring_reset(&uarts[idx].u_rx);
+  uarts[idx].u_rxin = 0;
+  DMA_Cmd(uarts[idx].u_dma, ENABLE);
+
   /* Enable */
+  USART_DMACmd(uarts[idx].u_hw, USART_DMAReq_Rx, ENABLE);
   USART_Cmd(uarts[idx].u_hw, ENABLE);
-  USART_ITConfig(uarts[idx].u_hw, USART_IT_RXNE, ENABLE);
+  USART_ITConfig(uarts[idx].u_hw, USART_IT_IDLE, ENABLE);
 
   /* Return object */
   return uarts + idx;
@@ -211,9 +313,14 @@ uart_open ( uint8_t idx, uint32_t baud )
 void
 uart_close ( uart_s *uart )
 {
-  USART_ITConfig(uart->u_hw, USART_IT_RXNE, DISABLE);
+  uart_flush(uart);
+  USART_ITConfig(uart->u_hw, USART_IT_IDLE, DISABLE);
+  USART_DMACmd(uart->u_hw, USART_DMAReq_Rx, DISABLE);
+  DMA_ITConfig(uart->u_dma, DMA_IT_HT | DMA_IT_TC, DISABLE);
+  DMA_Cmd(uart->u_dma, DISABLE);
   USART_Cmd(uart->u_hw, DISABLE);
   USART_DeInit(uart->u_hw);
+  uart->u_baud = 0;
 }
 
 /**
@@ -228,18 +335,80 @@ uart_close ( uart_s *uart )
 ssize_t
 uart_read ( uart_s *uart, uint8_t *buf, size_t len )
 {
-  ssize_t n = 0;
-  while ((uart->u_rxi != uart->u_rxo) && (0 != len)) {
-    *buf = uart->u_rxb[uart->u_rxo];
-    ++uart->u_rxo;
-    if (uart->u_rxo >= ABC_UART_RXBUF_SZ)
-      uart->u_rxo = 0;
-    ++n;
-    --len;
+  const uint8_t *p;
+  ssize_t n = 0, c;
+
+  while (0 != len) {
+    c = uart_peek(uart, &p);
+    if (0 >= c) break;
+    if ((size_t)c > len) c = (ssize_t)len;
+    memcpy(buf, p, (size_t)c);
+    uart_consume(uart, (size_t)c);
+    buf += c;
+    len -= (size_t)c;
+    n   += c;
   }
   return n;
 }
 
+/**
+ * Get the received data without copying it
+ *
+ * @param uart The UART to read from
+ * @param buf  Returns a pointer to the data (valid until uart_consume)
+ *
+ * @return The number of bytes available (<0 indicates an error)
+ */
+ssize_t
+uart_peek ( uart_s *uart, const uint8_t **buf )
+{
+  size_t   n, room;
+
+  /* DMA write position */
+  uint16_t in = (uint16_t)(ABC_UART_RXBUF_SZ - uart->u_dma->CNDTR);
+  if (in >= ABC_UART_RXBUF_SZ) in = 0;
+
+  /* Commit what has arrived, skipping anything overwritten */
+  n = (uint16_t)(in - uart->u_rxin) % ABC_UART_RXBUF_SZ;
+  uart->u_rxin = in;
+  room = ring_free(&uart->u_rx);
+  if (n > room) {
+    ring_consume(&uart->u_rx, n - room);
+    ring_drop(&uart->u_rx, n - room);
+  }
+  ring_commit(&uart->u_rx, n);
+
+  return (ssize_t)ring_peek(&uart->u_rx, buf);
+}
+
+/**
+ * Release data returned by uart_peek()
+ *
+ * @param uart The UART to release data from
+ * @param len  The number of bytes processed
+ */
+void
+uart_consume ( uart_s *uart, size_t len )
+{
+  ring_consume(&uart->u_rx, len);
+}
+
+/**
+ * Be told when data has been received
+ *
+ * @param uart The UART
+ * @param cb   The function to call (NULL to stop)
+ * @param arg  Passed to cb
+ */
+void
+uart_set_callback ( uart_s *uart, uart_cb cb, void *arg )
+{
+  __disable_irq();
+  uart->u_cb     = cb;
+  uart->u_cb_arg = arg;
+  __enable_irq();
+}
+
 /**
  * Write to the UART
  *
@@ -252,14 +421,28 @@ uart_read ( uart_s *uart, uint8_t *buf, size_t len )
 ssize_t
 uart_write ( uart_s *uart, const uint8_t *buf, size_t len )
 {
-  ssize_t n = 0;
-  while ((0 != len) && (SET == USART_GetFlagStatus(USART1, USART_FLAG_TXE))) {
-    USART_SendData(uart->u_hw, *buf);
-    ++buf;
-    --len;
-    ++n;
-  }
-  return n;
+  size_t n;
+
+  /* Copy to ring */
+  n = ring_push(&uart->u_tx, buf, len);
+
+  /* Start TX (the IRQ drains the ring) */
+  if (0 != n)
+    USART_ITConfig(uart->u_hw, USART_IT_TXE, ENABLE);
+
+  return (ssize_t)n;
+}
+
+/**
+ * Wait for all buffered data to be sent
+ *
+ * @param uart The UART to flush
+ */
+void
+uart_flush ( uart_s *uart )
+{
+  while (0 != ring_used(&uart->u_tx));
+  while (RESET == USART_GetFlagStatus(uart->u_hw, USART_FLAG_TC));
 }
 
 #endif /* ABC_HAL_UART_H */
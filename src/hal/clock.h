@@ -0,0 +1,70 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * HAL - Clock
+ *
+ * Free running millisecond tick, for timeouts and the like. It wraps every
+ * ~49 days, so compare differences and never absolute values.
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_HAL_CLOCK_H
+#define ABC_HAL_CLOCK_H
+
+#include "types.h"
+
+/**
+ * Initialise (and start) the clock
+ */
+void     clock_init ( void );
+
+/**
+ * Get the time
+ *
+ * @return Milliseconds since clock_init()
+ */
+uint32_t clock_ms ( void );
+
+/**
+ * Get the time, finer grained (for timing code, it wraps every ~71 minutes)
+ *
+ * @return Microseconds since clock_init()
+ */
+uint32_t clock_us ( void );
+
+/**
+ * Account for time the tick was stopped (see hal/power.h)
+ *
+ * @param ms Milliseconds to move the clock on by
+ */
+void     clock_skip ( uint32_t ms );
+
+#endif /* ABC_HAL_CLOCK_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,66 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * HAL - CPU
+ *
+ * Interrupt masking and sleep, for waiting on interrupts without missing
+ * one:
+ *
+ *   cpu_irq_disable();
+ *   if (nothing to do) cpu_wait();
+ *   cpu_irq_enable();
+ *
+ * An interrupt that becomes pending while masked still ends cpu_wait(), it
+ * is then taken once they are enabled again.
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_HAL_CPU_H
+#define ABC_HAL_CPU_H
+
+#include "types.h"
+
+/**
+ * Mask interrupts
+ */
+void cpu_irq_disable ( void );
+
+/**
+ * Unmask interrupts
+ */
+void cpu_irq_enable ( void );
+
+/**
+ * Sleep until an interrupt is pending (at the latest the next clock tick)
+ */
+void cpu_wait ( void );
+
+#endif /* ABC_HAL_CPU_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
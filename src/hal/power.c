@@ -0,0 +1,144 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * HAL - Power management
+ *
+ * Mode choice and accounting, common to all platforms (the drivers only
+ * provide the modes themselves)
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/power.h"
+#include "hal/clock.h"
+#include "hal/trace.h"
+
+/* ****************************************************************************
+ * State
+ * ***************************************************************************/
+
+static uint32_t          power_start;   /**< power_init() (clock_ms) */
+static volatile uint32_t power_holds;   /**< power_hold() count */
+static volatile uint32_t power_rx;      /**< Last activity (clock_ms) */
+static power_stats_s     power_st;      /**< SLEEP/STOP accounting */
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+power_init ( void )
+{
+  power_start = power_rx = clock_ms();
+  power_rtc_init();
+}
+
+void
+power_idle ( uint32_t ms )
+{
+  uint32_t     t0 = clock_us();
+  power_mode_t m  = POWER_SLEEP;
+
+  if ((0 == power_holds) && (ms >= ABC_POWER_STOP_MIN_MS) &&
+      ((uint32_t)(clock_ms() - power_rx) >= ABC_POWER_QUIET_MS) &&
+      power_stop(ms))
+    m = POWER_STOP;
+  else
+    power_sleep();
+
+  power_st.ps_us[m] += (uint32_t)(clock_us() - t0);
+  ++power_st.ps_entries[m];
+}
+
+void
+power_hold ( void )
+{
+  __atomic_add_fetch(&power_holds, 1, __ATOMIC_RELAXED);
+}
+
+void
+power_release ( void )
+{
+  __atomic_sub_fetch(&power_holds, 1, __ATOMIC_RELAXED);
+}
+
+void
+power_activity ( void )
+{
+  power_rx = clock_ms();
+}
+
+void
+power_stats ( power_stats_s *ps )
+{
+  uint64_t total = (uint64_t)(uint32_t)(clock_ms() - power_start) * 1000;
+  size_t   i;
+
+  *ps = power_st;
+  ps->ps_us[POWER_RUN] = 0;
+  if (total > ps->ps_us[POWER_SLEEP] + ps->ps_us[POWER_STOP])
+    ps->ps_us[POWER_RUN] = total - ps->ps_us[POWER_SLEEP] -
+                           ps->ps_us[POWER_STOP];
+
+  /* uA x us = 1e-12 As, nAh = 3.6e-6 As */
+  ps->ps_nah = 0;
+  for (i = 0; i < POWER_MODES; i++)
+    ps->ps_nah += ps->ps_us[i] * power_mode_ua[i];
+  ps->ps_nah /= 3600000;
+}
+
+void
+power_report ( void )
+{
+  static const char *names[] = { "run", "sleep", "stop" };
+  power_stats_s ps;
+  uint64_t      total = 0, ua;
+  size_t        i;
+
+  power_stats(&ps);
+  for (i = 0; i < POWER_MODES; i++)
+    total += ps.ps_us[i];
+  if (0 == total) return;
+
+  for (i = 0; i < POWER_MODES; i++)
+    trace_printf("power: %-5s %3lu.%lu%% (%lu entries)\n", names[i],
+                 (unsigned long)(ps.ps_us[i] * 100 / total),
+                 (unsigned long)(ps.ps_us[i] * 1000 / total % 10),
+                 (unsigned long)ps.ps_entries[i]);
+
+  /* Average current, and what that would get from the battery */
+  ua = ps.ps_nah * 3600000 / total;
+  trace_printf("power: %lu.%03lu mAh, %luuA average, ~%luh on %umAh\n",
+               (unsigned long)(ps.ps_nah / 1000000),
+               (unsigned long)(ps.ps_nah / 1000 % 1000), (unsigned long)ua,
+               (unsigned long)(ua ? ABC_POWER_BATTERY_MAH * 1000ull / ua : 0),
+               ABC_POWER_BATTERY_MAH);
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
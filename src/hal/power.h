@@ -0,0 +1,154 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * HAL - Power management
+ *
+ * Chooses how deeply to sleep when there is nothing to do, and keeps count
+ * of the time spent in each mode:
+ *
+ *   RUN   - executing
+ *   SLEEP - core stopped, clocks and peripherals running (woken by any
+ *           interrupt, including the 1ms tick)
+ *   STOP  - tickless: the tick is stopped and the RTC keeps time and wakes
+ *           the CPU when it is next needed. On STM32 this is STOP mode, the
+ *           clocks stop and RX DMA with them, so it is woken by the UART RX
+ *           pin (losing the first characters) or PPS. On nRF52 it's System
+ *           ON idle, EasyDMA carries on receiving.
+ *
+ * STOP is only used when nothing holds the power (power_hold()), there has
+ * been no receive activity for ABC_POWER_QUIET_MS and nothing is due for
+ * at least ABC_POWER_STOP_MIN_MS.
+ *
+ * The time in each mode, weighted by the typical supply current of the MCU
+ * in it (power_mode_ua), gives the charge used, to compare builds against
+ * each other rather than to predict the battery life exactly.
+ * ***************************************************************************/
+
+#ifndef ABC_HAL_POWER_H
+#define ABC_HAL_POWER_H
+
+#include "types.h"
+
+/**
+ * No deadline
+ */
+#define POWER_FOREVER (0xFFFFFFFFu)
+
+/**
+ * Modes
+ */
+typedef enum power_mode
+{
+  POWER_RUN,
+  POWER_SLEEP,
+  POWER_STOP,
+  POWER_MODES
+} power_mode_t;
+
+/**
+ * Statistics
+ */
+typedef struct power_stats
+{
+  uint64_t ps_us[POWER_MODES];          /**< Time in each mode */
+  uint32_t ps_entries[POWER_MODES];     /**< Times each was entered */
+  uint64_t ps_nah;                      /**< Charge used (nAh) */
+} power_stats_s;
+
+/**
+ * Typical supply current in each mode (uA, provided by the driver)
+ */
+extern const uint32_t power_mode_ua[POWER_MODES];
+
+/**
+ * Initialise (starts the RTC)
+ */
+void power_init ( void );
+
+/**
+ * Sleep until an interrupt, or at most ms
+ *
+ * Called with interrupts disabled (see hal/cpu.h), once there is nothing
+ * to do. The clock (clock_ms()) is correct again on return.
+ *
+ * @param ms Time until something is due (POWER_FOREVER if nothing)
+ */
+void power_idle ( uint32_t ms );
+
+/**
+ * Keep out of STOP (e.g. data is about to arrive), these nest
+ */
+void power_hold ( void );
+
+/**
+ * Undo power_hold()
+ */
+void power_release ( void );
+
+/**
+ * Note receive activity (any context, including interrupts)
+ */
+void power_activity ( void );
+
+/**
+ * Get the statistics (up to now)
+ */
+void power_stats ( power_stats_s *ps );
+
+/**
+ * Trace the statistics
+ */
+void power_report ( void );
+
+/*
+ * Driver interface (for power_idle())
+ */
+
+/**
+ * Start the RTC
+ */
+void     power_rtc_init ( void );
+
+/**
+ * Sleep (SLEEP mode) until an interrupt
+ */
+void     power_sleep ( void );
+
+/**
+ * Stop (STOP mode) until an interrupt, or at most ms
+ *
+ * The time stopped is passed on to clock_skip()
+ *
+ * @return false if the time is too short to stop
+ */
+bool     power_stop ( uint32_t ms );
+
+#endif /* ABC_HAL_POWER_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,92 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * HAL - 1PPS input
+ *
+ * Listeners, common to all platforms (the drivers only capture the edge)
+ * ***************************************************************************/
+
+#include "board.h"
+#include "abc_misc.h"
+#include "hal/pps.h"
+
+/* ****************************************************************************
+ * State
+ * ***************************************************************************/
+
+static pps_cb            pps_cbs[PPS_CB_MAX];
+static volatile uint32_t pps_edges;     /**< Edges seen */
+static volatile uint32_t pps_exact;     /**< Of which captured */
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+pps_add_callback ( pps_cb cb )
+{
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(pps_cbs); i++) {
+    if (NULL == pps_cbs[i]) {
+      pps_cbs[i] = cb;
+      return;
+    }
+  }
+}
+
+void
+pps_rem_callback ( pps_cb cb )
+{
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(pps_cbs); i++)
+    if (cb == pps_cbs[i]) pps_cbs[i] = NULL;
+}
+
+uint32_t
+pps_count ( uint32_t *exact )
+{
+  if (NULL != exact) *exact = pps_exact;
+  return pps_edges;
+}
+
+void
+pps_dispatch ( uint32_t us, bool exact )
+{
+  pps_cb cb;
+  size_t i;
+
+  ++pps_edges;
+  if (exact) ++pps_exact;
+  for (i = 0; i < ARRAY_SIZE(pps_cbs); i++)
+    if (NULL != (cb = pps_cbs[i])) cb(us, exact);
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
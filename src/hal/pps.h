@@ -27,6 +27,9 @@
  *
  * Driver to receive 1Hz interrupt (typically from GPS)
  *
+ * Where the hardware allows the edge is captured by a timer, so its time
+ * is exact however late the interrupt is taken. Times are in the
+ * clock_us() timeline.
  * ***************************************************************************/
 
 #ifndef ABC_HAL_PPS_H
@@ -34,10 +37,19 @@
 
 #include "types.h"
 
+/**
+ * Most listeners
+ */
+#define PPS_CB_MAX (4)
+
 /**
  * Callback
+ *
+ * @param us    Time of the edge (clock_us())
+ * @param exact The edge was captured by hardware, else it is the time the
+ *              interrupt was taken (e.g. on waking from STOP)
  */
-typedef void (*pps_cb) ( void );
+typedef void (*pps_cb) ( uint32_t us, bool exact );
 
 /**
  * Initialise the subsystem/driver
@@ -56,7 +68,25 @@ void pps_add_callback ( pps_cb cb );
  */
 void pps_rem_callback ( pps_cb cb );
 
-#endif /* ABC_HAL_SDCARD_H */
+/**
+ * Get the edge count
+ *
+ * @param exact Edges captured by hardware (may be NULL)
+ *
+ * @return Edges seen since pps_init()
+ */
+uint32_t pps_count ( uint32_t *exact );
+
+/*
+ * Driver interface
+ */
+
+/**
+ * Pass an edge on to the listeners (under interrupt)
+ */
+void pps_dispatch ( uint32_t us, bool exact );
+
+#endif /* ABC_HAL_PPS_H */
 
 /* ****************************************************************************
  * Editor Configuration
@@ -80,6 +80,41 @@ sdcard_s sdcard_close ( sdcard_s *sd );
 ssize_t sdcard_read
   ( sdcard_s *sd, size_t sect, uint8_t *buf, size_t len );
 
+/**
+ * Start a multi-block read
+ *
+ * Consecutive sectors (starting at sect) are then read, one at a time,
+ * using sdcard_read_next() without any further command overhead.
+ *
+ * The read must be stopped with sdcard_read_stop() before the card can
+ * be used for anything else.
+ *
+ * @param sd   The SD card to read from
+ * @param sect The first sector to read
+ *
+ * @return True if the read was started
+ */
+bool    sdcard_read_multi ( sdcard_s *sd, size_t sect );
+
+/**
+ * Read the next sector of a multi-block read
+ *
+ * @param sd   The SD card being read
+ * @param buf  The buffer to read into (must be 512 bytes)
+ *
+ * @return True if the sector was read
+ */
+bool    sdcard_read_next ( sdcard_s *sd, uint8_t *buf );
+
+/**
+ * Stop a multi-block read
+ *
+ * @param sd   The SD card being read
+ *
+ * @return True if the card acknowledged the stop
+ */
+bool    sdcard_read_stop ( sdcard_s *sd );
+
 /**
  * Write to the SD card
  *
@@ -95,6 +130,86 @@ ssize_t sdcard_read
 ssize_t sdcard_write
   ( sdcard_s *sd, size_t sect, const uint8_t *buf, size_t len );
 
+/**
+ * Start a streamed sector write
+ *
+ * The sector data is then supplied (in any size pieces) using
+ * sdcard_write_append() and the write completed with sdcard_write_end(). The
+ * card is held for the duration, no other access is possible.
+ *
+ * @param sd   The SD card to write to
+ * @param sect The sector to write to
+ *
+ * @return True if the card is ready to receive the sector data
+ */
+bool    sdcard_write_begin ( sdcard_s *sd, size_t sect );
+
+/**
+ * Stream data into the sector being written
+ *
+ * Note: data is sent directly to the card, it is not buffered
+ *
+ * @param sd   The SD card being written
+ * @param buf  The data to write to the card
+ * @param len  The number of bytes to write (must not pass the sector end)
+ *
+ * @return The number of bytes written (or -1 for error)
+ */
+ssize_t sdcard_write_append
+  ( sdcard_s *sd, const uint8_t *buf, size_t len );
+
+/**
+ * Complete a streamed sector write
+ *
+ * Any part of the sector not yet written is filled with zeros.
+ *
+ * @param sd   The SD card being written
+ *
+ * @return True if the card accepted and programmed the sector
+ */
+bool    sdcard_write_end ( sdcard_s *sd );
+
+/**
+ * Start a multi-block write
+ *
+ * The card is held in receive mode and each consecutive sector (starting
+ * at sect) is then written with sdcard_write_begin/append/end without any
+ * further command overhead. The card is left to program each sector while
+ * the caller gets on with something else.
+ *
+ * The session must be closed with sdcard_write_stop() before the card can
+ * be used for anything else.
+ *
+ * @param sd    The SD card to write to
+ * @param sect  The first sector to write to
+ * @param count The number of sectors expected to be written (used to
+ *              pre-erase, contents of any not written are undefined) or
+ *              0 if unknown
+ *
+ * @return True if the session was started
+ */
+bool    sdcard_write_multi ( sdcard_s *sd, size_t sect, size_t count );
+
+/**
+ * Check whether the card is still programming the last multi-block sector
+ *
+ * The card is polled once, this never waits.
+ *
+ * @param sd   The SD card being written
+ *
+ * @return True if the next sdcard_write_begin() would have to wait
+ */
+bool    sdcard_write_busy ( sdcard_s *sd );
+
+/**
+ * Stop a multi-block write
+ *
+ * @param sd   The SD card being written
+ *
+ * @return True if all sectors were successfully programmed
+ */
+bool    sdcard_write_stop ( sdcard_s *sd );
+
 #endif /* ABC_HAL_SDCARD_H */
 
 /* ****************************************************************************
@@ -37,6 +37,30 @@
  */
 typedef struct spi spi_s;
 
+/**
+ * Asynchronous transfer completion callback
+ *
+ * Note: this may be called under interrupt
+ *
+ * @param arg The opaque argument given with the transfer
+ * @param ok  True if the transfer completed successfully
+ */
+typedef void (*spi_cb) ( void *arg, bool ok );
+
+/**
+ * Full-duplex transfer segment
+ *
+ * ss_len bytes are clocked out of ss_tx while ss_len bytes are clocked in
+ * to ss_rx. If ss_tx is NULL then 0xFF is sent, if ss_rx is NULL then what
+ * comes back is discarded.
+ */
+typedef struct spi_seg
+{
+  const uint8_t *ss_tx;                 /**< Data to send (or NULL) */
+  uint8_t       *ss_rx;                 /**< Buffer to receive into (or NULL) */
+  size_t         ss_len;                /**< Length of the segment */
+} spi_seg_s;
+
 /**
  * Initialise the SPI subsystem
  */
@@ -75,6 +99,59 @@ bool spi_tx_rx
     const uint8_t *txbuf, const size_t txlen,
           uint8_t *rxbuf, const size_t rxlen );
 
+/**
+ * Full-duplex transfer
+ *
+ * @param spi   The SPI to operate on
+ * @param txbuf The data to transmit (NULL to send 0xFF)
+ * @param rxbuf The buffer to receive into (NULL to discard)
+ * @param len   The number of bytes to transfer
+ *
+ * @return True if operation successful, else false
+ */
+bool spi_xfer
+  ( spi_s *spi, const uint8_t *txbuf, uint8_t *rxbuf, size_t len );
+
+/**
+ * Full-duplex scatter-gather transfer
+ *
+ * The segments are clocked back to back as a single transfer, e.g. a
+ * command followed by the window its response is expected in.
+ *
+ * @param spi   The SPI to operate on
+ * @param segs  The segments
+ * @param nsegs The number of segments
+ *
+ * @return True if operation successful, else false
+ */
+bool spi_xfer_list
+  ( spi_s *spi, const spi_seg_s *segs, size_t nsegs );
+
+/**
+ * Start a transfer and return without waiting for it to complete
+ *
+ * The txlen bytes of txbuf are sent (the response is discarded), then
+ * rxlen bytes are received into rxbuf (0xFF is sent while receiving). Both
+ * buffers must remain valid until the callback is made. Only a single
+ * transfer can be outstanding, any other call on the SPI (including
+ * spi_tx_rx) waits for it to complete.
+ *
+ * @param spi   The SPI to operate on
+ * @param txbuf The data to transmit
+ * @param txlen The number of bytes to transmit
+ * @param rxbuf The buffer to receive into
+ * @param rxlen The number of bytes to receive
+ * @param cb    Completion callback (can be NULL)
+ * @param arg   Opaque argument passed to cb
+ *
+ * @return True if the transfer was started (cb will be called)
+ */
+bool spi_tx_rx_async
+  ( spi_s *spi,
+    const uint8_t *txbuf, const size_t txlen,
+          uint8_t *rxbuf, const size_t rxlen,
+    spi_cb cb, void *arg );
+
 #endif /* ABC_HAL_SPI_H */
 
 /* ****************************************************************************
@@ -41,10 +41,22 @@ void trace_init ( void );
 
 
 /*
- * Output debug
+ * Output debug (queued, lines are dropped if the queue is full)
+ *
+ * Only to be called from one context (e.g. the main loop)
  */
 void trace_printf ( const char *fmt, ... );
 
+/*
+ * Move queued output on to the UART (non-blocking)
+ */
+void trace_service ( void );
+
+/*
+ * Wait for all queued output to be sent
+ */
+void trace_flush ( void );
+
 #endif /* ABC_HAL_TRACE_H */
 
 /* ****************************************************************************
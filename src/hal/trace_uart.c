@@ -26,20 +26,34 @@
  * HAL - Trace over UART
  * 
  * Implementation to send trace debug via the debug uart
+ *
+ * Lines are queued in a ring and drained into the UART as it has room, so
+ * tracing never waits on the (slow) debug baud rate. A line that does not
+ * fit is dropped whole and counted, the count is reported in front of the
+ * next line that does.
  * ***************************************************************************/
 
 #include "board.h"
 #include "abc_misc.h"
+#include "ring.h"
 #include "hal/trace.h"
 #include "hal/uart.h"
 
 #include <stdarg.h>
+#include <stdio.h>
+
+#if !RING_POW2(ABC_TRACE_BUF_SZ)
+#error "ABC_TRACE_BUF_SZ must be a power of 2"
+#endif
 
 /* ****************************************************************************
  * State
  * ***************************************************************************/
 
-static uart_s *trace_uart;
+static uart_s  *trace_uart;
+static ring_s   trace_ring;
+static uint8_t  trace_buf[ABC_TRACE_BUF_SZ];
+static uint32_t trace_lost;             /**< Overflow already reported */
 
 /* ****************************************************************************
  * Public Interface
@@ -48,6 +62,7 @@ static uart_s *trace_uart;
 void
 trace_init ( void )
 {
+  ring_init(&trace_ring, trace_buf, sizeof(trace_buf));
   trace_uart = uart_open(ABC_UART_TRACE, 9600);
 }
 
@@ -61,6 +76,14 @@ trace_printf ( const char *fmt, ... )
   /* Ignore */
   if (NULL == trace_uart) return;
 
+  /* Report lost lines (once there is room) */
+  if ((trace_lost != trace_ring.r_overflow) && (ring_free(&trace_ring) > 48)) {
+    c = snprintf(line, sizeof(line), "trace: %lu bytes lost\n",
+                 (unsigned long)(trace_ring.r_overflow - trace_lost));
+    trace_lost = trace_ring.r_overflow;
+    ring_push(&trace_ring, (uint8_t*)line, (size_t)c);
+  }
+
   /* Build Line */
   va_start(va, fmt);
   c = vsnprintf(line, sizeof(line)-2, fmt, va);
@@ -68,13 +91,47 @@ trace_printf ( const char *fmt, ... )
 
   /* Invalid */
   if (c <= 0) return;
+  if (c > (ssize_t)sizeof(line) - 3) c = sizeof(line) - 3;
 
   /* Add \n */
   line[c++] = '\n';
   line[c]   = '\0';
 
-  /* Send */
-  uart_write(trace_uart, (uint8_t*)line, (size_t)c);
+  /* Queue (whole lines only) */
+  if (ring_free(&trace_ring) < (size_t)c)
+    ring_drop(&trace_ring, (size_t)c);
+  else
+    ring_push(&trace_ring, (uint8_t*)line, (size_t)c);
+
+  trace_service();
+}
+
+void
+trace_service ( void )
+{
+  const uint8_t *p;
+  ssize_t n, c;
+
+  if (NULL == trace_uart) return;
+
+  /* Hand the UART as much as it takes */
+  while (0 != (n = (ssize_t)ring_peek(&trace_ring, &p))) {
+    c = uart_write(trace_uart, p, (size_t)n);
+    if (c <= 0) break;
+    ring_consume(&trace_ring, (size_t)c);
+    if (c < n) break;
+  }
+}
+
+void
+trace_flush ( void )
+{
+  if (NULL == trace_uart) return;
+
+  while (0 != ring_used(&trace_ring)) {
+    trace_service();
+    uart_flush(trace_uart);
+  }
 }
 
 
@@ -28,7 +28,7 @@
  * Definition of simple UART interface, it is always run 8N1 with no HW flow
  * control (just the way I like it).
  *
- * The interface is entirely non-blocking.
+ * The interface is entirely non-blocking (other than uart_flush()).
  *
  * ***************************************************************************/
 
@@ -42,6 +42,11 @@
  */
 typedef struct uart uart_s;
 
+/**
+ * Receive notification
+ */
+typedef void (*uart_cb) ( void *arg );
+
 /**
  * Initialise the UART subsystem
  */
@@ -50,10 +55,13 @@ void    uart_init ( void );
 /**
  * Open a UART
  *
+ * Opening a UART that is already open changes its baud rate: anything
+ * still to be sent goes at the old rate and unread input is dropped.
+ *
  * @param idx  The device index
  * @param baud The baud rate to operate at
  *
- * @return NULL if something goes wrong (inc if already open)
+ * @return NULL if something goes wrong (inc an unsupported baud rate)
  */
 uart_s *uart_open ( uint8_t idx, uint32_t baud );
 
@@ -75,6 +83,41 @@ void    uart_close ( uart_s *uart );
  */
 ssize_t uart_read ( uart_s *uart, uint8_t *buf, size_t len );
 
+/**
+ * Get the received data without copying it
+ *
+ * This returns the longest contiguous span of the receive buffer, there may
+ * be more data once that has been consumed (the buffer wraps).
+ *
+ * @param uart The UART to read from
+ * @param buf  Returns a pointer to the data (valid until uart_consume)
+ *
+ * @return The number of bytes available (<0 indicates an error)
+ */
+ssize_t uart_peek ( uart_s *uart, const uint8_t **buf );
+
+/**
+ * Release data returned by uart_peek()
+ *
+ * @param uart The UART to release data from
+ * @param len  The number of bytes processed (must not exceed uart_peek())
+ */
+void    uart_consume ( uart_s *uart, size_t len );
+
+/**
+ * Be told when data has been received
+ *
+ * Data is received in bursts (DMA blocks, end of a sentence etc), so this
+ * is not once per byte. It is kept over re-opens.
+ *
+ * Note: the callback is called under interrupt
+ *
+ * @param uart The UART
+ * @param cb   The function to call (NULL to stop)
+ * @param arg  Passed to cb
+ */
+void    uart_set_callback ( uart_s *uart, uart_cb cb, void *arg );
+
 /**
  * Write to the UART
  *
@@ -86,6 +129,13 @@ ssize_t uart_read ( uart_s *uart, uint8_t *buf, size_t len );
  */
 ssize_t uart_write ( uart_s *uart, const uint8_t *buf, size_t len );
 
+/**
+ * Wait for all data written to the UART to be sent
+ *
+ * @param uart The UART to flush
+ */
+void    uart_flush ( uart_s *uart );
+
 #endif /* ABC_HAL_UART_H */
 
 /* ****************************************************************************
@@ -1,12 +1,17 @@
 #include "board.h"
 #include "hal/uart.h"
+#include "hal/clock.h"
 #include "hal/spi.h"
 #include "hal/sdcard.h"
 #include "hal/pps.h"
+#include "hal/power.h"
 #include "hal/trace.h"
-#include "sensors/gps/nmea.h"
+#include "sensors/gps/gps.h"
 #include "storage/pff.h"
 #include "storage/diskio.h"
+#include "storage/track.h"
+#include "scheduler.h"
+#include "timebase.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -16,60 +21,299 @@
 #pragma GCC diagnostic ignored "-Wmissing-declarations"
 #pragma GCC diagnostic ignored "-Wreturn-type"
 
-int
-main(int argc, char* argv[])
+/*
+ * Task events
+ */
+#define ABC_EV_RX     (0x01)            /**< GPS data received */
+#define ABC_EV_SECTOR (0x01)            /**< Track sector ready */
+#define ABC_EV_PPS    (0x01)            /**< PPS edge captured */
+
+/*
+ * Housekeeping (trace output) interval
+ */
+#define ABC_TICK_MS   (100)
+
+/*
+ * Card busy poll interval, while a sector is waiting
+ */
+#define ABC_CARD_MS   (1)
+
+static FATFS   abc_fs;
+static gps_s  *abc_gps;
+static track_s abc_trk;
+static bool    abc_open;
+static bool    abc_awake;
+static bool    abc_edge;  // held for the PPS edge
+static uint64_t abc_lat_max; // fix valid to recorded (us)
+static task_s  abc_gps_task, abc_pps_task, abc_log_task, abc_tick_task;
+
+/*
+ * Sectors from the start of the open file that are contiguous on the card
+ * (follows the FAT chain, once when the file is opened)
+ */
+static DWORD
+abc_contig ( const FATFS *fs )
+{
+  DWORD csz = (DWORD)fs->csize * 512, n = 1, max, c, next;
+  UINT  esz = (FS_FAT32 == fs->fs_type) ? 4 : 2;
+  BYTE  e[4] = { 0 };
+
+  max = (fs->fsize + csz - 1) / csz;
+  if ((FS_FAT12 == fs->fs_type) || (0 == max)) return fs->csize;
+
+  for (c = fs->org_clust; n < max; c = next, n++) {
+    if (RES_OK != disk_readp(e, fs->fatbase + c * esz / 512, c * esz % 512,
+                             esz))
+      break;
+    next = ((DWORD)e[3] << 24 | (DWORD)e[2] << 16 | (DWORD)e[1] << 8 | e[0]);
+    if ((next & 0x0FFFFFFF) != c + 1) break;
+  }
+
+  return n * fs->csize;
+}
+
+/*
+ * GPS data received (under interrupt)
+ */
+static void
+abc_rx ( void *arg )
+{
+  power_activity();
+  sched_post(&abc_gps_task, ABC_EV_RX);
+}
+
+/*
+ * Stay out of STOP (losing the start of a burst), or allow it again
+ */
+static void
+abc_wake ( bool awake )
+{
+  if (awake == abc_awake) return;
+  abc_awake = awake;
+  if (awake) power_hold();
+  else       power_release();
+}
+
+/*
+ * PPS edge (under interrupt)
+ */
+static void
+abc_pps ( uint32_t us, bool exact )
+{
+  sched_post(&abc_pps_task, ABC_EV_PPS);
+}
+
+/*
+ * Keep the CPU out of STOP around each expected PPS edge. The capture timer
+ * does not run in STOP, an edge seen there is only good to the millisecond
+ * and does not steer the timebase, so without this it would never stay
+ * locked once the CPU starts stopping between fixes.
+ */
+static void
+abc_pps_run ( task_s *t, uint32_t ev )
 {
-  char line[128], path[32];
-  int n = 0;
-  bool open = false;
+  uint64_t next, us;
+
+  /* Window opens, until the edge (or a little after, if it is missed) */
+  if (!(ev & ABC_EV_PPS) && !abc_edge) {
+    abc_edge = true;
+    power_hold();
+    sched_timer(t, 2 * ABC_POWER_GUARD_MS, 0);
+    return;
+  }
+
+  /* Edge seen (or missed), stopping is fine until just before the next */
+  if (abc_edge) {
+    abc_edge = false;
+    power_release();
+  }
+  sched_timer_stop(t);
+
+  /* Not locked, the next edge tries again */
+  if (0 == (next = timebase_pps_next())) return;
+  us = timebase_us();
+  if (next > us + ABC_POWER_GUARD_MS * 1000ull)
+    sched_timer(t, (uint32_t)((next - us) / 1000) - ABC_POWER_GUARD_MS, 0);
+  else
+    sched_post(t, SCHED_EV_TIMER);
+}
+
+/*
+ * Process received data, recording fixes
+ */
+static void
+abc_gps_run ( task_s *t, uint32_t ev )
+{
+  char path[32];
+  DWORD hint;
+  int r;
   time_t now;
-  double lat, lon;
   struct tm tm;
+  const gps_fix_s *fix;
+  bool got = false;
+  uint64_t stamp = 0, due, us;
+
+  /* Next fix is about to arrive */
+  if (ev & SCHED_EV_TIMER)
+    abc_wake(true);
+
+  while (0 < (r = gps_poll(abc_gps))) {
+    fix   = gps_fix(abc_gps);
+    got   = true;
+    stamp = fix->fx_stamp;
+    if (!fix->fx_valid) continue;
+
+    /* Data */
+    if (!abc_open) {
+      tm   = fix->fx_tm;
+      now  = mktime(&tm);
+      /* Petit FatFs only understands 8.3 names */
+      snprintf(path, sizeof(path), "/%08lX.TRK", (unsigned long)now);
+      if (FR_OK != pf_open(path)) {
+        trace_printf("abc - cannot open %s\n", path);
+        sched_stop();
+        return;
+      }
+      abc_open = true;
+
+      /*
+       * The (pre-allocated) file is ours, let the card erase it. Only as
+       * far as it is contiguous, beyond that are other files' sectors.
+       */
+      hint = abc_contig(&abc_fs);
+      if (hint > (abc_fs.fsize + 511) / 512) hint = (abc_fs.fsize + 511) / 512;
+      disk_write_hint(hint);
+      track_begin(&abc_trk, fix);
+    }
+
+    /* Record */
+    if (!track_add(&abc_trk, fix)) {
+      trace_printf("abc - track full\n");
+      sched_stop();
+      return;
+    }
+    if (timebase_locked()) {
+      us = timebase_us() - fix->fx_stamp;
+      if (us > abc_lat_max) abc_lat_max = us;
+    }
+  }
+
+  /* Input gone */
+  if (0 > r) sched_stop();
+
+  /*
+   * Nothing until just before the next fix is valid, the CPU can stop. Its
+   * burst follows that, so this counts from when the last fix was valid,
+   * not when it was processed (the end of its burst). Without PPS that is
+   * not known, so it stays awake.
+   */
+  if (got && timebase_locked()) {
+    due = stamp + (ABC_GPS_RATE_MS - ABC_POWER_GUARD_MS) * 1000ull;
+    us  = timebase_us();
+    if (due > us) {
+      abc_wake(false);
+      sched_timer(t, (uint32_t)((due - us) / 1000), 0);
+    }
+  }
+
+  /* The card is written in between fixes (never waited on) */
+  if (abc_open && track_pending(&abc_trk))
+    sched_post(&abc_log_task, ABC_EV_SECTOR);
+}
+
+/*
+ * Write out completed sectors as the card becomes ready
+ */
+static void
+abc_log_run ( task_s *t, uint32_t ev )
+{
+  if (!track_service(&abc_trk)) {
+    trace_printf("abc - track full\n");
+    sched_stop();
+    return;
+  }
+
+  /* Card still busy, look again shortly */
+  if (track_pending(&abc_trk))
+    sched_timer(t, ABC_CARD_MS, 0);
+}
+
+/*
+ * Housekeeping
+ */
+static void
+abc_tick_run ( task_s *t, uint32_t ev )
+{
+  trace_service();
+}
+
+int
+main(int argc, char* argv[])
+{
+  DWORD hits, misses;
 
   /* Setup */
+  clock_init();
+  power_init();
   uart_init();
   trace_init();
   spi_init();
   sdcard_init();
   disk_initialize();
   pps_init();
+  timebase_init();
   trace_printf("abc - begin\n");
 
   /* Mount the disk */
-  FATFS fs;
-  if (FR_OK != pf_mount(&fs)) return 1;
-
-  /* Open the GPS UART */
-  uart_s *u = uart_open(ABC_UART_GPS, 9600);
-  
-  /* Read data */
-  while (1) {
-    if (1 != uart_read(u, (uint8_t*)(line + n), 1)) continue;
-    if (line[n] == '\r') continue;
-    if (line[n] == '\n') {
-      line[n] = '\0';
-      n       = 0;
-
-      /* Data */
-      if (nmea_gprmc(line, &tm, &lat, &lon)) {
-        if (!open) {
-          open = true;
-          now  = mktime(&tm);
-          snprintf(path, sizeof(path), "/%ld.track", now);
-          if (FR_OK != pf_open(path)) return 1;
-        }
-
-        /* Write line to file */
-        UINT c;
-        snprintf(line, sizeof(line),
-                 "{ \"time\" : %ld, \"latitude\" : %0.6f, \"longitude\" : %0.6f }\n",
-                 now, lat, lon);
-        pf_write(line, strlen(line), &c);
-      }
-    } else {
-      ++n;
-    }
+  if (FR_OK != pf_mount(&abc_fs)) {
+    trace_flush();
+    return 1;
+  }
+
+  /* Keep the FAT and root directory cached, path and cluster lookups */
+  disk_cache_pin(abc_fs.fatbase, abc_fs.database - abc_fs.fatbase);
+  if (FS_FAT32 == abc_fs.fs_type)
+    disk_cache_pin(abc_fs.database + (abc_fs.dirbase - 2) * abc_fs.csize,
+                   abc_fs.csize);
+
+  /* Find the GPS and move it to the working baud and rate */
+  abc_gps = gps_open(ABC_UART_GPS, ABC_GPS_BAUD, ABC_GPS_RATE_MS);
+  if (NULL == abc_gps) {
+    trace_flush();
+    return 1;
   }
+
+  /* Tasks (highest priority first), then sleep until there is work */
+  sched_add(&abc_gps_task,  "gps",  abc_gps_run,  NULL);
+  sched_add(&abc_pps_task,  "pps",  abc_pps_run,  NULL);
+  sched_add(&abc_log_task,  "log",  abc_log_run,  NULL);
+  sched_add(&abc_tick_task, "tick", abc_tick_run, NULL);
+  sched_timer(&abc_tick_task, ABC_TICK_MS, ABC_TICK_MS);
+  gps_set_callback(abc_gps, abc_rx, NULL);
+  pps_add_callback(abc_pps);
+  sched_post(&abc_gps_task, ABC_EV_RX); // received during gps_open()
+  abc_wake(true);                        // until the first fix
+  sched_run();
+
+  /* Input gone (or no room), flush the partial sector */
+  if (abc_open) {
+    track_end(&abc_trk);
+    disk_sync();
+    trace_printf("abc - %lu records, %lu sectors, %lu dropped\n",
+                 (unsigned long)abc_trk.tr_records,
+                 (unsigned long)abc_trk.tr_sectors,
+                 (unsigned long)abc_trk.tr_dropped);
+  }
+  disk_cache_stats(&hits, &misses);
+  trace_printf("abc - end (sector cache %lu hits, %lu misses)\n",
+               (unsigned long)hits, (unsigned long)misses);
+  trace_printf("abc - fix latency max %luus\n", (unsigned long)abc_lat_max);
+  timebase_report();
+  sched_report();
+  power_report();
+  trace_flush();
+
+  return 0;
 }
 
 #pragma GCC diagnostic pop
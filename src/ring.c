@@ -0,0 +1,165 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Single producer, single consumer byte ring
+ *
+ * See ring.h
+ * ***************************************************************************/
+
+#include "ring.h"
+
+#include <string.h>
+
+/*
+ * The other side's index, loaded before the data it covers is touched
+ */
+#define RING_LOAD(_p)      __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+
+/*
+ * Our own index, stored once we have finished with the data
+ */
+#define RING_STORE(_p, _v) __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+
+/* ****************************************************************************
+ * Setup
+ * ***************************************************************************/
+
+bool
+ring_init ( ring_s *r, uint8_t *buf, size_t size )
+{
+  if (!RING_POW2(size) || (size > 0x80000000u)) return false;
+
+  r->r_buf      = buf;
+  r->r_mask     = (uint32_t)(size - 1);
+  r->r_overflow = 0;
+  r->r_peak     = 0;
+  ring_reset(r);
+  return true;
+}
+
+void
+ring_reset ( ring_s *r )
+{
+  r->r_head = 0;
+  r->r_tail = 0;
+}
+
+/* ****************************************************************************
+ * Producer
+ * ***************************************************************************/
+
+size_t
+ring_reserve ( ring_s *r, uint8_t **buf )
+{
+  uint32_t head = r->r_head;
+  uint32_t used = head - RING_LOAD(&r->r_tail);
+  uint32_t off  = head & r->r_mask;
+  uint32_t n    = r->r_mask + 1 - used;
+
+  /* Up to the end of the buffer */
+  if (n > r->r_mask + 1 - off) n = r->r_mask + 1 - off;
+
+  *buf = r->r_buf + off;
+  return n;
+}
+
+void
+ring_commit ( ring_s *r, size_t len )
+{
+  uint32_t head = r->r_head + (uint32_t)len;
+  uint32_t used = head - r->r_tail;
+
+  if (used > r->r_peak) r->r_peak = used;
+  RING_STORE(&r->r_head, head);
+}
+
+size_t
+ring_push ( ring_s *r, const uint8_t *buf, size_t len )
+{
+  uint8_t *p;
+  size_t   n, c = 0;
+
+  /* At most two spans (either side of the wrap) */
+  while (c < len) {
+    n = ring_reserve(r, &p);
+    if (0 == n) break;
+    if (n > len - c) n = len - c;
+    memcpy(p, buf + c, n);
+    ring_commit(r, n);
+    c += n;
+  }
+
+  if (c < len) ring_drop(r, len - c);
+  return c;
+}
+
+/* ****************************************************************************
+ * Consumer
+ * ***************************************************************************/
+
+size_t
+ring_peek ( ring_s *r, const uint8_t **buf )
+{
+  uint32_t tail = r->r_tail;
+  uint32_t n    = RING_LOAD(&r->r_head) - tail;
+  uint32_t off  = tail & r->r_mask;
+
+  /* Up to the end of the buffer */
+  if (n > r->r_mask + 1 - off) n = r->r_mask + 1 - off;
+
+  *buf = r->r_buf + off;
+  return n;
+}
+
+void
+ring_consume ( ring_s *r, size_t len )
+{
+  RING_STORE(&r->r_tail, r->r_tail + (uint32_t)len);
+}
+
+size_t
+ring_pop ( ring_s *r, uint8_t *buf, size_t len )
+{
+  const uint8_t *p;
+  size_t         n, c = 0;
+
+  /* At most two spans (either side of the wrap) */
+  while (c < len) {
+    n = ring_peek(r, &p);
+    if (0 == n) break;
+    if (n > len - c) n = len - c;
+    memcpy(buf + c, p, n);
+    ring_consume(r, n);
+    c += n;
+  }
+
+  return c;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,180 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Single producer, single consumer byte ring
+ *
+ * Lock-free queue between exactly one writer and one reader, typically an
+ * interrupt handler on one side and the main loop on the other (or two
+ * threads in the host simulation).
+ *
+ * The head and tail are free running counts of the bytes ever pushed and
+ * popped, each only ever stored by its own side. The size must be a power
+ * of two so that they index the buffer by masking, and used = head - tail
+ * holds across the wrap. A side publishes its index with release ordering
+ * once it has finished with the data, and loads the other's with acquire
+ * ordering before touching the data, so on a multi-core host nothing is
+ * read before it has been written, or overwritten before it has been read.
+ * On Cortex-M these are just a DMB either side.
+ *
+ * Anything the producer cannot fit is counted in r_overflow, rather than
+ * overwriting unread data.
+ *
+ * Functions are marked with the side that may call them. Either side may
+ * be taken over by another context as long as the two never run at once
+ * (e.g. the main loop with the interrupt disabled).
+ * ***************************************************************************/
+
+#ifndef ABC_RING_H
+#define ABC_RING_H
+
+#include "types.h"
+
+/**
+ * Is a (constant) size usable, for pre-processor checks of buffer sizes
+ */
+#define RING_POW2(_n) ((0 != (_n)) && (0 == ((_n) & ((_n) - 1))))
+
+/**
+ * Ring state
+ */
+typedef struct ring
+{
+  uint8_t          *r_buf;              /**< Storage */
+  uint32_t          r_mask;             /**< Size - 1 */
+  volatile uint32_t r_head;             /**< Bytes pushed (producer) */
+  volatile uint32_t r_tail;             /**< Bytes popped (consumer) */
+  volatile uint32_t r_overflow;         /**< Bytes lost, ring full (producer) */
+  volatile uint32_t r_peak;             /**< Most bytes ever queued (producer) */
+} ring_s;
+
+/**
+ * Initialise (or reset) a ring, neither side may be active
+ *
+ * @param r    The ring
+ * @param buf  The storage
+ * @param size The size of the storage (a power of 2)
+ *
+ * @return false if the size is invalid
+ */
+bool   ring_init ( ring_s *r, uint8_t *buf, size_t size );
+
+/**
+ * Empty the ring, neither side may be active (the counters are kept)
+ */
+void   ring_reset ( ring_s *r );
+
+/**
+ * Bytes queued (either side, it can only grow for the consumer and only
+ * shrink for the producer)
+ */
+static inline size_t
+ring_used ( const ring_s *r )
+{
+  return (size_t)(__atomic_load_n(&r->r_head, __ATOMIC_ACQUIRE) -
+                  __atomic_load_n(&r->r_tail, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Bytes free (either side)
+ */
+static inline size_t
+ring_free ( const ring_s *r )
+{
+  return (size_t)r->r_mask + 1 - ring_used(r);
+}
+
+/**
+ * Queue as much of a buffer as fits (producer)
+ *
+ * @return The number of bytes queued, the rest is counted as overflow
+ */
+size_t ring_push ( ring_s *r, const uint8_t *buf, size_t len );
+
+/**
+ * Dequeue up to len bytes (consumer)
+ *
+ * @return The number of bytes copied to buf
+ */
+size_t ring_pop ( ring_s *r, uint8_t *buf, size_t len );
+
+/**
+ * Get the longest contiguous span of queued data (consumer)
+ *
+ * There may be more once this has been consumed (the ring wraps).
+ *
+ * @param r   The ring
+ * @param buf Returns a pointer to the data (valid until ring_consume)
+ *
+ * @return The number of bytes at buf
+ */
+size_t ring_peek ( ring_s *r, const uint8_t **buf );
+
+/**
+ * Release data returned by ring_peek() (consumer)
+ *
+ * @param len The number of bytes processed (must not exceed ring_peek())
+ */
+void   ring_consume ( ring_s *r, size_t len );
+
+/**
+ * Get the longest contiguous span of free space (producer)
+ *
+ * For filling in place (e.g. by fread() or DMA), there may be more once
+ * this has been committed (the ring wraps).
+ *
+ * @param r   The ring
+ * @param buf Returns a pointer to the space (valid until ring_commit)
+ *
+ * @return The number of bytes at buf
+ */
+size_t ring_reserve ( ring_s *r, uint8_t **buf );
+
+/**
+ * Queue data written to the space returned by ring_reserve() (producer)
+ *
+ * @param len The number of bytes written
+ */
+void   ring_commit ( ring_s *r, size_t len );
+
+/**
+ * Count data lost before it could be queued (producer)
+ *
+ * For sources that overrun on their own (hardware FIFO, DMA, ...)
+ *
+ * @param len The number of bytes lost
+ */
+static inline void
+ring_drop ( ring_s *r, size_t len )
+{
+  r->r_overflow += (uint32_t)len;
+}
+
+#endif /* ABC_RING_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,244 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Cooperative scheduler
+ *
+ * See scheduler.h
+ * ***************************************************************************/
+
+#include "scheduler.h"
+#include "hal/clock.h"
+#include "hal/cpu.h"
+#include "hal/power.h"
+#include "hal/trace.h"
+
+#include <string.h>
+
+/* ****************************************************************************
+ * Module data
+ * ***************************************************************************/
+
+static task_s       *sched_tasks;       /**< Highest priority first */
+static volatile bool sched_stopped;     /**< sched_stop() called */
+static uint32_t      sched_start;       /**< sched_run() called (clock_ms) */
+static uint32_t      sched_end;         /**< sched_run() returned */
+static uint64_t      sched_idle;        /**< Time asleep (us) */
+static uint32_t      sched_wakes;       /**< Times woken */
+
+/* ****************************************************************************
+ * Internals
+ * ***************************************************************************/
+
+/*
+ * Post the events of the timers that have expired
+ */
+static void
+sched_timers ( void )
+{
+  uint32_t now = clock_ms();
+  task_s  *t;
+
+  for (t = sched_tasks; NULL != t; t = t->t_next) {
+    if (!t->t_armed || ((int32_t)(now - t->t_due) < 0)) continue;
+
+    /* Periodic (skipping whole periods missed) */
+    if (t->t_period) {
+      t->t_due += t->t_period;
+      if ((int32_t)(now - t->t_due) >= 0) t->t_due = now + t->t_period;
+    } else {
+      t->t_armed = false;
+    }
+    sched_post(t, SCHED_EV_TIMER);
+  }
+}
+
+/*
+ * Time until the next timer is due
+ *
+ * @return ms (POWER_FOREVER if none are armed)
+ */
+static uint32_t
+sched_next ( void )
+{
+  uint32_t now = clock_ms(), next = POWER_FOREVER;
+  int32_t  dt;
+  task_s  *t;
+
+  for (t = sched_tasks; NULL != t; t = t->t_next) {
+    if (!t->t_armed) continue;
+    dt = (int32_t)(t->t_due - now);
+    if (dt <= 0) return 0;
+    if ((uint32_t)dt < next) next = dt;
+  }
+
+  return next;
+}
+
+/*
+ * Run the highest priority task with events pending
+ *
+ * @return false if there was none
+ */
+static bool
+sched_once ( void )
+{
+  task_s       *t;
+  task_stats_s *ts;
+  uint32_t      ev, start, dt;
+
+  for (t = sched_tasks; NULL != t; t = t->t_next) {
+    if (0 == t->t_ev) continue;
+
+    start = clock_us();
+    ev    = __atomic_exchange_n(&t->t_ev, 0, __ATOMIC_ACQUIRE);
+    ts    = &t->t_stats;
+    dt    = start - t->t_posted;
+    if (dt > ts->ts_lat_max) ts->ts_lat_max = dt;
+
+    t->t_fn(t, ev);
+
+    dt = clock_us() - start;
+    ++ts->ts_runs;
+    ts->ts_busy += dt;
+    if (dt > ts->ts_max) ts->ts_max = dt;
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Anything posted (interrupts masked)
+ */
+static bool
+sched_pending ( void )
+{
+  task_s *t;
+
+  for (t = sched_tasks; NULL != t; t = t->t_next)
+    if (0 != t->t_ev) return true;
+  return false;
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+sched_add ( task_s *t, const char *name, task_fn fn, void *arg )
+{
+  task_s **p;
+
+  memset(t, 0, sizeof(*t));
+  t->t_name = name;
+  t->t_fn   = fn;
+  t->t_arg  = arg;
+
+  for (p = &sched_tasks; NULL != *p; p = &(*p)->t_next);
+  *p = t;
+}
+
+void
+sched_post ( task_s *t, uint32_t ev )
+{
+  uint32_t now = clock_us();
+
+  if (0 == __atomic_fetch_or(&t->t_ev, ev, __ATOMIC_RELEASE))
+    t->t_posted = now;
+}
+
+void
+sched_timer ( task_s *t, uint32_t ms, uint32_t period )
+{
+  t->t_due    = clock_ms() + ms;
+  t->t_period = period;
+  t->t_armed  = true;
+}
+
+void
+sched_timer_stop ( task_s *t )
+{
+  t->t_armed = false;
+}
+
+void
+sched_run ( void )
+{
+  uint32_t t0;
+
+  sched_stopped = false;
+  sched_start   = clock_ms();
+
+  while (!sched_stopped) {
+    sched_timers();
+    if (sched_once()) continue;
+
+    /* Nothing to do, sleep (unless something was posted meanwhile) */
+    t0 = clock_us();
+    cpu_irq_disable();
+    if (!sched_pending()) {
+      power_idle(sched_next());
+      ++sched_wakes;
+    }
+    cpu_irq_enable();
+    sched_idle += clock_us() - t0;
+  }
+
+  sched_end = clock_ms();
+}
+
+void
+sched_stop ( void )
+{
+  sched_stopped = true;
+}
+
+void
+sched_report ( void )
+{
+  const task_s       *t;
+  const task_stats_s *ts;
+  uint64_t            total = (uint64_t)(sched_end - sched_start) * 1000;
+
+  trace_printf("sched: %lu.%03lus, %lu.%lu%% asleep (%lu wakes)\n",
+               (unsigned long)(total / 1000000),
+               (unsigned long)(total / 1000 % 1000),
+               (unsigned long)(total ? sched_idle * 100 / total : 0),
+               (unsigned long)(total ? sched_idle * 1000 / total % 10 : 0),
+               (unsigned long)sched_wakes);
+  for (t = sched_tasks; NULL != t; t = t->t_next) {
+    ts = &t->t_stats;
+    trace_printf("sched: %-6s %7lu runs, avg %5luus, max %6luus, "
+                 "latency max %6luus\n", t->t_name, (unsigned long)ts->ts_runs,
+                 (unsigned long)(ts->ts_runs ? ts->ts_busy / ts->ts_runs : 0),
+                 (unsigned long)ts->ts_max, (unsigned long)ts->ts_lat_max);
+  }
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,141 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Cooperative scheduler
+ *
+ * Work is done by tasks, which run to completion when they have events
+ * pending. Events are bits, posted from anywhere (including interrupts)
+ * and collected into the task until it runs, when they are all handed
+ * over at once. A task can also have a timer, which posts SCHED_EV_TIMER.
+ *
+ * Tasks run in the order they were added: after each task has run the
+ * search for the next starts from the top again, so the first added has
+ * the highest priority (but nothing is ever pre-empted). With nothing to
+ * run the CPU sleeps (hal/power.h) until the next interrupt or timer.
+ *
+ * Each task keeps the number of runs, the time spent and the worst case
+ * run time and latency (post to run), the scheduler the time spent
+ * asleep.
+ * ***************************************************************************/
+
+#ifndef ABC_SCHEDULER_H
+#define ABC_SCHEDULER_H
+
+#include "types.h"
+
+/**
+ * Timer event (the rest are the task's to define)
+ */
+#define SCHED_EV_TIMER (0x80000000u)
+
+typedef struct task task_s;
+
+/**
+ * Task handler
+ *
+ * @param t  The task
+ * @param ev The events posted since it last ran
+ */
+typedef void (*task_fn) ( task_s *t, uint32_t ev );
+
+/**
+ * Task statistics (us)
+ */
+typedef struct task_stats
+{
+  uint32_t ts_runs;                     /**< Times run */
+  uint64_t ts_busy;                     /**< Total run time */
+  uint32_t ts_max;                      /**< Longest run */
+  uint32_t ts_lat_max;                  /**< Longest from post to run */
+} task_stats_s;
+
+/**
+ * Task (the caller provides the storage, it's all private)
+ */
+struct task
+{
+  const char       *t_name;             /**< Name (for stats) */
+  task_fn           t_fn;               /**< Handler */
+  void             *t_arg;              /**< Handler arg */
+  volatile uint32_t t_ev;               /**< Events pending */
+  volatile uint32_t t_posted;           /**< When first pending (clock_us) */
+  bool              t_armed;            /**< Timer running */
+  uint32_t          t_due;              /**< Timer expiry (clock_ms) */
+  uint32_t          t_period;           /**< Timer reload (0 = one shot) */
+  task_stats_s      t_stats;            /**< Statistics */
+  task_s           *t_next;             /**< Next (lower priority) task */
+};
+
+/**
+ * Add a task (it must stay valid until sched_run() returns)
+ *
+ * @param t    The task
+ * @param name Its name
+ * @param fn   Its handler
+ * @param arg  Handler arg (available as t->t_arg)
+ */
+void sched_add ( task_s *t, const char *name, task_fn fn, void *arg );
+
+/**
+ * Post events to a task (any context, including interrupts)
+ */
+void sched_post ( task_s *t, uint32_t ev );
+
+/**
+ * Start (or restart) a task's timer (task context)
+ *
+ * @param t      The task
+ * @param ms     Time until SCHED_EV_TIMER is posted
+ * @param period Then every period ms (0 for once)
+ */
+void sched_timer ( task_s *t, uint32_t ms, uint32_t period );
+
+/**
+ * Stop a task's timer (task context)
+ */
+void sched_timer_stop ( task_s *t );
+
+/**
+ * Run tasks until sched_stop()
+ */
+void sched_run ( void );
+
+/**
+ * Make sched_run() return (once the current task has finished)
+ */
+void sched_stop ( void );
+
+/**
+ * Trace the statistics
+ */
+void sched_report ( void );
+
+#endif /* ABC_SCHEDULER_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,392 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * GPS Receiver
+ *
+ * Startup negotiation and protocol selection. The receiver is not assumed
+ * to be anything in particular: it is found by listening for a valid NMEA
+ * sentence or UBX message at each likely baud rate, asked whether it
+ * understands UBX (CFG-MSG is ACKed or NAKed by any u-blox) and then sent
+ * UBX or PMTK configuration to match.
+ * ***************************************************************************/
+
+#include "gps.h"
+#include "nmea.h"
+#include "ubx.h"
+#include "abc_misc.h"
+#include "hal/clock.h"
+#include "hal/cpu.h"
+#include "hal/trace.h"
+#include "timebase.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Time to listen at each baud rate, long enough for a 1Hz receiver to have
+ * sent something
+ */
+#define GPS_PROBE_MS    (1500)
+
+/*
+ * Time allowed for a UBX acknowledgement
+ */
+#define GPS_ACK_MS      (500)
+
+/*
+ * Fixes kept while negotiating (data keeps arriving, at 10Hz for most of
+ * it), any more are counted as lost
+ */
+#define GPS_PENDING_MAX (8)
+
+/*
+ * Protocols
+ */
+enum {
+  GPS_PROTO_ANY,                        /**< Not known (yet), try both */
+  GPS_PROTO_NMEA,
+  GPS_PROTO_UBX,
+};
+
+/*
+ * Events
+ */
+#define GPS_EV_NMEA     (0x01)          /**< Valid NMEA sentence */
+#define GPS_EV_UBX      (0x02)          /**< Valid UBX NAV message */
+#define GPS_EV_ACK      (0x04)          /**< CFG-MSG acknowledged */
+#define GPS_EV_NAK      (0x08)          /**< CFG-MSG rejected */
+#define GPS_EV_FIX      (0x10)          /**< New fix */
+
+/*
+ * Structure used to represent the receiver
+ */
+struct gps
+{
+  uart_s          *g_uart;              /**< UART */
+  uint32_t         g_baud;              /**< Current baud rate */
+  uint8_t          g_proto;             /**< Protocol in use */
+  const gps_fix_s *g_fix;               /**< Latest fix */
+  nmea_parser_s    g_nmea;              /**< NMEA parser */
+  ubx_parser_s     g_ubx;               /**< UBX parser */
+  gps_fix_s        g_pending[GPS_PENDING_MAX]; /**< Fixes from startup */
+  uint8_t          g_npending;          /**< Fixes in g_pending */
+  uint8_t          g_rdpending;         /**< Fixes returned from g_pending */
+  uint8_t          g_lost;              /**< Fixes g_pending had no room for */
+};
+
+/*
+ * Module data
+ */
+static gps_s gps_rx;
+
+/*
+ * Baud rates probed (factory defaults first, then where we leave it)
+ */
+static const uint32_t gps_bauds[] = {
+  9600, 115200, 38400, 57600, 19200, 4800, 230400
+};
+
+/* ****************************************************************************
+ * Receive
+ * ***************************************************************************/
+
+/*
+ * Timestamp a new fix (see timebase_utc())
+ */
+static void
+gps_stamp ( gps_fix_s *fx )
+{
+  fx->fx_stamp = timebase_utc(fx->fx_ms);
+}
+
+static uint8_t
+gps_nmea_event ( gps_s *g, nmea_type_t t )
+{
+  if (NMEA_NONE == t) return 0;
+  if (NMEA_RMC  != t) return GPS_EV_NMEA;
+  gps_stamp(&g->g_nmea.np_fix);
+  g->g_fix = &g->g_nmea.np_fix;
+  return GPS_EV_NMEA | GPS_EV_FIX;
+}
+
+static uint8_t
+gps_ubx_event ( gps_s *g, ubx_type_t t )
+{
+  const ubx_parser_s *p = &g->g_ubx;
+
+  switch (t) {
+    case UBX_PVT:
+    case UBX_EPOCH:
+      gps_stamp(&g->g_ubx.up_fix);
+      g->g_fix = &g->g_ubx.up_fix;
+      return GPS_EV_UBX | GPS_EV_FIX;
+    case UBX_ACK:
+    case UBX_NAK:
+      if ((UBX_CLASS_CFG != p->up_ack_class) || (UBX_CFG_MSG != p->up_ack_id))
+        break;
+      return (UBX_ACK == t) ? GPS_EV_ACK : GPS_EV_NAK;
+    default:
+      break;
+  }
+  return 0;
+}
+
+/*
+ * Feed received data to the parser(s), stopping after a message
+ *
+ * @return The number of bytes used
+ */
+static size_t
+gps_feed ( gps_s *g, const uint8_t *buf, size_t len, uint8_t *ev )
+{
+  nmea_type_t nt;
+  ubx_type_t  ut;
+  size_t      n, i;
+
+  switch (g->g_proto) {
+    case GPS_PROTO_NMEA:
+      n    = nmea_feed(&g->g_nmea, buf, len, &nt);
+      *ev |= gps_nmea_event(g, nt);
+      break;
+    case GPS_PROTO_UBX:
+      n    = ubx_feed(&g->g_ubx, buf, len, &ut);
+      *ev |= gps_ubx_event(g, ut);
+      break;
+    default:
+      n    = nmea_feed(&g->g_nmea, buf, len, &nt);
+      *ev |= gps_nmea_event(g, nt);
+      for (i = 0; i < n; ) {
+        i   += ubx_feed(&g->g_ubx, buf + i, n - i, &ut);
+        *ev |= gps_ubx_event(g, ut);
+      }
+      break;
+  }
+  return n;
+}
+
+/*
+ * Receive until one of the events in mask (or timeout)
+ *
+ * Fixes received meanwhile are kept for gps_poll().
+ *
+ * @return The events seen, <0 if the input has gone
+ */
+static int
+gps_wait ( gps_s *g, uint32_t ms, uint8_t mask )
+{
+  const uint8_t *in;
+  uint32_t       start = clock_ms();
+  uint8_t        ev = 0, e;
+  size_t         n;
+  ssize_t        r;
+
+  do {
+    r = uart_peek(g->g_uart, &in);
+    if (0 > r) return -1;
+    if (0 == r) cpu_wait(); // nothing yet, sleep (a tick at most)
+    while (r) {
+      e = 0;
+      n = gps_feed(g, in, (size_t)r, &e);
+      uart_consume(g->g_uart, n);
+      in += n;
+      r  -= (ssize_t)n;
+      if ((e & GPS_EV_FIX) && (g->g_npending < GPS_PENDING_MAX))
+        g->g_pending[g->g_npending++] = *g->g_fix;
+      else if ((e & GPS_EV_FIX) && (g->g_lost < UINT8_MAX))
+        ++g->g_lost;
+      ev |= e;
+    }
+    if (ev & mask) break;
+  } while ((uint32_t)(clock_ms() - start) < ms);
+
+  return ev;
+}
+
+/* ****************************************************************************
+ * Transmit
+ * ***************************************************************************/
+
+/*
+ * Send a PMTK command (checksum and line ending added)
+ */
+static void
+gps_pmtk ( gps_s *g, const char *fmt, ... )
+{
+  char    s[40];
+  uint8_t cs = 0;
+  va_list va;
+  int     i, n;
+  ssize_t r;
+
+  va_start(va, fmt);
+  n = vsnprintf(s + 1, sizeof(s) - 6, fmt, va);
+  va_end(va);
+  if ((n <= 0) || (n >= (int)sizeof(s) - 6)) return;
+
+  s[0] = '$';
+  for (i = 1; i <= n; i++) cs ^= (uint8_t)s[i];
+  n = snprintf(s + n + 1, 6, "*%02X\r\n", cs) + n + 1;
+
+  for (i = 0; i < n; ) {
+    r = uart_write(g->g_uart, (const uint8_t*)s + i, (size_t)(n - i));
+    if (0 > r) return;
+    if (0 == r) uart_flush(g->g_uart);
+    i += (int)r;
+  }
+  uart_flush(g->g_uart);
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+gps_s *
+gps_open ( uint8_t idx, uint32_t baud, uint16_t rate_ms )
+{
+  static const char *protos[] = { "unknown", "NMEA", "UBX" };
+  gps_s  *g = &gps_rx;
+  uint8_t pl[3];
+  size_t  i;
+  int     ev;
+  bool    ubx;
+
+  memset(g, 0, sizeof(*g));
+  nmea_init(&g->g_nmea);
+  ubx_init(&g->g_ubx);
+  g->g_proto = GPS_PROTO_ANY;
+  g->g_fix   = &g->g_nmea.np_fix;
+
+  /* Find the receiver */
+  for (i = 0; i < ARRAY_SIZE(gps_bauds); i++) {
+    if (NULL == (g->g_uart = uart_open(idx, gps_bauds[i]))) continue;
+    ev = gps_wait(g, GPS_PROBE_MS, GPS_EV_NMEA | GPS_EV_UBX);
+    if (0 > ev) return NULL;
+    if (ev & (GPS_EV_NMEA | GPS_EV_UBX)) break;
+  }
+  if (i >= ARRAY_SIZE(gps_bauds)) {
+    g->g_uart = uart_open(idx, gps_bauds[0]);
+    g->g_baud = gps_bauds[0];
+    trace_printf("gps: no receiver found\n");
+    return g;
+  }
+  g->g_baud = gps_bauds[i];
+
+  /* u-blox? (NAV-PVT is NAKed by those too old to have it) */
+  pl[0] = UBX_CLASS_NAV;
+  pl[1] = UBX_NAV_PVT;
+  pl[2] = 1;
+  ubx_send(g->g_uart, UBX_CLASS_CFG, UBX_CFG_MSG, pl, sizeof(pl));
+  ev = gps_wait(g, GPS_ACK_MS, GPS_EV_ACK | GPS_EV_NAK);
+  if (0 > ev) return NULL;
+  ubx = (0 != (ev & (GPS_EV_ACK | GPS_EV_NAK)));
+
+  /*
+   * Move it (rate last for PMTK, it may not fit at the old baud). Without
+   * NAV-PVT the fix comes from NAV-POSLLH/SOL/TIMEUTC.
+   */
+  if (ubx)
+    ubx_configure(g->g_uart, baud, rate_ms,
+                  (ev & GPS_EV_ACK) ? UBX_NAV_PVT : UBX_NAV_POSLLH);
+  else
+    gps_pmtk(g, "PMTK251,%lu", (unsigned long)baud);
+  g->g_uart = uart_open(idx, baud);
+  if (!ubx)
+    gps_pmtk(g, "PMTK220,%u", rate_ms);
+
+  /* Check it followed, else go back to where it was */
+  ev = gps_wait(g, GPS_PROBE_MS, GPS_EV_NMEA | GPS_EV_UBX);
+  if (0 > ev) return NULL;
+  if (ev & (GPS_EV_NMEA | GPS_EV_UBX)) {
+    g->g_baud = baud;
+  } else {
+    g->g_uart = uart_open(idx, g->g_baud);
+    ev = gps_wait(g, GPS_PROBE_MS, GPS_EV_NMEA | GPS_EV_UBX);
+    if (0 > ev) return NULL;
+  }
+
+  /* Stick to what it is sending */
+  if (ev & GPS_EV_UBX)
+    g->g_proto = GPS_PROTO_UBX;
+  else if (ev & GPS_EV_NMEA)
+    g->g_proto = GPS_PROTO_NMEA;
+  trace_printf("gps: %s at %lu baud (%s), %ums\n", ubx ? "u-blox" : "receiver",
+               (unsigned long)g->g_baud, protos[g->g_proto], rate_ms);
+  if (g->g_lost)
+    trace_printf("gps: %u fixes lost while negotiating\n", g->g_lost);
+
+  return g;
+}
+
+int
+gps_poll ( gps_s *g )
+{
+  const uint8_t *in;
+  uint8_t        ev;
+  ssize_t        r;
+  size_t         n;
+
+  /* Received during gps_open() */
+  if (g->g_rdpending < g->g_npending) {
+    g->g_fix = g->g_pending + g->g_rdpending++;
+    return 1;
+  }
+
+  while (1) {
+    r = uart_peek(g->g_uart, &in);
+    if (0 >= r) return (int)r;
+
+    ev = 0;
+    n  = gps_feed(g, in, (size_t)r, &ev);
+    uart_consume(g->g_uart, n);
+
+    /* Late starter, stick to what it sends */
+    if (GPS_PROTO_ANY == g->g_proto) {
+      if (ev & GPS_EV_UBX)
+        g->g_proto = GPS_PROTO_UBX;
+      else if (ev & GPS_EV_NMEA)
+        g->g_proto = GPS_PROTO_NMEA;
+    }
+    if (ev & GPS_EV_FIX) return 1;
+  }
+}
+
+void
+gps_set_callback ( gps_s *g, uart_cb cb, void *arg )
+{
+  uart_set_callback(g->g_uart, cb, arg);
+}
+
+const gps_fix_s *
+gps_fix ( gps_s *g )
+{
+  return g->g_fix;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,139 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * GPS Receiver
+ *
+ * Definitions common to all the receiver protocols, and the receiver
+ * itself: found at whatever baud rate it is using, moved to a faster one
+ * and a higher navigation rate, then polled for fixes in whichever
+ * protocol it ended up speaking.
+ * ***************************************************************************/
+
+#ifndef ABC_GPS_H
+#define ABC_GPS_H
+
+#include "hal/uart.h"
+
+#include <time.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Coordinate (latitude/longitude) in 1e-7 degrees, as used by u-blox
+ *
+ * This covers +/-214 degrees at ~1cm resolution without any float maths.
+ */
+typedef int32_t coord_t;
+#define COORD_SCALE     (10000000)
+
+/*
+ * Satellite systems
+ */
+typedef enum gps_sys
+{
+  GPS_SYS_GPS,                          /**< GPS */
+  GPS_SYS_GLONASS,                      /**< GLONASS */
+  GPS_SYS_GALILEO,                      /**< Galileo */
+  GPS_SYS_BEIDOU,                       /**< BeiDou */
+  GPS_SYS_MAX,
+  GPS_SYS_MULTI = GPS_SYS_MAX,          /**< Combined solution */
+} gps_sys_t;
+
+/*
+ * Navigation solution
+ *
+ * Units follow the u-blox binary protocol, so a NAV-PVT copies straight
+ * in. Fields a receiver message does not carry keep their last value.
+ */
+typedef struct gps_fix
+{
+  struct tm fx_tm;                      /**< UTC date and time */
+  int32_t   fx_ms;                      /**< Milliseconds (into fx_tm) */
+  uint64_t  fx_stamp;                   /**< Time of validity (timebase) */
+  bool      fx_valid;                   /**< Position is valid */
+  coord_t   fx_lat;                     /**< Latitude */
+  coord_t   fx_lon;                     /**< Longitude */
+  int32_t   fx_alt;                     /**< Altitude above MSL (mm) */
+  int32_t   fx_speed;                   /**< Ground speed (mm/s) */
+  int32_t   fx_course;                  /**< Course over ground (1e-5 deg) */
+  int32_t   fx_quality;                 /**< Fix quality (0 = none) */
+  int32_t   fx_mode;                    /**< Fix type (1 = none, 2D, 3D) */
+  int32_t   fx_sats;                    /**< Satellites used */
+  int32_t   fx_sats_view[GPS_SYS_MAX];  /**< Satellites in view */
+  int32_t   fx_hdop;                    /**< Horizontal DOP * 100 */
+  int32_t   fx_pdop;                    /**< Position DOP * 100 */
+  int32_t   fx_vdop;                    /**< Vertical DOP * 100 */
+} gps_fix_s;
+
+/*
+ * Opaque reference to the receiver
+ */
+typedef struct gps gps_s;
+
+/*
+ * Find the receiver and configure it
+ *
+ * The receiver's current baud rate is probed for, then it is asked (in
+ * both u-blox UBX and MediaTek PMTK, whichever it understands) to move to
+ * the given baud and navigation rate. The UART follows and the receiver is
+ * checked to still be talking, if it is not everything goes back to the
+ * rate it was found at. This takes a few seconds.
+ *
+ * @param idx     The UART the receiver is on
+ * @param baud    The baud rate wanted
+ * @param rate_ms The measurement period wanted (e.g. 100 for 10Hz)
+ *
+ * @return NULL if the input has gone (there is always a receiver, even if
+ *         it has not been heard from yet)
+ */
+gps_s           *gps_open ( uint8_t idx, uint32_t baud, uint16_t rate_ms );
+
+/*
+ * Process received data
+ *
+ * @return 1 if there is a new fix (see gps_fix()), 0 once all the data
+ *         received has been processed, <0 if the input has gone
+ */
+int              gps_poll ( gps_s *gps );
+
+/*
+ * Be told when there may be something for gps_poll()
+ *
+ * Note: the callback is called under interrupt (see uart_set_callback())
+ */
+void             gps_set_callback ( gps_s *gps, uart_cb cb, void *arg );
+
+/*
+ * Get the latest fix
+ */
+const gps_fix_s *gps_fix ( gps_s *gps );
+
+#endif /* ABC_GPS_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -32,131 +32,508 @@
 #include "hal/trace.h"
 
 #include <string.h>
-#include <stdlib.h>
-#include <stdio.h>
 #include <time.h>
 
+/* ****************************************************************************
+ * Field conversion
+ *
+ * Fields arrive as fixed-point integers (value * 10^dp), these turn them
+ * into something useful without sscanf(), which is large and (without an
+ * FPU) slow
+ * ***************************************************************************/
+
 /*
- * Find start of next element
+ * Position element (ddmm.mmmmm * 1e5) to 1e-7 degrees
  */
-static bool
-next_element ( const char *l, const char **ptr )
+static coord_t
+nmea_pos ( int32_t v )
 {
-  l = strchr(l, ',');
-  if (NULL == l) return false;
-  *ptr = l + 1;
-  return true;
+  int32_t d;
+
+  /* Degrees, and minutes * 1e5 (1e-5 min = 1e-7 deg * 5/3) */
+  d  = v / 10000000;
+  v -= d * 10000000;
+  return (d * COORD_SCALE) + (((v * 5) + 1) / 3);
 }
 
 /*
- * Parse position element
+ * Time (hhmmss.sss)
  */
-static bool
-parse_pos ( const char *l, double *pos )
+static void
+nmea_hms ( int32_t v, gps_fix_s *f )
 {
-  uint32_t d;
-  double   x;
+  struct tm *tm = &f->fx_tm;
 
-  if (1 != sscanf(l, "%lf", &x)) return false;
+  f->fx_ms    = v % 1000;
+  v /= 1000;
+  tm->tm_sec  = v % 100;
+  v /= 100;
+  tm->tm_min  = v % 100;
+  tm->tm_hour = v / 100;
+}
 
-  d    = (uint32_t)(x / 100);
-  x   -= (d * 100);
-  *pos = (d + (x / 60.0));
+/*
+ * Date (ddmmyy)
+ */
+static void
+nmea_dmy ( int32_t v, struct tm *tm )
+{
+  tm->tm_year = 100 + (v % 100);
+  v /= 100;
+  tm->tm_mon  = (v % 100) - 1;
+  tm->tm_mday = v / 100;
+}
 
-  return true;
+/* ****************************************************************************
+ * Formatting
+ * ***************************************************************************/
+
+size_t
+nmea_coord_str ( char *buf, coord_t c )
+{
+  char     tmp[10];
+  char    *p = buf;
+  uint32_t u, d;
+  int      i;
+
+  if (c < 0) *p++ = '-';
+  u = (c < 0) ? (uint32_t)-(int64_t)c : (uint32_t)c;
+  d = u / COORD_SCALE;
+  u = u % COORD_SCALE;
+
+  /* Degrees */
+  i = 0;
+  do {
+    tmp[i++] = (char)('0' + (d % 10));
+    d /= 10;
+  } while (d);
+  while (i) *p++ = tmp[--i];
+
+  /* Fraction (7 places) */
+  *p++ = '.';
+  for (i = 6; i >= 0; --i) {
+    p[i] = (char)('0' + (u % 10));
+    u /= 10;
+  }
+  p   += 7;
+  *p   = '\0';
+
+  return (size_t)(p - buf);
 }
 
+/* ****************************************************************************
+ * Streaming parser
+ * ***************************************************************************/
+
+/*
+ * Parser states
+ */
+enum {
+  NMEA_S_IDLE,                          /**< Waiting for $ */
+  NMEA_S_ADDR,                          /**< Address field */
+  NMEA_S_FIELD,                         /**< Data fields */
+  NMEA_S_SKIP,                          /**< Data field that is not used */
+  NMEA_S_CSUM_HI,                       /**< Checksum, first digit */
+  NMEA_S_CSUM_LO,                       /**< Checksum, second digit */
+};
+
+/*
+ * Field flags
+ */
+#define NMEA_F_DIGIT  (0x01)            /**< Digits seen */
+#define NMEA_F_DOT    (0x02)            /**< Decimal point seen */
+#define NMEA_F_NEG    (0x04)            /**< Negative */
+#define NMEA_F_CHR    (0x08)            /**< Non-numeric character seen */
+#define NMEA_F_ERR    (0x10)            /**< Malformed or out of range */
+
+/* ****************************************************************************
+ * Sentence tables
+ *
+ * Each sentence is described by what to do with each field (indexed by
+ * field number, the address is field 0), so adding a sentence is just a
+ * table and a case in nmea_address()
+ * ***************************************************************************/
+
+/*
+ * What to do with a field
+ */
+enum {
+  NMEA_K_NONE = 0,                      /**< Ignored */
+  NMEA_K_TIME,                          /**< hhmmss.sss */
+  NMEA_K_DATE,                          /**< ddmmyy */
+  NMEA_K_STATUS,                        /**< A(ctive) or V(oid) */
+  NMEA_K_POS,                           /**< ddmm.mmmmm */
+  NMEA_K_HEMI,                          /**< N/S/E/W for the preceding POS */
+  NMEA_K_KNOTS,                         /**< Speed in knots */
+  NMEA_K_QUALITY,                       /**< GGA fix quality */
+  NMEA_K_VIEW,                          /**< Satellites in view (per talker) */
+  NMEA_K_INT,                           /**< Fixed-point to fd_off */
+};
+
+typedef struct nmea_field
+{
+  uint8_t fd_kind;                      /**< NMEA_K_xxx */
+  uint8_t fd_dp;                        /**< Decimal places kept */
+  uint8_t fd_off;                       /**< Offset into gps_fix_s */
+} nmea_field_s;
+
+typedef struct nmea_sentence
+{
+  nmea_type_t         ns_type;          /**< Type */
+  uint8_t             ns_nfields;       /**< Fields (all must be present) */
+  const nmea_field_s *ns_fields;        /**< Field descriptions */
+} nmea_sentence_s;
+
+#define NMEA_FIELD(k, dp)      { NMEA_K_##k, dp, 0 }
+#define NMEA_FIELD_INT(m, dp)  { NMEA_K_INT, dp, offsetof(gps_fix_s, m) }
+#define NMEA_SENTENCE(t, f)    { NMEA_##t, ARRAY_SIZE(f), f }
+
+/* $--RMC,hhmmss.ss,A,ddmm.mm,N,dddmm.mm,W,knots,course,ddmmyy,... */
+static const nmea_field_s nmea_rmc_fields[] = {
+  [1] = NMEA_FIELD(TIME,       3),
+  [2] = NMEA_FIELD(STATUS,     0),
+  [3] = NMEA_FIELD(POS,        5),
+  [4] = NMEA_FIELD(HEMI,       0),
+  [5] = NMEA_FIELD(POS,        5),
+  [6] = NMEA_FIELD(HEMI,       0),
+  [7] = NMEA_FIELD(KNOTS,      3),
+  [8] = NMEA_FIELD_INT(fx_course, 5),
+  [9] = NMEA_FIELD(DATE,       0),
+};
+
+/* $--GGA,hhmmss.ss,ddmm.mm,N,dddmm.mm,W,q,sats,hdop,alt,M,... */
+static const nmea_field_s nmea_gga_fields[] = {
+  [1] = NMEA_FIELD(TIME,       3),
+  [2] = NMEA_FIELD(POS,        5),
+  [3] = NMEA_FIELD(HEMI,       0),
+  [4] = NMEA_FIELD(POS,        5),
+  [5] = NMEA_FIELD(HEMI,       0),
+  [6] = NMEA_FIELD(QUALITY,    0),
+  [7] = NMEA_FIELD_INT(fx_sats,   0),
+  [8] = NMEA_FIELD_INT(fx_hdop,   2),
+  [9] = NMEA_FIELD_INT(fx_alt,    3),
+};
+
+/* $--GSA,M,mode,sv*12,pdop,hdop,vdop */
+static const nmea_field_s nmea_gsa_fields[] = {
+  [2]  = NMEA_FIELD_INT(fx_mode,  0),
+  [15] = NMEA_FIELD_INT(fx_pdop,  2),
+  [16] = NMEA_FIELD_INT(fx_hdop,  2),
+  [17] = NMEA_FIELD_INT(fx_vdop,  2),
+};
+
+/* $--GSV,msgs,msg,view,... */
+static const nmea_field_s nmea_gsv_fields[] = {
+  [3] = NMEA_FIELD(VIEW,       0),
+};
+
+/* $--VTG,course,T,mag,M,knots,N,kmh,K,... */
+static const nmea_field_s nmea_vtg_fields[] = {
+  [1] = NMEA_FIELD_INT(fx_course, 5),
+  [5] = NMEA_FIELD(KNOTS,      3),
+};
+
+static const nmea_sentence_s nmea_rmc = NMEA_SENTENCE(RMC, nmea_rmc_fields);
+static const nmea_sentence_s nmea_gga = NMEA_SENTENCE(GGA, nmea_gga_fields);
+static const nmea_sentence_s nmea_gsa = NMEA_SENTENCE(GSA, nmea_gsa_fields);
+static const nmea_sentence_s nmea_gsv = NMEA_SENTENCE(GSV, nmea_gsv_fields);
+static const nmea_sentence_s nmea_vtg = NMEA_SENTENCE(VTG, nmea_vtg_fields);
+
+/*
+ * Address complete, look up the talker and sentence
+ *
+ * @return false if the sentence is not one we want
+ */
 static bool
-parse_time ( const char *l, struct tm *tm )
+nmea_address ( nmea_parser_s *p )
 {
-  int u32;
+  const char *a = p->np_addr;
+
+  if (5 != p->np_alen) return false;
 
-  if (1 != sscanf(l, "%d", &u32)) return false;
+  /* Talker */
+  switch ((a[0] << 8) | a[1]) {
+    case ('G' << 8) | 'P': p->np_sys = GPS_SYS_GPS;     break;
+    case ('G' << 8) | 'L': p->np_sys = GPS_SYS_GLONASS; break;
+    case ('G' << 8) | 'A': p->np_sys = GPS_SYS_GALILEO; break;
+    case ('G' << 8) | 'B':
+    case ('B' << 8) | 'D': p->np_sys = GPS_SYS_BEIDOU;  break;
+    case ('G' << 8) | 'N': p->np_sys = GPS_SYS_MULTI;   break;
+    default: return false;
+  }
 
-  tm->tm_sec  = u32 % 100;
-  u32 /= 100;
-  tm->tm_min  = u32 % 100;
-  tm->tm_hour = u32 / 100;
+  /* Sentence */
+  switch ((a[2] << 16) | (a[3] << 8) | a[4]) {
+    case ('R' << 16) | ('M' << 8) | 'C': p->np_sentence = &nmea_rmc; break;
+    case ('G' << 16) | ('G' << 8) | 'A': p->np_sentence = &nmea_gga; break;
+    case ('G' << 16) | ('S' << 8) | 'A': p->np_sentence = &nmea_gsa; break;
+    case ('G' << 16) | ('S' << 8) | 'V': p->np_sentence = &nmea_gsv; break;
+    case ('V' << 16) | ('T' << 8) | 'G': p->np_sentence = &nmea_vtg; break;
+    default: return false;
+  }
 
   return true;
 }
 
-static bool
-parse_date ( const char *l, struct tm *tm )
+/* ****************************************************************************
+ * Fields
+ * ***************************************************************************/
+
+/*
+ * Start a new field
+ */
+static void
+nmea_field_start ( nmea_parser_s *p )
 {
-  int u32;
+  const nmea_sentence_s *ns = p->np_sentence;
 
-  if (1 != sscanf(l, "%d", &u32)) return false;
+  if ((p->np_field >= ns->ns_nfields) ||
+      (NMEA_K_NONE == ns->ns_fields[p->np_field].fd_kind)) {
+    p->np_state = NMEA_S_SKIP;
+    return;
+  }
+  p->np_state = NMEA_S_FIELD;
+  p->np_acc   = 0;
+  p->np_ndp   = 0;
+  p->np_flags = 0;
+  p->np_chr   = '\0';
+  p->np_dp    = ns->ns_fields[p->np_field].fd_dp;
+}
 
-  tm->tm_year  = 100 + (u32 % 100);
-  u32 /= 100;
-  tm->tm_mon   = (u32 % 100) - 1;
-  tm->tm_mday  = u32 / 100;
+/*
+ * Current field as a fixed-point number (value * 10^np_dp)
+ *
+ * @return false if the field is empty or not a number
+ */
+static bool
+nmea_field_num ( nmea_parser_s *p, int32_t *val )
+{
+  int32_t v = p->np_acc;
+  uint8_t n;
 
+  if (NMEA_F_DIGIT != (p->np_flags & (NMEA_F_DIGIT|NMEA_F_CHR|NMEA_F_ERR))) {
+    if (p->np_flags) p->np_ok = false;
+    return false;
+  }
+  for (n = p->np_ndp; n < p->np_dp; ++n) {
+    if (v > (INT32_MAX / 10)) {
+      p->np_ok = false;
+      return false;
+    }
+    v *= 10;
+  }
+  *val = (p->np_flags & NMEA_F_NEG) ? -v : v;
   return true;
 }
 
 /*
- * Parse line
+ * Field complete
  */
-bool
-nmea_gprmc ( const char *line, struct tm *tm, double *lat, double *lon )
+static void
+nmea_field_end ( nmea_parser_s *p )
 {
-  uint8_t csum1, csum2;
-  const char *l;
-
-  /* Invalid start */
-  if ('$' != *line) return false;
-  l = line + 1;
-
-  /* Calc checksum */
-  csum1 = 0;
-  while (('\0' != *l) && ('*' != *l)) {
-    csum1 ^= (uint8_t)*l;
-    ++l;
+  const nmea_sentence_s *ns = p->np_sentence;
+  const nmea_field_s    *fd;
+  gps_fix_s             *w = &p->np_work;
+  int32_t                v;
+
+  if (NMEA_S_SKIP == p->np_state) return;
+  fd = ns->ns_fields + p->np_field;
+
+  switch (fd->fd_kind) {
+    case NMEA_K_TIME:
+      if (nmea_field_num(p, &v)) nmea_hms(v, w);
+      break;
+    case NMEA_K_DATE:
+      if (nmea_field_num(p, &v))
+        nmea_dmy(v, &w->fx_tm);
+      else
+        w->fx_valid = false;
+      break;
+    case NMEA_K_STATUS:
+      w->fx_valid = ('A' == p->np_chr);
+      break;
+    case NMEA_K_POS:
+      p->np_posok = nmea_field_num(p, &v);
+      if (p->np_posok)
+        p->np_pos = nmea_pos(v);
+      else
+        w->fx_valid = false;
+      break;
+    case NMEA_K_HEMI:
+      if (!p->np_posok) break;
+      p->np_posok = false;
+      if (('N' == p->np_chr) || ('S' == p->np_chr))
+        w->fx_lat = ('S' == p->np_chr) ? -p->np_pos : p->np_pos;
+      else if (('E' == p->np_chr) || ('W' == p->np_chr))
+        w->fx_lon = ('W' == p->np_chr) ? -p->np_pos : p->np_pos;
+      break;
+    case NMEA_K_KNOTS:
+      /* knots * 1e3 to mm/s */
+      if (nmea_field_num(p, &v))
+        w->fx_speed = (int32_t)((((int64_t)v * 1852) + 1800) / 3600);
+      break;
+    case NMEA_K_QUALITY:
+      if (!nmea_field_num(p, &v)) break;
+      w->fx_quality = v;
+      if (0 == v) w->fx_valid = false;
+      break;
+    case NMEA_K_VIEW:
+      if ((p->np_sys < GPS_SYS_MAX) && nmea_field_num(p, &v))
+        w->fx_sats_view[p->np_sys] = v;
+      break;
+    case NMEA_K_INT:
+      if (nmea_field_num(p, &v))
+        *(int32_t*)((uint8_t*)w + fd->fd_off) = v;
+      break;
   }
-  if ('\0' == *l) return false;
+}
 
-  /* Check */
-  csum2 = (uint8_t)((nibble(l[1]) << 4) + nibble(l[2]));
-  if (csum1 != csum2) return;
+/* ****************************************************************************
+ * Parser
+ * ***************************************************************************/
 
-  /* Process */
-  if (NULL != strstr(line, "$GPRMC")) {
+/*
+ * Process a single byte
+ */
+static nmea_type_t
+nmea_byte ( nmea_parser_s *p, uint8_t c )
+{
+  /* Start of sentence (from any state, which resyncs after garbage) */
+  if ('$' == c) {
+    p->np_state = NMEA_S_ADDR;
+    p->np_csum  = 0;
+    p->np_alen  = 0;
+    return NMEA_NONE;
+  }
 
-    /* Time */
-    if (!parse_time(line + 7, tm)) return false;
+  switch (p->np_state) {
 
-    /* Valid? */
-    if (!next_element(line+7, &l))  return false;
-    if ('A' != *l) return false;
+    /* Address */
+    case NMEA_S_ADDR:
+      p->np_csum ^= c;
+      if (',' != c) {
+        if (p->np_alen < sizeof(p->np_addr))
+          p->np_addr[p->np_alen++] = (char)c;
+        else
+          p->np_state = NMEA_S_IDLE;
+        break;
+      }
+      if (!nmea_address(p)) {
+        p->np_state = NMEA_S_IDLE;
+        break;
+      }
+      p->np_work  = p->np_fix;
+      p->np_ok    = true;
+      p->np_posok = false;
+      p->np_field = 1;
+      nmea_field_start(p);
+      break;
 
-    /* Latitude */
-    if (!parse_pos(l + 2, lat))    return false;
-    if (!next_element(l + 2, &l))   return false;
-    if ('S' == *l) *lat *= -1;
+    /* Data */
+    case NMEA_S_SKIP:
+      if ((',' != c) && ('*' != c) && ('\r' != c) && ('\n' != c)) {
+        p->np_csum ^= c;
+        break;
+      }
+      /* fall through */
+    case NMEA_S_FIELD:
+      if (('*' == c) || (',' == c)) {
+        nmea_field_end(p);
+        if ('*' == c) {
+          if ((p->np_field + 1) < p->np_sentence->ns_nfields)
+            p->np_ok = false;                   /* Truncated */
+          p->np_state = NMEA_S_CSUM_HI;
+          break;
+        }
+        p->np_csum ^= c;
+        ++p->np_field;
+        nmea_field_start(p);
+      } else if (('0' <= c) && ('9' >= c)) {
+        p->np_csum  ^= c;
+        p->np_flags |= NMEA_F_DIGIT;
+        if (p->np_flags & NMEA_F_DOT) {
+          if (p->np_ndp >= p->np_dp) break;
+          ++p->np_ndp;
+        }
+        if (p->np_acc > ((INT32_MAX - 9) / 10))
+          p->np_flags |= NMEA_F_ERR;
+        else
+          p->np_acc = (p->np_acc * 10) + (c - '0');
+      } else if (('\r' == c) || ('\n' == c)) {
+        p->np_state = NMEA_S_IDLE;
+      } else {
+        p->np_csum ^= c;
+        if (('.' == c) && !(p->np_flags & NMEA_F_DOT))
+          p->np_flags |= NMEA_F_DOT;
+        else if (('-' == c) && !p->np_flags)
+          p->np_flags |= NMEA_F_NEG;
+        else {
+          p->np_flags |= NMEA_F_CHR;
+          p->np_chr    = (char)c;
+        }
+      }
+      break;
 
-    /* Longitude */
-    if (!parse_pos(l + 2, lon))    return false;
-    if (!next_element(l + 2, &l))   return false;
-    if ('W' == *l) *lon *= -1;
+    /* Checksum */
+    case NMEA_S_CSUM_HI:
+      p->np_rxcsum = (uint8_t)(nibble((char)c) << 4);
+      p->np_state  = NMEA_S_CSUM_LO;
+      break;
+    case NMEA_S_CSUM_LO:
+      p->np_state = NMEA_S_IDLE;
+      p->np_rxcsum += nibble((char)c);
+      if (!p->np_ok || (p->np_rxcsum != p->np_csum)) break;
+      p->np_fix = p->np_work;
+      return p->np_sentence->ns_type;
+  }
 
-    /* Skip next two */
-    if (!next_element(l + 2, &l))   return false;
-    if (!next_element(l + 0, &l))   return false;
+  return NMEA_NONE;
+}
+
+void
+nmea_init ( nmea_parser_s *p )
+{
+  memset(p, 0, sizeof(*p));
+  p->np_state = NMEA_S_IDLE;
+}
 
-    /* Date */
-    if (!parse_date(l, tm))        return false;
+size_t
+nmea_feed
+  ( nmea_parser_s *p, const uint8_t *buf, size_t len, nmea_type_t *type )
+{
+  const uint8_t *s;
+  nmea_type_t    t;
+  size_t         i;
 
-    char tms[32];
-    strftime(tms, sizeof(tms), "%Y-%m-%d %H:%M:%S", tm);
-    trace_printf("nmea: time %s lat %0.6f lon %0.6f\n", tms, *lat, *lon);
-    return true;
-  }
+  *type = NMEA_NONE;
+  for (i = 0; i < len; ) {
 
-  return false;
+    /* Skip to the next sentence (unwanted ones are dropped at the address) */
+    if (NMEA_S_IDLE == p->np_state) {
+      if (NULL == (s = memchr(buf + i, '$', len - i))) return len;
+      i = (size_t)(s - buf);
+    }
+
+    t = nmea_byte(p, buf[i++]);
+    if (NMEA_NONE != t) {
+      *type = t;
+      break;
+    }
+  }
+  return i;
 }
 
+nmea_type_t
+nmea_parse ( nmea_parser_s *p, const char *line )
+{
+  nmea_type_t type;
+
+  /* Anything part parsed is lost */
+  p->np_state = NMEA_S_IDLE;
+  nmea_feed(p, (const uint8_t*)line, strlen(line), &type);
+  return type;
+}
 
 /* ****************************************************************************
  * Editor Configuration
@@ -29,12 +29,94 @@
 #ifndef ABC_NMEA_H
 #define ABC_NMEA_H
 
-#include <time.h>
+#include "gps.h"
+
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* ****************************************************************************
+ * Streaming parser
+ * ***************************************************************************/
 
-void nmea_parse ( const char *line );
+/*
+ * Sentence types
+ */
+typedef enum nmea_type
+{
+  NMEA_NONE = 0,
+  NMEA_RMC,                             /**< Recommended minimum */
+  NMEA_GGA,                             /**< Fix data */
+  NMEA_GSA,                             /**< DOP and active satellites */
+  NMEA_GSV,                             /**< Satellites in view */
+  NMEA_VTG,                             /**< Course and speed */
+} nmea_type_t;
 
-bool nmea_gprmc ( const char *line, struct tm *tm, double *lat, double *lon );
+/*
+ * Parser state
+ *
+ * Bytes are consumed as they arrive: the checksum, field index and the
+ * current field's value are all updated in place, so no line is ever
+ * buffered. Fields are applied to a working copy of the fix which only
+ * replaces np_fix once the checksum has been verified.
+ */
+struct nmea_sentence;
+typedef struct nmea_parser
+{
+  gps_fix_s   np_fix;                   /**< Last verified fix */
+  gps_fix_s   np_work;                  /**< Fix being updated */
+  const struct nmea_sentence *np_sentence; /**< Current sentence */
+  uint8_t     np_sys;                   /**< Current talker (gps_sys_t) */
+  uint8_t     np_state;                 /**< Parser state */
+  uint8_t     np_csum;                  /**< Running checksum */
+  uint8_t     np_rxcsum;                /**< Received checksum */
+  uint8_t     np_field;                 /**< Current field index */
+  char        np_addr[5];               /**< Address (e.g. GPRMC) */
+  uint8_t     np_alen;                  /**< Address length */
+  int32_t     np_acc;                   /**< Field value accumulator */
+  uint8_t     np_dp;                    /**< Decimal places wanted */
+  uint8_t     np_ndp;                   /**< Decimal places seen */
+  uint8_t     np_flags;                 /**< Field flags */
+  char        np_chr;                   /**< Field character (e.g. N/S) */
+  coord_t     np_pos;                   /**< Position awaiting hemisphere */
+  bool        np_posok;                 /**< np_pos is set */
+  bool        np_ok;                    /**< No malformed fields */
+} nmea_parser_s;
+
+/*
+ * Reset the parser (and forget the fix)
+ */
+void        nmea_init ( nmea_parser_s *p );
+
+/*
+ * Feed received bytes to the parser
+ *
+ * This stops after each complete (and verified) sentence so the caller can
+ * act on it, p->np_fix holds the result.
+ *
+ * @param type Output, the sentence completed or NMEA_NONE
+ *
+ * @return The number of bytes consumed
+ */
+size_t      nmea_feed
+  ( nmea_parser_s *p, const uint8_t *buf, size_t len, nmea_type_t *type );
+
+/*
+ * Parse a single (complete) sentence
+ *
+ * @return The sentence type, or NMEA_NONE if it was not understood
+ */
+nmea_type_t nmea_parse ( nmea_parser_s *p, const char *line );
+
+/*
+ * Format a coordinate as decimal degrees (e.g. -0.1122390)
+ *
+ * @param buf Output, must have room for NMEA_COORD_STRLEN bytes
+ *
+ * @return The length of the string (excluding the terminator)
+ */
+#define NMEA_COORD_STRLEN (13)
+size_t nmea_coord_str ( char *buf, coord_t c );
 
 #endif /* ABC_NMEA_H */
 
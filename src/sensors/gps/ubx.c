@@ -0,0 +1,479 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * u-blox UBX protocol
+ * ***************************************************************************/
+
+#include "ubx.h"
+
+#include <string.h>
+
+/*
+ * Sync characters
+ */
+#define UBX_SYNC1 (0xB5)
+#define UBX_SYNC2 (0x62)
+
+/*
+ * Parser states
+ */
+enum {
+  UBX_S_SYNC1,                          /**< Waiting for 0xB5 */
+  UBX_S_SYNC2,                          /**< Waiting for 0x62 */
+  UBX_S_CLASS,                          /**< Message class */
+  UBX_S_ID,                             /**< Message ID */
+  UBX_S_LEN1,                           /**< Length, low byte */
+  UBX_S_LEN2,                           /**< Length, high byte */
+  UBX_S_PAYLOAD,                        /**< Payload */
+  UBX_S_CK_A,                           /**< Checksum, first byte */
+  UBX_S_CK_B,                           /**< Checksum, second byte */
+};
+
+/* ****************************************************************************
+ * Field access (little endian, unaligned)
+ * ***************************************************************************/
+
+static inline uint16_t
+ubx_u16 ( const uint8_t *b )
+{
+  return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static inline uint32_t
+ubx_u32 ( const uint8_t *b )
+{
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static inline int32_t
+ubx_i32 ( const uint8_t *b )
+{
+  return (int32_t)ubx_u32(b);
+}
+
+static inline void
+ubx_put_u16 ( uint8_t *b, uint16_t v )
+{
+  b[0] = (uint8_t)v;
+  b[1] = (uint8_t)(v >> 8);
+}
+
+static inline void
+ubx_put_u32 ( uint8_t *b, uint32_t v )
+{
+  ubx_put_u16(b,     (uint16_t)v);
+  ubx_put_u16(b + 2, (uint16_t)(v >> 16));
+}
+
+/* ****************************************************************************
+ * Messages
+ * ***************************************************************************/
+
+/*
+ * NAV-PVT (92 bytes, 84 on u-blox 7)
+ */
+static bool
+ubx_nav_pvt ( ubx_parser_s *p )
+{
+  const uint8_t *b = p->up_payload;
+  gps_fix_s     *f = &p->up_fix;
+  uint8_t        type;
+
+  if (p->up_len < 84) return false;
+
+  /* Date and time (if both resolved) */
+  if (0x03 == (b[11] & 0x03)) {
+    f->fx_tm.tm_year = ubx_u16(b + 4) - 1900;
+    f->fx_tm.tm_mon  = b[6] - 1;
+    f->fx_tm.tm_mday = b[7];
+    f->fx_tm.tm_hour = b[8];
+    f->fx_tm.tm_min  = b[9];
+    f->fx_tm.tm_sec  = b[10];
+  }
+
+  /* Milliseconds (iTOW, GPS and UTC differ by whole seconds) */
+  f->fx_ms = (int32_t)(ubx_u32(b) % 1000);
+
+  /* Fix type (0 none, 1 DR, 2 2D, 3 3D, 4 GNSS+DR, 5 time) and gnssFixOK */
+  type          = b[20];
+  f->fx_valid   = (b[21] & 0x01) && (type >= 2) && (type <= 4);
+  f->fx_quality = f->fx_valid ? 1 : 0;
+  f->fx_mode    = ((2 == type) || (3 == type)) ? type : ((4 == type) ? 3 : 1);
+  f->fx_sats    = b[23];
+
+  /* Solution */
+  f->fx_lon     = ubx_i32(b + 24);
+  f->fx_lat     = ubx_i32(b + 28);
+  f->fx_alt     = ubx_i32(b + 36);
+  f->fx_speed   = ubx_i32(b + 60);
+  f->fx_course  = ubx_i32(b + 64);
+  f->fx_pdop    = ubx_u16(b + 76);
+
+  return true;
+}
+
+/*
+ * NAV-POSLLH (28 bytes)
+ */
+static bool
+ubx_nav_posllh ( ubx_parser_s *p )
+{
+  const uint8_t *b = p->up_payload;
+  gps_fix_s     *f = &p->up_fix;
+
+  if (p->up_len < 28) return false;
+
+  f->fx_ms  = (int32_t)(ubx_u32(b) % 1000);
+  f->fx_lon = ubx_i32(b + 4);
+  f->fx_lat = ubx_i32(b + 8);
+  f->fx_alt = ubx_i32(b + 16);
+
+  return true;
+}
+
+/*
+ * NAV-SOL (52 bytes)
+ */
+static bool
+ubx_nav_sol ( ubx_parser_s *p )
+{
+  const uint8_t *b = p->up_payload;
+  gps_fix_s     *f = &p->up_fix;
+  uint8_t        type;
+
+  if (p->up_len < 52) return false;
+
+  /* Fix type (as NAV-PVT) and GPSfixOK */
+  type          = b[10];
+  f->fx_valid   = (b[11] & 0x01) && (type >= 2) && (type <= 4);
+  f->fx_quality = f->fx_valid ? 1 : 0;
+  f->fx_mode    = ((2 == type) || (3 == type)) ? type : ((4 == type) ? 3 : 1);
+  f->fx_pdop    = ubx_u16(b + 44);
+  f->fx_sats    = b[47];
+
+  return true;
+}
+
+/*
+ * NAV-TIMEUTC (20 bytes)
+ */
+static bool
+ubx_nav_timeutc ( ubx_parser_s *p )
+{
+  const uint8_t *b = p->up_payload;
+  gps_fix_s     *f = &p->up_fix;
+
+  if (p->up_len < 20) return false;
+
+  /* Date and time (once UTC is known, not just GPS time) */
+  if (b[19] & 0x04) {
+    f->fx_tm.tm_year = ubx_u16(b + 12) - 1900;
+    f->fx_tm.tm_mon  = b[14] - 1;
+    f->fx_tm.tm_mday = b[15];
+    f->fx_tm.tm_hour = b[16];
+    f->fx_tm.tm_min  = b[17];
+    f->fx_tm.tm_sec  = b[18];
+  }
+  f->fx_ms = (int32_t)(ubx_u32(b) % 1000);
+
+  return true;
+}
+
+/*
+ * Legacy NAV message decoded, is the solution complete
+ */
+static ubx_type_t
+ubx_epoch ( ubx_parser_s *p, ubx_type_t t )
+{
+  uint32_t itow = ubx_u32(p->up_payload);
+
+  if (itow != p->up_itow) {
+    p->up_itow  = itow;
+    p->up_epoch = 0;
+  }
+  p->up_epoch |= (uint8_t)(1 << t);
+  if (((1 << UBX_POSLLH) | (1 << UBX_SOL) | (1 << UBX_TIMEUTC)) !=
+      p->up_epoch)
+    return t;
+
+  p->up_epoch = 0;
+  return UBX_EPOCH;
+}
+
+/*
+ * Verified message
+ */
+static ubx_type_t
+ubx_message ( ubx_parser_s *p )
+{
+  switch ((p->up_class << 8) | p->up_id) {
+    case (UBX_CLASS_NAV << 8) | UBX_NAV_PVT:
+      return ubx_nav_pvt(p) ? UBX_PVT : UBX_NONE;
+    case (UBX_CLASS_NAV << 8) | UBX_NAV_POSLLH:
+      return ubx_nav_posllh(p) ? ubx_epoch(p, UBX_POSLLH) : UBX_NONE;
+    case (UBX_CLASS_NAV << 8) | UBX_NAV_SOL:
+      return ubx_nav_sol(p) ? ubx_epoch(p, UBX_SOL) : UBX_NONE;
+    case (UBX_CLASS_NAV << 8) | UBX_NAV_TIMEUTC:
+      return ubx_nav_timeutc(p) ? ubx_epoch(p, UBX_TIMEUTC) : UBX_NONE;
+    case (UBX_CLASS_ACK << 8) | UBX_ACK_ACK:
+    case (UBX_CLASS_ACK << 8) | UBX_ACK_NAK:
+      if (2 != p->up_len) break;
+      p->up_ack_class = p->up_payload[0];
+      p->up_ack_id    = p->up_payload[1];
+      return (UBX_ACK_ACK == p->up_id) ? UBX_ACK : UBX_NAK;
+  }
+  return UBX_NONE;
+}
+
+/* ****************************************************************************
+ * Parser
+ * ***************************************************************************/
+
+/*
+ * Payload bytes
+ *
+ * @return The number of bytes used
+ */
+static size_t
+ubx_payload ( ubx_parser_s *p, const uint8_t *buf, size_t len )
+{
+  uint8_t a = p->up_ck_a, b = p->up_ck_b;
+  size_t  i, n;
+
+  if (len > (size_t)(p->up_len - p->up_pos))
+    len = p->up_len - p->up_pos;
+  for (i = 0; i < len; i++) {
+    a += buf[i];
+    b += a;
+  }
+
+  /* Keep what fits (longer messages are only checked) */
+  if (p->up_pos < UBX_MAX_PAYLOAD) {
+    n = UBX_MAX_PAYLOAD - p->up_pos;
+    memcpy(p->up_payload + p->up_pos, buf, (len < n) ? len : n);
+  }
+
+  p->up_ck_a  = a;
+  p->up_ck_b  = b;
+  p->up_pos  += (uint16_t)len;
+  if (p->up_pos >= p->up_len) p->up_state = UBX_S_CK_A;
+
+  return len;
+}
+
+/*
+ * Process a single byte
+ */
+static ubx_type_t
+ubx_byte ( ubx_parser_s *p, uint8_t c )
+{
+  /* Checksum covers class to the end of the payload */
+  if ((p->up_state >= UBX_S_CLASS) && (p->up_state <= UBX_S_LEN2)) {
+    p->up_ck_a += c;
+    p->up_ck_b += p->up_ck_a;
+  }
+
+  switch (p->up_state) {
+    case UBX_S_SYNC1:
+      if (UBX_SYNC1 == c) p->up_state = UBX_S_SYNC2;
+      break;
+    case UBX_S_SYNC2:
+      if (UBX_SYNC2 == c) {
+        p->up_state = UBX_S_CLASS;
+        p->up_ck_a  = 0;
+        p->up_ck_b  = 0;
+      } else if (UBX_SYNC1 != c) {
+        p->up_state = UBX_S_SYNC1;
+      }
+      break;
+    case UBX_S_CLASS:
+      p->up_class = c;
+      p->up_state = UBX_S_ID;
+      break;
+    case UBX_S_ID:
+      p->up_id    = c;
+      p->up_state = UBX_S_LEN1;
+      break;
+    case UBX_S_LEN1:
+      p->up_len   = c;
+      p->up_state = UBX_S_LEN2;
+      break;
+    case UBX_S_LEN2:
+      p->up_len  |= (uint16_t)(c << 8);
+      p->up_pos   = 0;
+      p->up_state = p->up_len ? UBX_S_PAYLOAD : UBX_S_CK_A;
+      break;
+    case UBX_S_CK_A:
+      if (c == p->up_ck_a) {
+        p->up_state = UBX_S_CK_B;
+        break;
+      }
+      p->up_state = (UBX_SYNC1 == c) ? UBX_S_SYNC2 : UBX_S_SYNC1;
+      break;
+    case UBX_S_CK_B:
+      p->up_state = UBX_S_SYNC1;
+      if (c != p->up_ck_b) {
+        if (UBX_SYNC1 == c) p->up_state = UBX_S_SYNC2;
+        break;
+      }
+      if (p->up_len > UBX_MAX_PAYLOAD) break;
+      return ubx_message(p);
+  }
+
+  return UBX_NONE;
+}
+
+void
+ubx_init ( ubx_parser_s *p )
+{
+  memset(p, 0, sizeof(*p));
+  p->up_state = UBX_S_SYNC1;
+}
+
+size_t
+ubx_feed
+  ( ubx_parser_s *p, const uint8_t *buf, size_t len, ubx_type_t *type )
+{
+  const uint8_t *s;
+  ubx_type_t     t;
+  size_t         i;
+
+  *type = UBX_NONE;
+  for (i = 0; i < len; ) {
+
+    /* Skip to the next frame */
+    if (UBX_S_SYNC1 == p->up_state) {
+      if (NULL == (s = memchr(buf + i, UBX_SYNC1, len - i))) return len;
+      i = (size_t)(s - buf);
+    }
+
+    /* Payload, as much as is here in one go */
+    else if (UBX_S_PAYLOAD == p->up_state) {
+      i += ubx_payload(p, buf + i, len - i);
+      continue;
+    }
+
+    t = ubx_byte(p, buf[i++]);
+    if (UBX_NONE != t) {
+      *type = t;
+      break;
+    }
+  }
+  return i;
+}
+
+/* ****************************************************************************
+ * Configuration
+ * ***************************************************************************/
+
+size_t
+ubx_frame
+  ( uint8_t *buf, uint8_t cls, uint8_t id, const uint8_t *payload,
+    uint16_t len )
+{
+  uint8_t a = 0, b = 0;
+  size_t  i;
+
+  buf[0] = UBX_SYNC1;
+  buf[1] = UBX_SYNC2;
+  buf[2] = cls;
+  buf[3] = id;
+  ubx_put_u16(buf + 4, len);
+  if (len) memcpy(buf + 6, payload, len);
+  for (i = 2; i < (6u + len); i++) {
+    a += buf[i];
+    b += a;
+  }
+  buf[6 + len] = a;
+  buf[7 + len] = b;
+
+  return len + UBX_FRAME_OVERHEAD;
+}
+
+void
+ubx_send
+  ( uart_s *uart, uint8_t cls, uint8_t id, const uint8_t *payload,
+    uint16_t len )
+{
+  uint8_t buf[20 + UBX_FRAME_OVERHEAD];
+  size_t  n, o = 0;
+  ssize_t r;
+
+  n = ubx_frame(buf, cls, id, payload, len);
+  while (o < n) {
+    r = uart_write(uart, buf + o, n - o);
+    if (0 > r) return;
+    if (0 == r) uart_flush(uart);
+    o += (size_t)r;
+  }
+}
+
+void
+ubx_configure
+  ( uart_s *uart, uint32_t baud, uint16_t rate_ms, uint8_t nav )
+{
+  static const uint8_t legacy[] = { UBX_NAV_SOL, UBX_NAV_TIMEUTC };
+  uint8_t pl[20];
+  size_t  i;
+
+  /* NAV message every solution (on the current port) */
+  if (0 != nav) {
+    pl[0] = UBX_CLASS_NAV;
+    pl[1] = nav;
+    pl[2] = 1;
+    ubx_send(uart, UBX_CLASS_CFG, UBX_CFG_MSG, pl, 3);
+  }
+
+  /* Without NAV-PVT, the rest of the fix */
+  if (UBX_NAV_POSLLH == nav) {
+    for (i = 0; i < sizeof(legacy); i++) {
+      pl[1] = legacy[i];
+      ubx_send(uart, UBX_CLASS_CFG, UBX_CFG_MSG, pl, 3);
+    }
+  }
+
+  /* Measurement rate, one solution per measurement, aligned to GPS time */
+  ubx_put_u16(pl + 0, rate_ms);
+  ubx_put_u16(pl + 2, 1);
+  ubx_put_u16(pl + 4, 1);
+  ubx_send(uart, UBX_CLASS_CFG, UBX_CFG_RATE, pl, 6);
+
+  /* UART1, 8N1 at the new rate (last, the port changes after) */
+  memset(pl, 0, sizeof(pl));
+  pl[0] = 1;
+  ubx_put_u32(pl + 4,  0x000008D0);
+  ubx_put_u32(pl + 8,  baud);
+  ubx_put_u16(pl + 12, UBX_PROTO_UBX | UBX_PROTO_NMEA);
+  ubx_put_u16(pl + 14, nav ? UBX_PROTO_UBX : UBX_PROTO_NMEA);
+  ubx_send(uart, UBX_CLASS_CFG, UBX_CFG_PRT, pl, 20);
+
+  uart_flush(uart);
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
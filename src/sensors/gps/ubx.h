@@ -0,0 +1,176 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * u-blox UBX protocol
+ *
+ * Binary framing (sync 0xB5 0x62, class, id, 16-bit length, payload and an
+ * 8-bit Fletcher checksum over class..payload). A NAV-PVT carries the whole
+ * fix in 100 bytes, against ~200 bytes of RMC/GGA/GSA text that then has to
+ * be parsed.
+ *
+ * Receivers before u-blox 7 (e.g. NEO-6M) have no NAV-PVT. The same fix is
+ * then put together from NAV-POSLLH (position), NAV-SOL (validity) and
+ * NAV-TIMEUTC (date and time), which the receiver sends in that order for
+ * each solution.
+ * ***************************************************************************/
+
+#ifndef ABC_UBX_H
+#define ABC_UBX_H
+
+#include "gps.h"
+#include "hal/uart.h"
+
+#include <stddef.h>
+
+/*
+ * Message classes and IDs
+ */
+#define UBX_CLASS_NAV     (0x01)
+#define UBX_CLASS_ACK     (0x05)
+#define UBX_CLASS_CFG     (0x06)
+
+#define UBX_NAV_POSLLH    (0x02)
+#define UBX_NAV_SOL       (0x06)
+#define UBX_NAV_PVT       (0x07)
+#define UBX_NAV_TIMEUTC   (0x21)
+#define UBX_ACK_NAK       (0x00)
+#define UBX_ACK_ACK       (0x01)
+#define UBX_CFG_PRT       (0x00)
+#define UBX_CFG_MSG       (0x01)
+#define UBX_CFG_RATE      (0x08)
+
+/*
+ * CFG-PRT protocol masks
+ */
+#define UBX_PROTO_UBX     (0x0001)
+#define UBX_PROTO_NMEA    (0x0002)
+
+/*
+ * Largest payload kept (NAV-PVT), longer messages are checked and dropped
+ */
+#define UBX_MAX_PAYLOAD   (92)
+
+/*
+ * Frame overhead (sync, class, id, length, checksum)
+ */
+#define UBX_FRAME_OVERHEAD (8)
+
+/*
+ * Messages decoded
+ */
+typedef enum ubx_type
+{
+  UBX_NONE = 0,
+  UBX_PVT,                              /**< NAV-PVT (u-blox 7 onwards) */
+  UBX_POSLLH,                           /**< NAV-POSLLH (position) */
+  UBX_SOL,                              /**< NAV-SOL (fix type, DOP) */
+  UBX_TIMEUTC,                          /**< NAV-TIMEUTC (date and time) */
+  UBX_EPOCH,                            /**< All three of the above, for
+                                             the same solution */
+  UBX_ACK,                              /**< ACK-ACK */
+  UBX_NAK,                              /**< ACK-NAK */
+} ubx_type_t;
+
+/*
+ * Parser state
+ */
+typedef struct ubx_parser
+{
+  gps_fix_s up_fix;                     /**< Fix, updated by NAV messages */
+  uint8_t   up_ack_class;               /**< Last ACK/NAK, message class */
+  uint8_t   up_ack_id;                  /**< Last ACK/NAK, message ID */
+  uint8_t   up_epoch;                   /**< Legacy NAV messages seen */
+  uint32_t  up_itow;                    /**< For this solution (iTOW) */
+  uint8_t   up_state;                   /**< Parser state */
+  uint8_t   up_class;                   /**< Current message class */
+  uint8_t   up_id;                      /**< Current message ID */
+  uint8_t   up_ck_a;                    /**< Running checksum */
+  uint8_t   up_ck_b;
+  uint16_t  up_len;                     /**< Payload length */
+  uint16_t  up_pos;                     /**< Payload received */
+  uint8_t   up_payload[UBX_MAX_PAYLOAD];/**< Payload */
+} ubx_parser_s;
+
+/*
+ * Reset the parser (and forget the fix)
+ */
+void       ubx_init ( ubx_parser_s *p );
+
+/*
+ * Feed received bytes to the parser
+ *
+ * This stops after each complete (and verified) message so the caller can
+ * act on it, p->up_fix holds the result.
+ *
+ * @param type Output, the message completed or UBX_NONE
+ *
+ * @return The number of bytes consumed
+ */
+size_t     ubx_feed
+  ( ubx_parser_s *p, const uint8_t *buf, size_t len, ubx_type_t *type );
+
+/*
+ * Build a frame
+ *
+ * @param buf Output, must have room for len + UBX_FRAME_OVERHEAD bytes
+ *
+ * @return The frame length
+ */
+size_t     ubx_frame
+  ( uint8_t *buf, uint8_t cls, uint8_t id, const uint8_t *payload,
+    uint16_t len );
+
+/*
+ * Send a message (waits for room in the UART)
+ */
+void       ubx_send
+  ( uart_s *uart, uint8_t cls, uint8_t id, const uint8_t *payload,
+    uint16_t len );
+
+/*
+ * Configure the receiver's output
+ *
+ * Enables the given NAV message (UBX_NAV_PVT, or UBX_NAV_POSLLH for older
+ * receivers, along with NAV-SOL and NAV-TIMEUTC) once per solution, sets
+ * the measurement rate and finally moves UART1 to the new baud rate with
+ * only UBX output. With nav 0 the output stays NMEA. The messages are
+ * fully sent before this returns, the caller must then re-open the UART at
+ * baud.
+ *
+ * @param uart    The UART the receiver is on
+ * @param baud    The new baud rate
+ * @param rate_ms The measurement period (e.g. 100 for 10Hz)
+ * @param nav     The NAV message to enable, or 0
+ */
+void       ubx_configure
+  ( uart_s *uart, uint32_t baud, uint16_t rate_ms, uint8_t nav );
+
+#endif /* ABC_UBX_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
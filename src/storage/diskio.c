@@ -35,9 +35,184 @@
 
 #include <string.h>
 
-static int      di_sector = -1;
-static uint8_t  di_buffer[512];
+/*
+ * Maximum number of sectors skipped over to keep a multi-block read going,
+ * rather than stopping it and starting a new one
+ */
+#define DISKIO_READAHEAD (4)
+
+/*
+ * Number of sectors cached (512 bytes of RAM each)
+ */
+#ifndef DISKIO_CACHE_SIZE
+#define DISKIO_CACHE_SIZE (4)
+#endif
+
+/*
+ * Number of pinned (FAT/directory) sector ranges
+ */
+#define DISKIO_PIN_MAX (2)
+
+typedef struct disk_cache
+{
+  DWORD   dc_sector;                      /**< Sector held */
+  DWORD   dc_used;                        /**< Last use (LRU) */
+  bool    dc_valid;                       /**< Entry holds a sector */
+  bool    dc_pinned;                      /**< FAT/directory sector */
+  uint8_t dc_buffer[512];                 /**< Sector data */
+} disk_cache_s;
+
+static disk_cache_s di_cache[DISKIO_CACHE_SIZE];
+static DWORD    di_used;                 /**< LRU clock */
+static DWORD    di_hits;                 /**< Cache hits */
+static DWORD    di_misses;               /**< Cache misses */
+static DWORD    di_pin[DISKIO_PIN_MAX][2];/**< Pinned ranges (first, count) */
 static sdcard_s *di_card;
+static bool     di_rd_multi;             /**< Multi-block read active */
+static DWORD    di_rd_next;              /**< Next sector of the read */
+static bool     di_wr_multi;             /**< Multi-block write active */
+static DWORD    di_wr_next;              /**< Next sector of the write */
+static DWORD    di_wr_hint;              /**< Sectors still expected */
+
+/* ****************************************************************************
+ * Multi-block transfers
+ * ***************************************************************************/
+
+static DRESULT
+disk_rd_stop (void)
+{
+  if (!di_rd_multi) return RES_OK;
+  di_rd_multi = false;
+  return sdcard_read_stop(di_card) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT
+disk_wr_stop (void)
+{
+  if (!di_wr_multi) return RES_OK;
+  di_wr_multi = false;
+  return sdcard_write_stop(di_card) ? RES_OK : RES_ERROR;
+}
+
+/*
+ * Fetch a sector, continuing the current multi-block read if the sector
+ * is (just) ahead of it
+ */
+static DRESULT
+disk_fetch (DWORD sector, uint8_t *buf)
+{
+  /* Outside the read-ahead window */
+  if (di_rd_multi &&
+      ((sector < di_rd_next) || ((sector - di_rd_next) > DISKIO_READAHEAD)))
+    disk_rd_stop();
+
+  /* Start a new multi-block read */
+  if (!di_rd_multi) {
+    if (RES_OK != disk_wr_stop())               return RES_ERROR;
+    if (!sdcard_read_multi(di_card, sector))    return RES_ERROR;
+    di_rd_multi = true;
+    di_rd_next  = sector;
+  }
+
+  /* Pull sectors up to (and including) the one wanted */
+  while (di_rd_next <= sector) {
+    if (!sdcard_read_next(di_card, buf)) {
+      disk_rd_stop();
+      return RES_ERROR;
+    }
+    ++di_rd_next;
+  }
+
+  return RES_OK;
+}
+
+/* ****************************************************************************
+ * Sector cache
+ *
+ * A small LRU cache. Sectors inside a pinned range (the FAT and directory)
+ * are only ever evicted to make room for other pinned sectors, so that
+ * streaming file data through the cache does not flush out the metadata
+ * that cluster chain and path lookups keep coming back to.
+ * ***************************************************************************/
+
+static bool
+disk_cache_pinned (DWORD sector)
+{
+  int i;
+  for (i = 0; i < DISKIO_PIN_MAX; ++i)
+    if ((sector - di_pin[i][0]) < di_pin[i][1])
+      return true;
+  return false;
+}
+
+static disk_cache_s *
+disk_cache_find (DWORD sector)
+{
+  int i;
+  for (i = 0; i < DISKIO_CACHE_SIZE; ++i)
+    if (di_cache[i].dc_valid && (di_cache[i].dc_sector == sector))
+      return di_cache + i;
+  return NULL;
+}
+
+/*
+ * Pick the entry to replace: a free one, else the least recently used
+ * unpinned one, else (everything is pinned) the least recently used
+ */
+static disk_cache_s *
+disk_cache_victim (void)
+{
+  int i;
+  disk_cache_s *dc, *lru = NULL, *any = NULL;
+
+  for (i = 0; i < DISKIO_CACHE_SIZE; ++i) {
+    dc = di_cache + i;
+    if (!dc->dc_valid) return dc;
+    if (!dc->dc_pinned && (!lru || (dc->dc_used < lru->dc_used)))
+      lru = dc;
+    if (!any || (dc->dc_used < any->dc_used))
+      any = dc;
+  }
+  return lru ? lru : any;
+}
+
+static void
+disk_cache_drop (DWORD sector)
+{
+  disk_cache_s *dc = disk_cache_find(sector);
+  if (dc) dc->dc_valid = false;
+}
+
+void
+disk_cache_pin (DWORD sector, DWORD count)
+{
+  int i;
+  disk_cache_s *dc;
+
+  for (i = 0; i < DISKIO_PIN_MAX; ++i) {
+    if (di_pin[i][1]) continue;
+    di_pin[i][0] = sector;
+    di_pin[i][1] = count;
+    break;
+  }
+
+  /* Re-classify anything already cached */
+  for (i = 0; i < DISKIO_CACHE_SIZE; ++i) {
+    dc = di_cache + i;
+    dc->dc_pinned = dc->dc_valid && disk_cache_pinned(dc->dc_sector);
+  }
+}
+
+void
+disk_cache_stats (DWORD* hits, DWORD* misses)
+{
+  if (hits)   *hits   = di_hits;
+  if (misses) *misses = di_misses;
+}
+
+/* ****************************************************************************
+ * Petit FatFs interface
+ * ***************************************************************************/
 
 DSTATUS
 disk_initialize (void)
@@ -51,22 +226,94 @@ disk_initialize (void)
 DRESULT
 disk_readp (BYTE* buff, DWORD sector, UINT offser, UINT count)
 {
-  /* Read */
-  if (di_sector != (int)sector) {
-    if (512 != sdcard_read(di_card, sector, di_buffer, 512)) {
-      di_sector = -1;
-      return STA_NODISK;
-    }
+  disk_cache_s *dc = disk_cache_find(sector);
+
+  /* Miss */
+  if (NULL == dc) {
+    ++di_misses;
+    dc           = disk_cache_victim();
+    dc->dc_valid = false;
+    if (RES_OK != disk_fetch(sector, dc->dc_buffer)) return RES_ERROR;
+    dc->dc_valid  = true;
+    dc->dc_sector = sector;
+    dc->dc_pinned = disk_cache_pinned(sector);
+  } else {
+    ++di_hits;
   }
-  memcpy(buff, di_buffer + offser, count);
-  return 0;
+  dc->dc_used = ++di_used;
+
+  if (NULL != buff)
+    memcpy(buff, dc->dc_buffer + offser, count);
+  return RES_OK;
 }
 
-DRESULT disk_writep (const BYTE* buff, DWORD sc)
+/*
+ * Petit FatFs write protocol:
+ *
+ *   buff == NULL, sc != 0 : initiate a write to sector sc
+ *   buff != NULL          : stream sc bytes into the sector
+ *   buff == NULL, sc == 0 : finalize (remainder of sector is zero filled)
+ *
+ * Consecutive sectors are written as a single multi-block write, which is
+ * only closed when a non-consecutive sector is written, a read is needed
+ * or disk_sync() is called.
+ */
+DRESULT
+disk_writep (const BYTE* buff, DWORD sc)
+{
+  /* Stream data */
+  if (NULL != buff) {
+    if ((ssize_t)sc != sdcard_write_append(di_card, buff, sc))
+      return RES_ERROR;
+    return RES_OK;
+  }
+
+  /* Finalize */
+  if (0 == sc) {
+    if (sdcard_write_end(di_card)) return RES_OK;
+    disk_sync();
+    return RES_ERROR;
+  }
+
+  /* Initiate */
+  disk_cache_drop(sc);
+
+  /* Not the next sector, close the current multi-block write */
+  if (di_wr_multi && (sc != di_wr_next))
+    if (RES_OK != disk_wr_stop()) return RES_ERROR;
+
+  /* Start a new multi-block write */
+  if (!di_wr_multi) {
+    if (RES_OK != disk_rd_stop())                     return RES_ERROR;
+    if (!sdcard_write_multi(di_card, sc, di_wr_hint)) return RES_ERROR;
+    di_wr_multi = true;
+  }
+  di_wr_next = sc + 1;
+  if (di_wr_hint) --di_wr_hint;
+
+  if (sdcard_write_begin(di_card, sc)) return RES_OK;
+  disk_sync();
+  return RES_ERROR;
+}
+
+void
+disk_write_hint (DWORD count)
+{
+  di_wr_hint = count;
+}
+
+int
+disk_busy (void)
+{
+  return di_wr_multi && sdcard_write_busy(di_card);
+}
+
+DRESULT
+disk_sync (void)
 {
-  (void)buff;
-  (void)sc;
-  return 0; // TODO: not yet supported
+  DRESULT r = disk_rd_stop();
+  if (RES_OK != disk_wr_stop()) r = RES_ERROR;
+  return r;
 }
 
 /* ****************************************************************************
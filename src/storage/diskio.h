@@ -31,6 +31,11 @@ typedef enum {
 DSTATUS disk_initialize (void);
 DRESULT disk_readp (BYTE* buff, DWORD sector, UINT offser, UINT count);
 DRESULT disk_writep (const BYTE* buff, DWORD sc);
+void disk_write_hint (DWORD count);	/* Number of sectors about to be written sequentially (pre-erase) */
+DRESULT disk_sync (void);				/* Complete any outstanding multi-block read/write */
+int disk_busy (void);					/* Non-zero while the card is still programming (never waits) */
+void disk_cache_pin (DWORD sector, DWORD count);	/* Prefer to keep these (FAT/directory) sectors cached */
+void disk_cache_stats (DWORD* hits, DWORD* misses);	/* Sector cache hit/miss counters */
 
 #define STA_NOINIT		0x01	/* Drive not initialized */
 #define STA_NODISK		0x02	/* No medium in the drive */
@@ -24,6 +24,7 @@
 
 #include "hal/sdcard.h"
 #include "hal/spi.h"
+#include "hal/clock.h"
 #include "abc_misc.h"
 #include "board.h"
 
@@ -39,6 +40,20 @@
 #define SDCARD_SPI_SPEED_FAST (12500000)
 #define SDCARD_RETRIES            (1000)
 
+/*
+ * Bytes clocked in straight after a command (in the same transfer). The
+ * response arrives after 1-8 (Ncr) idle bytes and a data token no sooner
+ * than 1 (Nac) byte after the response, so 2 bytes catch the R1 of a prompt
+ * card without ever swallowing the start of a data block.
+ */
+#define SDCARD_NCR                   (2)
+
+/*
+ * Longest a card may stay busy programming (the SDXC write timeout, SDHC
+ * is 250ms)
+ */
+#define SDCARD_BUSY_MS               (500)
+
 /* ****************************************************************************
  * Module data
  * ***************************************************************************/
@@ -50,9 +65,20 @@ struct sdcard
   uint8_t       sd_idx;
   size_t        sd_sectors;
   struct {
-    bool f_sdv2 : 1;
-    bool f_sdhc : 1;
+    bool f_sdv2  : 1;
+    bool f_sdhc  : 1;
+    bool f_write : 1;
+    bool f_multi : 1;
+    bool f_busy  : 1;
+    bool f_rd_multi : 1;
   }             sd_flags;
+  uint16_t      sd_wr_len;               /**< Bytes sent in current write */
+  uint16_t      sd_wr_crc;               /**< CRC of current write */
+  size_t        sd_wr_next;              /**< Next sector in multi write */
+  size_t        sd_rd_next;              /**< Next sector in multi read */
+  uint8_t       sd_resp[SDCARD_NCR];     /**< Bytes clocked in after cmd */
+  uint8_t       sd_resp_len;             /**< Bytes in sd_resp */
+  uint8_t       sd_resp_pos;             /**< Bytes consumed from sd_resp */
 };
 
 sdcard_s sdcards[ABC_SDCARD_NUM];
@@ -93,10 +119,8 @@ crc7 ( const uint8_t *data, size_t len )
  * Calculate 16-bit CRC
  */
 static uint16_t
-crc16 ( const uint8_t *data, size_t len )
+crc16 ( uint16_t crc, const uint8_t *data, size_t len )
 {
-  uint16_t crc = 0;
-
   while (len) {
     crc = (uint16_t)((crc >> 8) | (crc << 8));
     crc = (uint16_t)(crc ^ *data);
@@ -119,15 +143,28 @@ sdcard_cs ( sdcard_s *sd, bool state )
   if (sd->sd_cs) sd->sd_cs(state);
 }
 
+/*
+ * Read bytes from the card, starting with any left over from the command
+ */
+static void
+sdcard_get_bytes ( sdcard_s *sd, uint8_t *buf, size_t len )
+{
+  while (len && (sd->sd_resp_pos < sd->sd_resp_len)) {
+    *buf++ = sd->sd_resp[sd->sd_resp_pos++];
+    --len;
+  }
+  if (len)
+    spi_tx_rx(sd->sd_spi, NULL, 0, buf, len);
+}
+
 /*
  * Dummy bytes
  */
 static void
 sdcard_nec ( sdcard_s *sd )
 {
-  static const uint8_t nec[]
-    = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
-  spi_tx_rx(sd->sd_spi, nec, sizeof(nec), NULL, 0);
+  sd->sd_resp_len = 0;
+  spi_xfer(sd->sd_spi, NULL, NULL, 8);
 }
 
 /*
@@ -153,8 +190,14 @@ sdcard_cmd ( sdcard_s *sd, uint8_t cmd, uint32_t arg )
   sdcard_printf("sdcard: cmd(%02X %02X %02X %02X %02X %02X)\n",
                 txbuf[0], txbuf[1], txbuf[2], txbuf[3], txbuf[4], txbuf[5]);
 
-  /* Send the command */
-  spi_tx_rx(sd->sd_spi, txbuf, 6, NULL, 0);
+  /* Send the command and collect the first response bytes */
+  const spi_seg_s segs[] = {
+    { txbuf, NULL,        sizeof(txbuf) },
+    { NULL,  sd->sd_resp, SDCARD_NCR    },
+  };
+  spi_xfer_list(sd->sd_spi, segs, ARRAY_SIZE(segs));
+  sd->sd_resp_len = SDCARD_NCR;
+  sd->sd_resp_pos = 0;
 }
 
 /*
@@ -167,7 +210,7 @@ sdcard_get_r1 ( sdcard_s *sd )
   uint16_t tries = SDCARD_RETRIES;
 
   while (--tries) {
-    spi_tx_rx(sd->sd_spi, NULL, 0, &r, 1);
+    sdcard_get_bytes(sd, &r, 1);
     if (0 == (r & 0x80))
       return r;
   }
@@ -189,7 +232,7 @@ sdcard_get_r7 ( sdcard_s *sd, uint32_t *r7 )
   if (0x01 != r1) return r1;
 
   /* Get R7 */
-  spi_tx_rx(sd->sd_spi, NULL, 0, tmp, 4);
+  sdcard_get_bytes(sd, tmp, 4);
   *r7 = (uint32_t)(tmp[0] << 24)
       | (uint32_t)(tmp[1] << 16)
       | (uint32_t)(tmp[2] <<  8)
@@ -212,20 +255,21 @@ sdcard_get_data ( sdcard_s *sd, uint8_t *buf, size_t len )
 
   /* Wait for first start byte */
   while (--tries) {
-    spi_tx_rx(sd->sd_spi, NULL, 0, &start, 1);
+    sdcard_get_bytes(sd, &start, 1);
     if (0xFE == start) break;
   }
   if (0 > tries) return false;
 
-  /* Read the bytes */
-  spi_tx_rx(sd->sd_spi, NULL, 0, buf, len);
-
-  /* Read the CRC */
-  spi_tx_rx(sd->sd_spi, NULL, 0, tmp, 2);
+  /* Read the bytes and the CRC */
+  const spi_seg_s segs[] = {
+    { NULL, buf, len },
+    { NULL, tmp, 2   },
+  };
+  spi_xfer_list(sd->sd_spi, segs, ARRAY_SIZE(segs));
   crc1 = (uint16_t)((tmp[0] << 8) | tmp[1]);
 
   /* Calculate CRC */
-  crc2 = crc16(buf, len);
+  crc2 = crc16(0, buf, len);
   if (crc1 != crc2) {
     sdcard_printf("sdcard: crc mismatch (%02X != %02X)\n", crc1, crc2);
     return false;
@@ -235,44 +279,23 @@ sdcard_get_data ( sdcard_s *sd, uint8_t *buf, size_t len )
 }
 
 /*
- * Put data
+ * Finish data block (send CRC and get the data response)
  */
 static bool
-sdcard_put_data ( sdcard_s *sd, const uint8_t *buf, size_t len )
+sdcard_put_end ( sdcard_s *sd, uint16_t crc )
 {
   int32_t  tries = SDCARD_RETRIES;
-  uint8_t  start = 0xFE;
   uint8_t  tmp[2];
-  uint16_t crc;
 
-  /* Calculate CRC */
-  crc = crc16(buf, len);
+  /* Send CRC, the data response follows immediately */
   tmp[0] = (uint8_t)((crc >> 8) & 0xFF);
   tmp[1] = (uint8_t)(crc & 0xFF);
-
-  /* Send start byte */
-  spi_tx_rx(sd->sd_spi, &start, 1, NULL, 0);
-
-  /* Send the data */
-  spi_tx_rx(sd->sd_spi, buf, len, NULL, 0);
-
-  /* Send CRC */
-  spi_tx_rx(sd->sd_spi, tmp, 2, NULL, 0);
+  spi_tx_rx(sd->sd_spi, tmp, 2, tmp, 1);
 
   /* Dummy read */
-  while (--tries) {
+  while ((0xFF == tmp[0]) && --tries)
     spi_tx_rx(sd->sd_spi, NULL, 0, tmp, 1);
-    if (0xFF != tmp[0]) break;
-  }
-  if (0 > tries) return false;
-
-  /* Poll for busy */
-  tries = 100000;
-  while (--tries) {
-    spi_tx_rx(sd->sd_spi, NULL, 0, tmp+1, 1);
-    if (0xFF == tmp[1]) break;
-  }
-  if (0 > tries) return false;
+  if (0 == tries) return false;
 
   /* OK */
   if ((tmp[0] & 0x1F) == 0x05) return true;
@@ -281,6 +304,23 @@ sdcard_put_data ( sdcard_s *sd, const uint8_t *buf, size_t len )
   return false;
 }
 
+/*
+ * Wait for the card to finish programming
+ */
+static bool
+sdcard_wait_busy ( sdcard_s *sd )
+{
+  uint32_t start = clock_ms();
+  uint8_t  b;
+
+  do {
+    spi_tx_rx(sd->sd_spi, NULL, 0, &b, 1);
+    if (0xFF == b) return true;
+  } while ((uint32_t)(clock_ms() - start) < SDCARD_BUSY_MS);
+
+  return false;
+}
+
 /* ****************************************************************************
  * Card Setup
  * ***************************************************************************/
@@ -340,15 +380,19 @@ sdcard_read_csd ( sdcard_s *sd )
   sdcard_cs(sd, true);
   if (!r) return false;
 
-  /* V1 */
+  /* V1: (C_SIZE+1) * 2^(C_SIZE_MULT+2) blocks of 2^READ_BL_LEN */
   if (1 == ((buf[0] >> 6) + 1)) {
     sd->sd_sectors = (size_t)((((buf[6] & 0x3) << 10)
                                  | (buf[7] << 2)
                                  |  (buf[8] >> 6)) + 1);
+    sd->sd_sectors <<= (((buf[9] & 0x3) << 1) | (buf[10] >> 7)) + 2
+                     + (buf[5] & 0xF) - 9;
+
+  /* V2: (C_SIZE+1) * 512KiB */
   } else {
-    sd->sd_sectors = (size_t)((buf[7] << 16)
-                               | (buf[8] <<  8)
-                               | buf[9]);
+    sd->sd_sectors = (size_t)((((buf[7] & 0x3F) << 16)
+                                | (buf[8] <<  8)
+                                |  buf[9]) + 1) * 1024;
     sd->sd_flags.f_sdhc = true;
     sdcard_printf("sdcard: card is SDHC\n");
   }
@@ -530,9 +574,12 @@ sdcard_read
   bool r;
 
   /* Validate */
-  if (sect >= sd->sd_sectors) return -1;
-  if (len > 512)              return -1;
-  
+  if (sd->sd_flags.f_write)    return -1;
+  if (sd->sd_flags.f_multi)    return -1;
+  if (sd->sd_flags.f_rd_multi) return -1;
+  if (sect >= sd->sd_sectors)  return -1;
+  if (len > 512)               return -1;
+
   sdcard_cs(sd, false);
   if (sd->sd_flags.f_sdhc)
     sdcard_cmd(sd, 17, sect);
@@ -552,38 +599,269 @@ sdcard_read
   return r ? (ssize_t)len : -1;
 }
 
+bool
+sdcard_read_multi ( sdcard_s *sd, size_t sect )
+{
+  uint8_t r1;
+
+  /* Validate */
+  if (sd->sd_flags.f_write || sd->sd_flags.f_multi) return false;
+  if (sd->sd_flags.f_rd_multi)                      return false;
+  if (sect >= sd->sd_sectors)                       return false;
+
+  sdcard_cs(sd, false);
+  if (sd->sd_flags.f_sdhc)
+    sdcard_cmd(sd, 18, sect);
+  else
+    sdcard_cmd(sd, 18, sect * 512);
+  r1 = sdcard_get_r1(sd);
+  if ((0xFF == r1) || (0xFE & r1)) {
+    sdcard_cs(sd, true);
+    return false;
+  }
+
+  sd->sd_flags.f_rd_multi = true;
+  sd->sd_rd_next          = sect;
+
+  return true;
+}
+
+bool
+sdcard_read_next ( sdcard_s *sd, uint8_t *buf )
+{
+  /* Validate */
+  if (!sd->sd_flags.f_rd_multi)        return false;
+  if (sd->sd_rd_next >= sd->sd_sectors) return false;
+
+  /* Read */
+  if (!sdcard_get_data(sd, buf, 512))  return false;
+  ++sd->sd_rd_next;
+
+  return true;
+}
+
+bool
+sdcard_read_stop ( sdcard_s *sd )
+{
+  uint8_t r1;
+  bool r;
+
+  /* Validate */
+  if (!sd->sd_flags.f_rd_multi) return true;
+
+  /* Stop transmission (the card stops sending data immediately) */
+  sdcard_cmd(sd, 12, 0);
+  sdcard_get_bytes(sd, &r1, 1); // stuff byte
+  r1 = sdcard_get_r1(sd);
+  r  = (0xFF != r1) && sdcard_wait_busy(sd);
+  sdcard_nec(sd);
+  sdcard_cs(sd, true);
+  sd->sd_flags.f_rd_multi = false;
+
+  return r;
+}
+
 ssize_t
 sdcard_write
   ( sdcard_s *sd, size_t sect, const uint8_t *buf, size_t len )
 {
+  /* Validate */
+  if (len > 512) return -1;
+
+  /* Write */
+  if (!sdcard_write_begin(sd, sect))                 return -1;
+  if ((ssize_t)len != sdcard_write_append(sd, buf, len)) {
+    sdcard_write_end(sd);
+    return -1;
+  }
+
+  return sdcard_write_end(sd) ? (ssize_t)len : -1;
+}
+
+bool
+sdcard_write_begin ( sdcard_s *sd, size_t sect )
+{
+  uint8_t token = 0xFE;
   uint8_t r1;
+
+  /* Validate */
+  if (sd->sd_flags.f_write)    return false;
+  if (sd->sd_flags.f_rd_multi) return false;
+  if (sect >= sd->sd_sectors)  return false;
+
+  /* Next block of a multi-block write */
+  if (sd->sd_flags.f_multi) {
+    if (sect != sd->sd_wr_next) return false;
+    if (sd->sd_flags.f_busy && !sdcard_wait_busy(sd)) return false;
+    sd->sd_flags.f_busy = false;
+    token = 0xFC;
+
+  /* Single block write */
+  } else {
+    sdcard_cs(sd, false);
+    if (sd->sd_flags.f_sdhc)
+      sdcard_cmd(sd, 24, sect);
+    else
+      sdcard_cmd(sd, 24, sect * 512);
+    r1 = sdcard_get_r1(sd);
+    if ((0xFF == r1) || (0xFE & r1)) {
+      sdcard_cs(sd, true);
+      return false;
+    }
+    sdcard_get_bytes(sd, &r1, 1); // dummy output
+  }
+
+  /* Send start token */
+  spi_tx_rx(sd->sd_spi, &token, 1, NULL, 0);
+  sd->sd_flags.f_write = true;
+  sd->sd_wr_len        = 0;
+  sd->sd_wr_crc        = 0;
+
+  return true;
+}
+
+ssize_t
+sdcard_write_append ( sdcard_s *sd, const uint8_t *buf, size_t len )
+{
+  /* Validate */
+  if (!sd->sd_flags.f_write)        return -1;
+  if (len > (512u - sd->sd_wr_len)) return -1;
+
+  /* Stream straight out */
+  if (!spi_tx_rx(sd->sd_spi, buf, len, NULL, 0)) return -1;
+  sd->sd_wr_crc  = crc16(sd->sd_wr_crc, buf, len);
+  sd->sd_wr_len  = (uint16_t)(sd->sd_wr_len + len);
+
+  return (ssize_t)len;
+}
+
+bool
+sdcard_write_end ( sdcard_s *sd )
+{
+  static const uint8_t zero[16] = { 0 };
+  size_t len;
   bool r;
 
   /* Validate */
-  if (sect >= sd->sd_sectors) return -1;
-  if (len  >  512)            return -1;
-  
+  if (!sd->sd_flags.f_write) return false;
+
+  /* Pad the sector */
+  while (sd->sd_wr_len < 512) {
+    len = 512u - sd->sd_wr_len;
+    if (len > sizeof(zero)) len = sizeof(zero);
+    sdcard_write_append(sd, zero, len);
+  }
+
+  /* Complete */
+  r = sdcard_put_end(sd, sd->sd_wr_crc);
+  sd->sd_flags.f_write = false;
+
+  /* Multi-block: leave the card programming, it's waited for at the start
+   * of the next block (or the stop) */
+  if (sd->sd_flags.f_multi) {
+    sd->sd_flags.f_busy = true;
+    ++sd->sd_wr_next;
+    return r;
+  }
+
+  if (!sdcard_wait_busy(sd)) r = false;
+  sdcard_nec(sd);
+  sdcard_cs(sd, true);
+
+  return r;
+}
+
+bool
+sdcard_write_multi ( sdcard_s *sd, size_t sect, size_t count )
+{
+  uint8_t r1;
+
+  /* Validate */
+  if (sd->sd_flags.f_write || sd->sd_flags.f_multi) return false;
+  if (sd->sd_flags.f_rd_multi)                      return false;
+  if (sect >= sd->sd_sectors)                       return false;
+
+  /* Pre-erase (this is only a hint, so failure is ignored) */
+  if (0 != count) {
+    if (count > 0x7FFFFF) count = 0x7FFFFF;
+    sdcard_cs(sd, false);
+    sdcard_cmd(sd, 55, 0);
+    r1 = sdcard_get_r1(sd);
+    sdcard_nec(sd);
+    sdcard_cs(sd, true);
+    if (0 == r1) {
+      sdcard_cs(sd, false);
+      sdcard_cmd(sd, 23, count);
+      r1 = sdcard_get_r1(sd);
+      sdcard_nec(sd);
+      sdcard_cs(sd, true);
+    }
+    if (0 != r1)
+      sdcard_printf("sdcard: pre-erase %lu failed (%02X)\n",
+                    (unsigned long)count, r1);
+  }
+
+  /* Start the write */
   sdcard_cs(sd, false);
   if (sd->sd_flags.f_sdhc)
-    sdcard_cmd(sd, 24, sect);
+    sdcard_cmd(sd, 25, sect);
   else
-    sdcard_cmd(sd, 24, sect * 512);
+    sdcard_cmd(sd, 25, sect * 512);
   r1 = sdcard_get_r1(sd);
   if ((0xFF == r1) || (0xFE & r1)) {
     sdcard_cs(sd, true);
-    return -1;
+    return false;
   }
+  sdcard_get_bytes(sd, &r1, 1); // dummy output
 
-  /* Read */
-  spi_tx_rx(sd->sd_spi, NULL, 0, &r1, 1); // dummy output
-  r = sdcard_put_data(sd, buf, len);
+  sd->sd_flags.f_multi = true;
+  sd->sd_flags.f_busy  = false;
+  sd->sd_wr_next       = sect;
+
+  return true;
+}
+
+bool
+sdcard_write_busy ( sdcard_s *sd )
+{
+  uint8_t b;
+
+  if (!sd->sd_flags.f_multi || !sd->sd_flags.f_busy) return false;
+  if (sd->sd_flags.f_write)                           return false;
+
+  spi_tx_rx(sd->sd_spi, NULL, 0, &b, 1);
+  if (0xFF != b) return true;
+  sd->sd_flags.f_busy = false;
+  return false;
+}
+
+bool
+sdcard_write_stop ( sdcard_s *sd )
+{
+  static const uint8_t stop = 0xFD;
+  uint8_t tmp;
+  bool r = true;
+
+  /* Validate */
+  if (!sd->sd_flags.f_multi) return true;
+
+  /* Complete partial block */
+  if (sd->sd_flags.f_write && !sdcard_write_end(sd)) r = false;
+
+  /* Wait for last block */
+  if (sd->sd_flags.f_busy && !sdcard_wait_busy(sd)) r = false;
+
+  /* Stop */
+  spi_tx_rx(sd->sd_spi, &stop, 1, &tmp, 1); // Nbr
+  if (!sdcard_wait_busy(sd)) r = false;
   sdcard_nec(sd);
   sdcard_cs(sd, true);
+  sd->sd_flags.f_multi = false;
+  sd->sd_flags.f_busy  = false;
 
-  return r ? (ssize_t)len : -1;
+  return r;
 }
 
-
 /* ****************************************************************************
  * Editor Configuration
  *
@@ -0,0 +1,337 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Storage - Track
+ *
+ * Records are coded straight into one of two sector buffers. Once the next
+ * record no longer fits that buffer is handed over and the other filled,
+ * while track_service() writes the completed one out (in one pf_write())
+ * as soon as the card has finished programming the previous sector. The
+ * card's busy periods (which can run to hundreds of ms) are never waited
+ * on, so GPS data keeps being taken in. If the card is slow enough for
+ * both buffers to fill, records are dropped and counted.
+ *
+ * The coder state is a few words per field, the sector buffers are the
+ * only real RAM cost.
+ *
+ * ***************************************************************************/
+
+#include "track.h"
+#include "pff.h"
+#include "diskio.h"
+#include "hal/clock.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * Longest wait for the card to finish a sector when closing (as
+ * SDCARD_BUSY_MS)
+ */
+#define TRACK_BUSY_MS (500)
+
+/* ****************************************************************************
+ * Encoding
+ * ***************************************************************************/
+
+static inline void
+track_put_u16 ( uint8_t *b, uint16_t v )
+{
+  b[0] = (uint8_t)v;
+  b[1] = (uint8_t)(v >> 8);
+}
+
+static inline void
+track_put_u32 ( uint8_t *b, uint32_t v )
+{
+  track_put_u16(b,     (uint16_t)v);
+  track_put_u16(b + 2, (uint16_t)(v >> 16));
+}
+
+static inline uint32_t
+track_zigzag ( int32_t v )
+{
+  return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline unsigned
+track_bitlen ( uint32_t v )
+{
+  return v ? (32u - (unsigned)__builtin_clz(v)) : 0;
+}
+
+/*
+ * Rice parameter for a field
+ */
+static inline unsigned
+track_rice_k ( const track_s *tr, int f )
+{
+  return track_bitlen(tr->tr_mean[f] >> 3);
+}
+
+/*
+ * Length of a code (bits)
+ */
+static inline unsigned
+track_rice_len ( uint32_t v, unsigned k )
+{
+  if ((v >> k) < TRACK_RICE_ESC) return (v >> k) + 1 + k;
+  return TRACK_RICE_ESC + 5 + track_bitlen(v);
+}
+
+/*
+ * Append n (<= 32) bits, MSB first (the sector is zeroed per frame)
+ */
+static void
+track_bits ( track_s *tr, uint32_t v, unsigned n )
+{
+  unsigned room, take;
+
+  while (n) {
+    room = 8 - (tr->tr_bits & 7);
+    take = (n < room) ? n : room;
+    tr->tr_sector[tr->tr_bits >> 3] |=
+      (uint8_t)(((v >> (n - take)) & ((1u << take) - 1)) << (room - take));
+    tr->tr_bits += (uint16_t)take;
+    n           -= take;
+  }
+}
+
+static void
+track_rice ( track_s *tr, int f, uint32_t v )
+{
+  unsigned k = track_rice_k(tr, f), n;
+  uint32_t q = v >> k;
+
+  if (q < TRACK_RICE_ESC) {
+    track_bits(tr, ((1u << q) - 1) << 1, q + 1);
+    if (k) track_bits(tr, v, k);
+  } else {
+    n = track_bitlen(v);
+    track_bits(tr, (1u << TRACK_RICE_ESC) - 1, TRACK_RICE_ESC);
+    track_bits(tr, n - 1, 5);
+    track_bits(tr, v, n);
+  }
+  tr->tr_mean[f] += ((v > 0xFFFF) ? 0xFFFF : v) - (tr->tr_mean[f] >> 3);
+}
+
+/*
+ * Fix time (UTC seconds)
+ */
+static uint32_t
+track_time ( const gps_fix_s *fix )
+{
+  struct tm tm = fix->fx_tm;
+  return (uint32_t)mktime(&tm);
+}
+
+/* ****************************************************************************
+ * Output
+ * ***************************************************************************/
+
+/*
+ * Fill buffer is complete
+ */
+static void
+track_close ( track_s *tr )
+{
+  track_put_u16(tr->tr_sector + tr->tr_frame, tr->tr_count);
+  tr->tr_closed = true;
+}
+
+/*
+ * Hand the (closed) fill buffer over for writing and start the next frame
+ *
+ * @return false if the other buffer has not been written yet
+ */
+static bool
+track_next ( track_s *tr )
+{
+  if (NULL != tr->tr_ready) return false;
+
+  tr->tr_ready  = tr->tr_sector;
+  tr->tr_sector = (tr->tr_sector == tr->tr_buf[0]) ? tr->tr_buf[1]
+                                                   : tr->tr_buf[0];
+  memset(tr->tr_sector, 0, TRACK_SECTOR);
+  tr->tr_frame  = 0;
+  tr->tr_bits   = 0;
+  tr->tr_count  = 0;
+  tr->tr_closed = false;
+  return true;
+}
+
+/*
+ * Write out the completed buffer
+ */
+static bool
+track_flush ( track_s *tr )
+{
+  UINT c;
+
+  if (FR_OK != pf_write(tr->tr_ready, TRACK_SECTOR, &c) ||
+      (TRACK_SECTOR != c))
+    tr->tr_full = true;
+  else
+    ++tr->tr_sectors;
+  tr->tr_ready = NULL;
+  return !tr->tr_full;
+}
+
+/*
+ * First record of a frame (stored as is)
+ */
+static void
+track_key ( track_s *tr, const int32_t *v )
+{
+  uint8_t *b = tr->tr_sector + tr->tr_frame;
+  int      f;
+
+  for (f = 0; f < TRACK_F_MAX; f++) {
+    track_put_u32(b + 2 + (f * 4), (uint32_t)v[f]);
+    tr->tr_delta[f] = 0;
+    tr->tr_mean[f]  = 0;
+  }
+  tr->tr_bits = (uint16_t)((tr->tr_frame + TRACK_FRAME_LEN) * 8);
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+track_begin ( track_s *tr, const gps_fix_s *fix )
+{
+  uint8_t *h = tr->tr_buf[0];
+
+  memset(tr, 0, sizeof(*tr));
+  tr->tr_base   = track_time(fix);
+  tr->tr_sector = h;
+
+  memcpy(h, TRACK_MAGIC, 4);
+  h[4] = TRACK_VERSION;
+  h[5] = TRACK_HDR_LEN;
+  track_put_u32(h + 8, tr->tr_base);
+  tr->tr_frame = TRACK_HDR_LEN;
+}
+
+bool
+track_add ( track_s *tr, const gps_fix_s *fix )
+{
+  int32_t  v[TRACK_F_MAX];
+  uint32_t z[TRACK_F_MAX];
+  unsigned bits;
+  int      f;
+
+  if (tr->tr_full) return false;
+
+  /* Time (duplicates and anything going backwards are dropped) */
+  v[TRACK_F_TIME] = (int32_t)((track_time(fix) - tr->tr_base) * 1000u +
+                              (uint32_t)fix->fx_ms);
+  v[TRACK_F_LAT]  = fix->fx_lat;
+  v[TRACK_F_LON]  = fix->fx_lon;
+  if (tr->tr_records && ((v[TRACK_F_TIME] - tr->tr_last[TRACK_F_TIME]) <= 0))
+    return true;
+
+  /* Prediction errors, and whether they fit */
+  if (tr->tr_count && !tr->tr_closed) {
+    bits = 0;
+    for (f = 0; f < TRACK_F_MAX; f++) {
+      z[f]  = track_zigzag(v[f] - tr->tr_last[f] - tr->tr_delta[f]);
+      bits += track_rice_len(z[f], track_rice_k(tr, f));
+    }
+    if ((tr->tr_bits + bits) > (TRACK_SECTOR * 8))
+      track_close(tr);
+  }
+
+  /* Both buffers full, the card has fallen behind */
+  if (tr->tr_closed && !track_next(tr)) {
+    ++tr->tr_dropped;
+    return true;
+  }
+
+  /* New frame */
+  if (0 == tr->tr_count) {
+    track_key(tr, v);
+
+  /* Code */
+  } else {
+    for (f = 0; f < TRACK_F_MAX; f++) {
+      track_rice(tr, f, z[f]);
+      tr->tr_delta[f] = v[f] - tr->tr_last[f];
+    }
+  }
+
+  for (f = 0; f < TRACK_F_MAX; f++)
+    tr->tr_last[f] = v[f];
+  ++tr->tr_count;
+  ++tr->tr_records;
+  return true;
+}
+
+bool
+track_service ( track_s *tr )
+{
+  if (tr->tr_full) return false;
+
+  /* Only once the card has finished with the last sector */
+  if ((NULL != tr->tr_ready) && !disk_busy())
+    if (!track_flush(tr)) return false;
+
+  /* Records were being dropped, start filling again */
+  if (tr->tr_closed) track_next(tr);
+
+  return true;
+}
+
+bool
+track_end ( track_s *tr )
+{
+  UINT     c;
+  uint32_t start = clock_ms();
+
+  /* Let the card finish the last sector (there's no more data to lose) */
+  while (disk_busy()) {
+    if ((uint32_t)(clock_ms() - start) >= TRACK_BUSY_MS) {
+      tr->tr_full = true;
+      break;
+    }
+  }
+
+  if ((NULL != tr->tr_ready) && !tr->tr_full)
+    track_flush(tr);
+  if (tr->tr_count && !tr->tr_full) {
+    if (!tr->tr_closed) track_close(tr);
+    track_next(tr);
+    track_flush(tr);
+  }
+  pf_write(NULL, 0, &c);
+  return !tr->tr_full;
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
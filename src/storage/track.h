@@ -0,0 +1,166 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Storage - Track
+ *
+ * Compressed binary track, written a sector at a time.
+ *
+ * File layout (version 2, all values little endian):
+ *
+ *   header  "ABCT"        magic
+ *           u8            version (TRACK_VERSION)
+ *           u8            header length (TRACK_HDR_LEN)
+ *           u16           reserved (0)
+ *           u32           epoch base (UTC seconds since 1970)
+ *
+ * followed by one frame per 512 byte sector (in the first sector it starts
+ * after the header). Frames stand alone, so a damaged or truncated sector
+ * only loses its own records:
+ *
+ *   frame   u16           records in the frame (0 = end of track)
+ *           u32           time of the first record (ms since epoch base)
+ *           i32           latitude  of the first record (1e-7 degrees)
+ *           i32           longitude of the first record (1e-7 degrees)
+ *           bits          the remaining records
+ *
+ * Each further record is its time, latitude and longitude as the error
+ * against a prediction: the previous interval and the previous movement
+ * (i.e. constant speed and heading, both zero for the second record of a
+ * frame). Errors are zigzag encoded and Rice coded, MSB first:
+ *
+ *   q = v >> k, q < 12    q one bits, a zero bit, then the low k bits of v
+ *   otherwise             12 one bits, 5 bits (n - 1), then v in n bits
+ *
+ * k is adapted per field, from a running mean m (reset to 0 per frame):
+ * k is the bit length of (m >> 3) and each value updates m to
+ * m - (m >> 3) + min(v, 0xFFFF).
+ *
+ * Version 1 (uncompressed LEB128 varint deltas) is still read by the host
+ * tools.
+ *
+ * ***************************************************************************/
+
+#ifndef ABC_STORAGE_TRACK_H
+#define ABC_STORAGE_TRACK_H
+
+#include "sensors/gps/gps.h"
+
+#define TRACK_MAGIC       "ABCT"
+#define TRACK_VERSION     (2)
+#define TRACK_HDR_LEN     (12)
+#define TRACK_SECTOR      (512)
+#define TRACK_FRAME_LEN   (14)
+
+/*
+ * Rice coding
+ */
+#define TRACK_RICE_ESC    (12)          /**< Quotient that escapes */
+#define TRACK_RICE_MAX    (TRACK_RICE_ESC + 5 + 32) /**< Longest code (bits) */
+
+/*
+ * Fields coded per record
+ */
+enum {
+  TRACK_F_TIME,
+  TRACK_F_LAT,
+  TRACK_F_LON,
+  TRACK_F_MAX
+};
+
+/*
+ * Structure used to represent an open track
+ */
+typedef struct track
+{
+  uint32_t tr_base;                     /**< Epoch base (UTC seconds) */
+  int32_t  tr_last[TRACK_F_MAX];        /**< Last record (ms, lat, lon) */
+  int32_t  tr_delta[TRACK_F_MAX];       /**< Last change (prediction) */
+  uint32_t tr_mean[TRACK_F_MAX];        /**< Rice parameter mean (x8) */
+  uint32_t tr_records;                  /**< Records coded */
+  uint32_t tr_dropped;                  /**< Records lost (no buffer) */
+  uint32_t tr_sectors;                  /**< Sectors written */
+  uint16_t tr_count;                    /**< Records in the current frame */
+  uint16_t tr_frame;                    /**< Frame offset in tr_sector */
+  uint16_t tr_bits;                     /**< Bits used in tr_sector */
+  bool     tr_closed;                   /**< tr_sector is complete */
+  bool     tr_full;                     /**< File is full (or failed) */
+  uint8_t *tr_sector;                   /**< Sector being filled */
+  uint8_t *tr_ready;                    /**< Sector waiting to be written */
+  uint8_t  tr_buf[2][TRACK_SECTOR];     /**< Sector buffers */
+} track_s;
+
+/**
+ * Start a new track (the file must already be open with pf_open())
+ *
+ * @param tr  The track
+ * @param fix The first fix (used for the epoch base)
+ */
+void track_begin   ( track_s *tr, const gps_fix_s *fix );
+
+/**
+ * Append a fix
+ *
+ * This never touches the card. Fixes that are not after the last one
+ * recorded are dropped, as are any that arrive while both sector buffers
+ * are waiting for the card (see tr_dropped).
+ *
+ * @return false if the file is full (or could not be written)
+ */
+bool track_add     ( track_s *tr, const gps_fix_s *fix );
+
+/**
+ * Write out a completed sector, if the card is ready for it
+ *
+ * To be called while track_pending(), when there is nothing else to do.
+ * It never waits for the card to finish programming, only for the sector
+ * transfer itself.
+ *
+ * @return false if the file is full (or could not be written)
+ */
+bool track_service ( track_s *tr );
+
+/**
+ * Is there a sector for track_service() to write
+ */
+static inline bool
+track_pending ( const track_s *tr )
+{
+  return (NULL != tr->tr_ready) || tr->tr_closed;
+}
+
+/**
+ * Write out everything (waiting for the card) and finish
+ *
+ * @return false if the file could not be written
+ */
+bool track_end     ( track_s *tr );
+
+#endif /* ABC_STORAGE_TRACK_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,272 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Disciplined timebase
+ *
+ * See timebase.h
+ * ***************************************************************************/
+
+#include "timebase.h"
+#include "hal/clock.h"
+#include "hal/cpu.h"
+#include "hal/pps.h"
+#include "hal/trace.h"
+
+/*
+ * Nominal second (us) and the rate fraction bits
+ */
+#define TB_SEC      (1000000u)
+#define TB_Q        (8)
+#define TB_SCALE_Q  (24)
+
+/*
+ * Rebase once the reference is this old (well inside the clock_us() wrap)
+ */
+#define TB_REBASE   (1u << 30)
+
+/* ****************************************************************************
+ * Module data (shared with the PPS interrupt, see tb_lock())
+ * ***************************************************************************/
+
+static uint32_t         tb_raw;         /**< Reference (clock_us) */
+static uint64_t         tb_ref;         /**< Reference (timebase) */
+static uint32_t         tb_scale;       /**< Timebase us per clock us (Q24) */
+static uint32_t         tb_period;      /**< Clock us per second (Q8) */
+static uint64_t         tb_last;        /**< Latest returned */
+static bool             tb_edge_ok;     /**< tb_edge is valid */
+static uint32_t         tb_edge_raw;    /**< Last edge (clock_us) */
+static uint64_t         tb_edge;        /**< Last edge (timebase) */
+static uint32_t         tb_seconds;     /**< Seconds measured since restart */
+static timebase_stats_s tb_st;
+
+/* ****************************************************************************
+ * Internals
+ * ***************************************************************************/
+
+/*
+ * Interrupts off/on (the PPS interrupt updates the reference)
+ */
+static inline void tb_lock   ( void ) { cpu_irq_disable(); }
+static inline void tb_unlock ( void ) { cpu_irq_enable();  }
+
+/*
+ * Convert, relative to the reference (locked)
+ */
+static uint64_t
+tb_at ( uint32_t us )
+{
+  int32_t d = (int32_t)(us - tb_raw);
+
+  if (d >= 0)
+    return tb_ref + (((uint64_t)(uint32_t)d * tb_scale) >> TB_SCALE_Q);
+  return tb_ref - (((uint64_t)(uint32_t)-d * tb_scale) >> TB_SCALE_Q);
+}
+
+/*
+ * Move the reference (locked)
+ */
+static void
+tb_rebase ( uint32_t us, uint64_t t )
+{
+  tb_raw = us;
+  tb_ref = t;
+}
+
+/*
+ * PPS edge (under interrupt)
+ */
+static void
+tb_pps ( uint32_t us, bool exact )
+{
+  uint32_t d, n, err, p;
+  uint64_t t, now;
+
+  if (!exact) return;
+
+  /* First edge (or restart), measure from here */
+  now = tb_at(us);
+  if (!tb_edge_ok) {
+    tb_edge_ok  = true;
+    tb_edge_raw = us;
+    tb_edge     = now;
+    tb_rebase(us, now);
+    return;
+  }
+
+  /* Whole seconds since the last edge, and how far out it is */
+  d = us - tb_edge_raw;
+  n = (d + TB_SEC / 2) / TB_SEC;
+  p = (uint32_t)(((uint64_t)d << TB_Q) / (n ? n : 1));
+  err = (p > tb_period) ? p - tb_period : tb_period - p;
+  err >>= TB_Q;
+  if ((0 == n) || (err > TIMEBASE_TOL_US)) {
+    ++tb_st.tb_rejected;
+    tb_seconds  = 0;
+    tb_edge_raw = us;
+    tb_edge     = now;
+    tb_rebase(us, now);
+    return;
+  }
+
+  /* Rate (the first second sets it, then a running average) */
+  if (0 == tb_seconds)
+    tb_period = p;
+  else
+    tb_period = (uint32_t)((int32_t)tb_period +
+                           ((int32_t)(p - tb_period) / 8));
+  tb_scale = (uint32_t)(((uint64_t)TB_SEC << (TB_Q + TB_SCALE_Q)) /
+                        tb_period);
+  if (tb_seconds && (err > tb_st.tb_jitter_max)) tb_st.tb_jitter_max = err;
+  tb_seconds += n;
+
+  /* Exactly n seconds on from the last edge */
+  t   = tb_edge + (uint64_t)n * TB_SEC;
+  err = (uint32_t)((t > now) ? t - now : now - t);
+  if (err > tb_st.tb_step_max) tb_st.tb_step_max = err;
+  ++tb_st.tb_edges;
+  tb_edge_raw = us;
+  tb_edge     = t;
+  tb_rebase(us, t);
+}
+
+/* ****************************************************************************
+ * Public Interface
+ * ***************************************************************************/
+
+void
+timebase_init ( void )
+{
+  tb_period = TB_SEC << TB_Q;
+  tb_scale  = 1u << TB_SCALE_Q;
+  tb_rebase(clock_us(), 0);
+  pps_add_callback(tb_pps);
+}
+
+uint64_t
+timebase_us ( void )
+{
+  uint32_t us;
+  uint64_t t;
+
+  tb_lock();
+  us = clock_us();
+  t  = tb_at(us);
+  if ((us - tb_raw) >= TB_REBASE) tb_rebase(us, t);
+  if (t < tb_last) t = tb_last;
+  tb_last = t;
+  tb_unlock();
+
+  return t;
+}
+
+uint64_t
+timebase_at ( uint32_t us )
+{
+  uint64_t t;
+
+  tb_lock();
+  t = tb_at(us);
+  tb_unlock();
+
+  return t;
+}
+
+uint64_t
+timebase_utc ( int32_t ms )
+{
+  uint64_t now = timebase_us(), t;
+  bool     ok;
+
+  tb_lock();
+  ok = tb_edge_ok && (0 != tb_seconds);
+  t  = tb_edge + (uint64_t)ms * 1000;
+  tb_unlock();
+  if (!ok) return now;
+
+  /* Most recent second it could be in */
+  if (t > now)
+    t -= ((t - now + TB_SEC - 1) / TB_SEC) * TB_SEC;
+  else
+    t += ((now - t) / TB_SEC) * TB_SEC;
+
+  return t;
+}
+
+uint64_t
+timebase_pps_next ( void )
+{
+  uint64_t now = timebase_us(), t;
+  bool     ok;
+
+  tb_lock();
+  ok = tb_edge_ok && (0 != tb_seconds);
+  t  = tb_edge;
+  tb_unlock();
+  if (!ok) return 0;
+
+  if (t > now) return t;
+  return t + ((now - t) / TB_SEC + 1) * TB_SEC;
+}
+
+bool
+timebase_locked ( void )
+{
+  return tb_edge_ok && (0 != tb_seconds);
+}
+
+void
+timebase_stats ( timebase_stats_s *st )
+{
+  tb_lock();
+  *st        = tb_st;
+  st->tb_ppb = (int32_t)(((int64_t)tb_period - ((int64_t)TB_SEC << TB_Q)) *
+                         1000 >> TB_Q);
+  tb_unlock();
+}
+
+void
+timebase_report ( void )
+{
+  timebase_stats_s st;
+  uint32_t         exact, edges = pps_count(&exact), ppb;
+
+  timebase_stats(&st);
+  ppb = (st.tb_ppb < 0) ? -st.tb_ppb : st.tb_ppb;
+  trace_printf("timebase: %s, %lu pps (%lu captured, %lu used, %lu "
+               "rejected)\n", timebase_locked() ? "locked" : "free running",
+               (unsigned long)edges, (unsigned long)exact,
+               (unsigned long)st.tb_edges, (unsigned long)st.tb_rejected);
+  trace_printf("timebase: crystal %c%lu.%03lu ppm, jitter max %luus, "
+               "step max %luus\n", (st.tb_ppb < 0) ? '-' : '+',
+               (unsigned long)(ppb / 1000), (unsigned long)(ppb % 1000),
+               (unsigned long)st.tb_jitter_max,
+               (unsigned long)st.tb_step_max);
+}
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/
@@ -0,0 +1,124 @@
+/* ****************************************************************************
+ *
+ * Copyright (C) 2017 Adam Sutton
+ *
+ * This file is part of ApsBikeComp (ABC)
+ *
+ * ApsBikeComp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * ApsBikeComp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ApsBikeComp.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * For more details, including opportunities for alternative licensing,
+ * please read the LICENSE file.
+ *
+ * ***************************************************************************/
+
+/* ****************************************************************************
+ * Disciplined timebase
+ *
+ * clock_us() runs off the MCU crystal, tens of ppm out, and wraps every
+ * ~71 minutes. The timebase extends it to 64 bits and, once PPS edges
+ * arrive, steers it to advance exactly a second from each edge to the
+ * next: the crystal's rate is measured over every second (and averaged)
+ * and the time is rebased at each edge. So the edges are whole seconds
+ * apart and anything in between is interpolated at the measured rate.
+ *
+ * Edges are checked against that rate, one that is out by more than
+ * TIMEBASE_TOL_US (per second) is ignored and restarts the measurement.
+ * Edges that were not captured by hardware (see hal/pps.h) are not used.
+ *
+ * The time never goes backwards: if an edge arrives early it jumps
+ * forward, if late it holds until it catches up.
+ * ***************************************************************************/
+
+#ifndef ABC_TIMEBASE_H
+#define ABC_TIMEBASE_H
+
+#include "types.h"
+
+/**
+ * Largest error (us per second) in an edge before it is rejected
+ */
+#define TIMEBASE_TOL_US (500)
+
+/**
+ * Statistics
+ */
+typedef struct timebase_stats
+{
+  uint32_t tb_edges;                    /**< Edges used */
+  uint32_t tb_rejected;                 /**< Edges out of tolerance */
+  int32_t  tb_ppb;                      /**< Crystal error (ppb, + is fast) */
+  uint32_t tb_jitter_max;               /**< Largest error in an edge (us) */
+  uint32_t tb_step_max;                 /**< Largest correction (us) */
+} timebase_stats_s;
+
+/**
+ * Initialise (listen to PPS, after pps_init())
+ */
+void     timebase_init   ( void );
+
+/**
+ * Get the time (task context, as the rest)
+ *
+ * @return Microseconds since timebase_init()
+ */
+uint64_t timebase_us     ( void );
+
+/**
+ * Convert a clock_us() time (within the last half hour or so)
+ */
+uint64_t timebase_at     ( uint32_t us );
+
+/**
+ * Get the time of a GPS solution
+ *
+ * PPS edges are the start of UTC seconds, so a solution ms into a second
+ * was valid ms after the most recent edge that is not after it (the
+ * solution always arrives after it was valid).
+ *
+ * @param ms Milliseconds into the UTC second (fx_ms)
+ *
+ * @return Time of validity (timebase_us()), or the time now if there are
+ *         no edges to go by
+ */
+uint64_t timebase_utc    ( int32_t ms );
+
+/**
+ * Get the time the next PPS edge is expected
+ *
+ * @return The time (timebase_us()), or 0 if not locked
+ */
+uint64_t timebase_pps_next ( void );
+
+/**
+ * Is time steered by PPS
+ */
+bool     timebase_locked ( void );
+
+/**
+ * Get the statistics
+ */
+void     timebase_stats  ( timebase_stats_s *st );
+
+/**
+ * Trace the statistics
+ */
+void     timebase_report ( void );
+
+#endif /* ABC_TIMEBASE_H */
+
+/* ****************************************************************************
+ * Editor Configuration
+ *
+ * vim:sts=2:ts=2:sw=2:et
+ * ***************************************************************************/